@@ -2,14 +2,28 @@
 # Automatically-generated file. Do not edit or delete the file
 ################################################################################
 
+arena.cpp
+
+bufferstate.cpp
+
+diskformat.cpp
+
 diskmenu.cpp
 
 floppyemu.cpp
 
+gcr.cpp
+
+handshakestats.cpp
+
 millitimer.cpp
 
 noklcd.cpp
 
+scheduler.cpp
+
+tach.cpp
+
 SdFat\Sd2Card.cpp
 
 SdFat\SdBaseFile.cpp
@@ -105,23 +105,16 @@ bool SdBaseFile::close() {
  * or an I/O error occurred.
  */
 bool SdBaseFile::contiguousRange(uint32_t* bgnBlock, uint32_t* endBlock) {
+  uint32_t c;
   // error if no blocks
   if (firstCluster_ == 0) goto fail;
 
-  for (uint32_t c = firstCluster_; ; c++) {
-    uint32_t next;
-    if (!vol_->fatGet(c, &next)) goto fail;
-
-    // check for contiguous
-    if (next != (c + 1)) {
-      // error if not end of chain
-      if (!vol_->isEOC(next)) goto fail;
-      *bgnBlock = vol_->clusterStartBlock(firstCluster_);
-      *endBlock = vol_->clusterStartBlock(c)
-                  + vol_->blocksPerCluster_ - 1;
-      return true;
-    }
-  }
+  // scan the chain a FAT block at a time
+  if (!vol_->chainContiguousEnd(firstCluster_, &c)) goto fail;
+  *bgnBlock = vol_->clusterStartBlock(firstCluster_);
+  *endBlock = vol_->clusterStartBlock(c)
+              + vol_->blocksPerCluster_ - 1;
+  return true;
 
  fail:
   return false;
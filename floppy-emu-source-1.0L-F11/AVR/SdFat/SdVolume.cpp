@@ -134,6 +134,72 @@ bool SdVolume::cacheRawBlock(uint32_t blockNumber, bool dirty) {
   return false;
 }
 //------------------------------------------------------------------------------
+// Follow a chain of consecutive clusters starting at cluster. Each FAT block
+// is cached once and its entries are compared in a tight loop, rather than
+// going through fatGet() for every cluster. On success lastCluster is the
+// final cluster of the chain. Fails if the chain is not contiguous.
+bool SdVolume::chainContiguousEnd(uint32_t cluster, uint32_t* lastCluster) {
+  uint32_t fatEnd = clusterCount_ + 1;
+  uint32_t next;
+
+  if (FAT12_SUPPORT && fatType_ == 12) {
+    // FAT12 entries straddle blocks, fall back to one lookup per cluster
+    for (;; cluster++) {
+      if (!fatGet(cluster, &next)) goto fail;
+      if (next != (cluster + 1)) break;
+    }
+  } else if (fatType_ == 16) {
+    for (;;) {
+      if (cluster > fatEnd) goto fail;
+      if (!cacheRawBlock(fatStartBlock_ + (cluster >> 8), CACHE_FOR_READ)) {
+        goto fail;
+      }
+      uint16_t* p = &cacheBuffer_.fat16[cluster & 0XFF];
+      uint16_t* pEnd = &cacheBuffer_.fat16[256];
+      uint16_t want = cluster + 1;
+      while (p != pEnd && *p == want) {
+        p++;
+        want++;
+      }
+      cluster = want - 1;
+      if (p != pEnd) {
+        next = *p;
+        break;
+      }
+      // the run continues into the next FAT block, at cluster
+    }
+  } else if (fatType_ == 32) {
+    for (;;) {
+      if (cluster > fatEnd) goto fail;
+      if (!cacheRawBlock(fatStartBlock_ + (cluster >> 7), CACHE_FOR_READ)) {
+        goto fail;
+      }
+      uint32_t* p = &cacheBuffer_.fat32[cluster & 0X7F];
+      uint32_t* pEnd = &cacheBuffer_.fat32[128];
+      uint32_t want = cluster + 1;
+      while (p != pEnd && (*p & FAT32MASK) == want) {
+        p++;
+        want++;
+      }
+      cluster = want - 1;
+      if (p != pEnd) {
+        next = *p & FAT32MASK;
+        break;
+      }
+      // the run continues into the next FAT block, at cluster
+    }
+  } else {
+    goto fail;
+  }
+  // error if not end of chain
+  if (cluster > fatEnd || !isEOC(next)) goto fail;
+  *lastCluster = cluster;
+  return true;
+
+ fail:
+  return false;
+}
+//------------------------------------------------------------------------------
 // return the size in bytes of a cluster chain
 bool SdVolume::chainSize(uint32_t cluster, uint32_t* size) {
   uint32_t s = 0;
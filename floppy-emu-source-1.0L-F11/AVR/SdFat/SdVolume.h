@@ -172,6 +172,7 @@ class SdVolume {
     cacheBlockNumber_  = blockNumber;
   }
   void cacheSetDirty() {cacheDirty_ |= CACHE_FOR_WRITE;}
+  bool chainContiguousEnd(uint32_t cluster, uint32_t* lastCluster);
   bool chainSize(uint32_t beginCluster, uint32_t* size);
   bool fatGet(uint32_t cluster, uint32_t* value);
   bool fatPut(uint32_t cluster, uint32_t value);
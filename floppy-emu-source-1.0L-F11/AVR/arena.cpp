@@ -0,0 +1,106 @@
+/* 
+    Floppy Emu, copyright 2013 Steve Chamberlin, "Big Mess o' Wires". All rights reserved.
+	
+    Floppy Emu is licensed under a Creative Commons Attribution-NonCommercial 3.0 Unported 
+	license. (CC BY-NC 3.0) The terms of the license may be viewed at 	
+	http://creativecommons.org/licenses/by-nc/3.0/
+	
+	Based on a work at http://www.bigmessowires.com/macintosh-floppy-emu/
+	
+    Permissions beyond the scope of this license may be available at www.bigmessowires.com
+	or from mailto:steve@bigmessowires.com.
+*/
+
+#include "arena.h"
+
+uint8_t sectorBuf[NUM_BUFFERS][BUFFER_SIZE];
+
+static uint8_t bufferOwner[NUM_BUFFERS];
+
+uint8_t ArenaAlloc(uint8_t owner, uint8_t minCount, uint8_t maxCount, uint8_t* pCount)
+{
+	uint8_t bestStart = ARENA_NONE, bestLen = 0;
+	uint8_t i = 0;
+	
+	while (i < NUM_BUFFERS)
+	{
+		// find the next run of free buffers
+		if (bufferOwner[i] != ARENA_FREE)
+		{
+			i++;
+			continue;
+		}
+		
+		uint8_t start = i;
+		while (i < NUM_BUFFERS && bufferOwner[i] == ARENA_FREE)
+			i++;
+		uint8_t len = i - start;
+		
+		if (len > bestLen)
+		{
+			bestStart = start;
+			bestLen = len;
+			
+			if (len >= maxCount)
+				break;
+		}
+	}
+	
+	if (bestLen < minCount || bestLen == 0)
+	{
+		*pCount = 0;
+		return ARENA_NONE;
+	}
+		
+	if (bestLen > maxCount)
+		bestLen = maxCount;
+		
+	for (i=bestStart; i<bestStart+bestLen; i++)
+		bufferOwner[i] = owner;
+		
+	*pCount = bestLen;
+	return bestStart;
+}
+
+uint8_t ArenaResize(uint8_t owner, uint8_t firstBuffer, uint8_t count, uint8_t newCount)
+{
+	// release buffers from the end
+	while (count > newCount)
+	{
+		count--;
+		bufferOwner[firstBuffer+count] = ARENA_FREE;
+	}
+	
+	// claim free buffers following the allocation
+	while (count < newCount && 
+		   firstBuffer+count < NUM_BUFFERS && 
+		   bufferOwner[firstBuffer+count] == ARENA_FREE)
+	{
+		bufferOwner[firstBuffer+count] = owner;
+		count++;
+	}
+	
+	return count;
+}
+
+void ArenaFree(uint8_t owner)
+{
+	for (uint8_t i=0; i<NUM_BUFFERS; i++)
+	{
+		if (bufferOwner[i] == owner)
+			bufferOwner[i] = ARENA_FREE;
+	}
+}
+
+uint8_t ArenaFreeCount()
+{
+	uint8_t count = 0;
+	
+	for (uint8_t i=0; i<NUM_BUFFERS; i++)
+	{
+		if (bufferOwner[i] == ARENA_FREE)
+			count++;
+	}
+	
+	return count;
+}
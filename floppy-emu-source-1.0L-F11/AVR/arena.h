@@ -0,0 +1,53 @@
+/* 
+    Floppy Emu, copyright 2013 Steve Chamberlin, "Big Mess o' Wires". All rights reserved.
+	
+    Floppy Emu is licensed under a Creative Commons Attribution-NonCommercial 3.0 Unported 
+	license. (CC BY-NC 3.0) The terms of the license may be viewed at 	
+	http://creativecommons.org/licenses/by-nc/3.0/
+	
+	Based on a work at http://www.bigmessowires.com/macintosh-floppy-emu/
+	
+    Permissions beyond the scope of this license may be available at www.bigmessowires.com
+	or from mailto:steve@bigmessowires.com.
+*/
+
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <inttypes.h>
+
+// The sector buffers are shared by the drive's track cache, the disk menu's file list, and
+// short-lived scratch users like the firmware updater. Every buffer has an owner, and each
+// allocation is a contiguous run of buffers, so a track cache can be indexed directly.
+// Allocations are only made and freed from the main loop, never from an interrupt routine.
+
+#define NUM_BUFFERS 24
+#define BUFFER_SIZE 512
+
+#define ARENA_NONE 0xFF
+
+typedef enum {
+	ARENA_FREE = 0,
+	ARENA_MENU,		// disk menu file list, while the menu is shown
+	ARENA_SCRATCH,	// temporary buffer, freed before returning to the main loop
+	ARENA_STAGING,	// write staging slots, while a disk is inserted (see bufferstate.h)
+	ARENA_DRIVE		// the drive's track cache, while a disk is inserted
+} eArenaOwner;
+
+extern uint8_t sectorBuf[NUM_BUFFERS][BUFFER_SIZE];
+
+// Allocate between minCount and maxCount contiguous buffers, preferring the first free run that can hold
+// maxCount, else the longest free run. Returns the first buffer number and stores the number of buffers
+// in *pCount, or returns ARENA_NONE if there's no free run of minCount buffers.
+uint8_t ArenaAlloc(uint8_t owner, uint8_t minCount, uint8_t maxCount, uint8_t* pCount);
+
+// Grow or shrink an allocation in place, keeping its first buffer. Returns the new number of buffers,
+// which is less than newCount if the buffers following the allocation aren't free.
+uint8_t ArenaResize(uint8_t owner, uint8_t firstBuffer, uint8_t count, uint8_t newCount);
+
+// Free every buffer belonging to this owner.
+void ArenaFree(uint8_t owner);
+
+uint8_t ArenaFreeCount();
+
+#endif /* ARENA_H_ */
@@ -0,0 +1,58 @@
+/* 
+    Floppy Emu, copyright 2013 Steve Chamberlin, "Big Mess o' Wires". All rights reserved.
+	
+    Floppy Emu is licensed under a Creative Commons Attribution-NonCommercial 3.0 Unported 
+	license. (CC BY-NC 3.0) The terms of the license may be viewed at 	
+	http://creativecommons.org/licenses/by-nc/3.0/
+	
+	Based on a work at http://www.bigmessowires.com/macintosh-floppy-emu/
+	
+    Permissions beyond the scope of this license may be available at www.bigmessowires.com
+	or from mailto:steve@bigmessowires.com.
+*/
+
+#include "bufferstate.h"
+
+volatile uint8_t bufferWriting = BUFFER_NONE;
+volatile uint8_t bufferWriteGen[NUM_BUFFERS];
+volatile uint8_t bufferClaimed[NUM_BUFFERS];
+volatile uint8_t bufferSavedGen[NUM_BUFFERS];
+volatile uint8_t bufferSector[NUM_BUFFERS];
+volatile uint8_t bufferValid[NUM_BUFFERS];
+
+volatile uint8_t stageHead;
+volatile uint8_t stageTail;
+volatile uint8_t stageTrack[STAGE_SLOTS];
+volatile uint8_t stageSector[STAGE_SLOTS];
+volatile uint8_t stageFirstBuffer = ARENA_NONE;
+volatile uint8_t stageSlots;
+
+void BufferReset(uint8_t bufferNumber)
+{
+	if (bufferWriting == bufferNumber)
+		bufferWriting = BUFFER_NONE;
+		
+	bufferWriteGen[bufferNumber] = 0;
+	bufferClaimed[bufferNumber] = 0;
+	bufferSavedGen[bufferNumber] = 0;
+	bufferValid[bufferNumber] = 0;
+}
+
+void BufferStateReset()
+{
+	for (uint8_t i=0; i<NUM_BUFFERS; i++)
+		BufferReset(i);
+		
+	bufferWriting = BUFFER_NONE;
+	stageHead = 0;
+	stageTail = 0;
+}
+
+void BufferSetStaging(uint8_t firstBuffer)
+{
+	// the write routines check stageSlots before using stageFirstBuffer
+	stageSlots = 0;
+	stageFirstBuffer = firstBuffer;
+	if (firstBuffer != ARENA_NONE)
+		stageSlots = STAGE_SLOTS;
+}
@@ -0,0 +1,242 @@
+/* 
+    Floppy Emu, copyright 2013 Steve Chamberlin, "Big Mess o' Wires". All rights reserved.
+	
+    Floppy Emu is licensed under a Creative Commons Attribution-NonCommercial 3.0 Unported 
+	license. (CC BY-NC 3.0) The terms of the license may be viewed at 	
+	http://creativecommons.org/licenses/by-nc/3.0/
+	
+	Based on a work at http://www.bigmessowires.com/macintosh-floppy-emu/
+	
+    Permissions beyond the scope of this license may be available at www.bigmessowires.com
+	or from mailto:steve@bigmessowires.com.
+*/
+
+#ifndef BUFFERSTATE_H_
+#define BUFFERSTATE_H_
+
+#include <inttypes.h>
+#include "arena.h"
+
+// The ownership protocol for the drive's track cache buffers, shared by the write interrupt routines and the
+// main loop without disabling interrupts. Every variable has a single writer:
+//
+//   bufferWriting                  interrupt routines: the buffer the Mac is writing, BUFFER_NONE if none
+//   bufferWriteGen[n]              interrupt routines: counts the sector writes completed into buffer n
+//   bufferClaimed[n]               main loop: it's reading buffer n from the SD card, or saving it
+//   bufferSavedGen[n]              main loop: bufferWriteGen[n] when buffer n last matched the SD card
+//   bufferSector[n], bufferValid[n]
+//                                  whichever side owns buffer n
+//
+// 1. A side owns a buffer while it holds its claim. The interrupt routines claim with BufferBeginWrite(), which
+//    checks bufferClaimed[n] and sets bufferWriting, and the main loop can't run in between. The main loop claims
+//    with BufferClaim(), which sets bufferClaimed[n] first and then backs off if bufferWriting is n. Either the
+//    interrupt routines claimed before that store and the main loop sees it, or after and they see the main
+//    loop's claim, so at most one side owns a buffer. Single byte loads and stores are atomic on the AVR.
+// 2. A buffer is dirty, holding a sector that isn't on the SD card yet, while its two generations differ. Each
+//    side only changes its own generation, and only while it owns the buffer, so the main loop marks a buffer
+//    clean by copying bufferWriteGen while it holds the claim, and a write can't slip in between.
+// 3. A dirty buffer is valid unless it's being written, and the interrupt routines never start writing one
+//    sector into a dirty buffer holding another, so an unsaved sector can't be lost. An aborted write leaves
+//    the buffer clean and invalid, so the torn sector is read back from the SD card instead of saved, and the
+//    Mac writes it again.
+// 4. Between a step and the main loop switching the buffers to the new track, the interrupt routines don't
+//    write to the track cache. The main loop claims and invalidates each buffer, and only then sets prevTrack
+//    to the new track, which lets the interrupt routines write to the cache again.
+//
+// A write that can't go to its cache buffer right now is staged instead, in a small ring of buffers of its own,
+// so the Mac isn't refused while the main loop is busy with the buffer:
+//
+//   stageHead, stageTrack[k], stageSector[k]
+//                                  interrupt routines: count of staged writes completed, and where slot k goes
+//   stageTail                      main loop: count of staged writes merged
+//   stageFirstBuffer, stageSlots   main loop, while nothing is staged: the ring's buffers, 0 or STAGE_SLOTS
+//
+// 5. Slots between stageTail and stageHead belong to the main loop, the rest to the interrupt routines. A slot
+//    is published by incrementing stageHead after its data and destination are complete, and returned by
+//    incrementing stageTail after it's merged, so a pending slot never changes under the main loop.
+// 6. The main loop merges slots in order, into the SD card and into the cache buffer if it holds the sector.
+//    While a sector has a staged write pending, later writes to it are staged too, so they can't be overtaken.
+//
+// The host build (host/bufsim.cpp) defines BufferPreemptionPoint() to run simulated interrupt routines between
+// the main loop's accesses, and checks these rules against random interleavings.
+
+#define BUFFER_NONE 0xFF
+
+// a power of 2
+#define STAGE_SLOTS 2
+
+#ifndef BufferPreemptionPoint
+#define BufferPreemptionPoint()
+#endif
+
+extern volatile uint8_t bufferWriting;
+extern volatile uint8_t bufferWriteGen[NUM_BUFFERS];
+extern volatile uint8_t bufferClaimed[NUM_BUFFERS];
+extern volatile uint8_t bufferSavedGen[NUM_BUFFERS];
+// which sector of the cylinder (side * trackLen + sector) each buffer holds, and whether all of it is there
+extern volatile uint8_t bufferSector[NUM_BUFFERS];
+extern volatile uint8_t bufferValid[NUM_BUFFERS];
+
+extern volatile uint8_t stageHead;
+extern volatile uint8_t stageTail;
+extern volatile uint8_t stageTrack[STAGE_SLOTS];
+extern volatile uint8_t stageSector[STAGE_SLOTS];
+extern volatile uint8_t stageFirstBuffer;
+extern volatile uint8_t stageSlots;
+
+// Make a buffer, or every buffer, invalid, clean, and unowned. Called with interrupts disabled.
+void BufferReset(uint8_t bufferNumber);
+void BufferStateReset();
+
+// Give the staging ring its buffers, or take them away with ARENA_NONE. Only while nothing is staged.
+void BufferSetStaging(uint8_t firstBuffer);
+
+inline bool BufferDirty(uint8_t bufferNumber)
+{
+	return bufferWriteGen[bufferNumber] != bufferSavedGen[bufferNumber];
+}
+
+// Is this sector of the cylinder in RAM?
+inline bool SectorResident(uint8_t cylinderSector, uint8_t bufferNumber)
+{
+	return bufferSector[bufferNumber] == cylinderSector && bufferValid[bufferNumber];
+}
+
+// --- interrupt routines ---
+
+// Claim a buffer for a sector the Mac is writing. Fails if the main loop owns it, or if it holds another
+// sector that hasn't been saved yet.
+inline bool BufferBeginWrite(uint8_t bufferNumber, uint8_t cylinderSector)
+{
+	if (bufferClaimed[bufferNumber] || (BufferDirty(bufferNumber) && bufferSector[bufferNumber] != cylinderSector))
+		return false;
+		
+	bufferWriting = bufferNumber;
+	bufferValid[bufferNumber] = 0;
+	bufferSector[bufferNumber] = cylinderSector;
+	return true;
+}
+
+// Does this sector have a staged write that hasn't been merged yet?
+inline bool BufferStaged(uint8_t track, uint8_t cylinderSector)
+{
+	for (uint8_t i=stageTail; i!=stageHead; i++)
+	{
+		uint8_t k = i & (STAGE_SLOTS-1);
+		if (stageTrack[k] == track && stageSector[k] == cylinderSector)
+			return true;
+	}
+	return false;
+}
+
+// Claim a free staging slot for a sector the Mac is writing. Returns its buffer number, or BUFFER_NONE if
+// every slot is waiting to be merged.
+inline uint8_t BufferBeginStagedWrite(uint8_t track, uint8_t cylinderSector)
+{
+	uint8_t head = stageHead;
+	if ((uint8_t)(head - stageTail) >= stageSlots)
+		return BUFFER_NONE;
+		
+	uint8_t k = head & (STAGE_SLOTS-1);
+	stageTrack[k] = track;
+	stageSector[k] = cylinderSector;
+	bufferWriting = stageFirstBuffer + k;
+	return bufferWriting;
+}
+
+// The sector arrived intact: hand the dirty buffer or the staging slot to the main loop
+inline void BufferEndWrite()
+{
+	uint8_t n = bufferWriting;
+	if (n == BUFFER_NONE)
+		return;
+	
+	if ((uint8_t)(n - stageFirstBuffer) < stageSlots)
+	{
+		stageHead++;
+		bufferWriting = BUFFER_NONE;
+		return;
+	}
+	
+	// bufferSavedGen can't change while we own the buffer, so skipping it keeps the buffer dirty across a wrap
+	uint8_t gen = bufferWriteGen[n] + 1;
+	if (gen == bufferSavedGen[n])
+		gen++;
+	bufferWriteGen[n] = gen;
+	bufferValid[n] = 1;
+	bufferWriting = BUFFER_NONE;
+}
+
+// The write failed part way: drop the torn sector
+inline void BufferAbortWrite()
+{
+	uint8_t n = bufferWriting;
+	if (n == BUFFER_NONE)
+		return;
+	
+	// an unpublished staging slot is simply reused
+	if ((uint8_t)(n - stageFirstBuffer) < stageSlots)
+	{
+		bufferWriting = BUFFER_NONE;
+		return;
+	}
+		
+	bufferWriteGen[n] = bufferSavedGen[n];
+	bufferValid[n] = 0;
+	bufferWriting = BUFFER_NONE;
+}
+
+// --- main loop ---
+
+// Claim a buffer to save it to the SD card. Fails if the Mac is writing it.
+inline bool BufferClaim(uint8_t bufferNumber)
+{
+	bufferClaimed[bufferNumber] = 1;
+	BufferPreemptionPoint();
+	if (bufferWriting == bufferNumber)
+	{
+		bufferClaimed[bufferNumber] = 0;
+		return false;
+	}
+	return true;
+}
+
+inline void BufferRelease(uint8_t bufferNumber)
+{
+	bufferClaimed[bufferNumber] = 0;
+}
+
+// The claimed buffer's sector is on the SD card now
+inline void BufferMarkSaved(uint8_t bufferNumber)
+{
+	bufferSavedGen[bufferNumber] = bufferWriteGen[bufferNumber];
+}
+
+// Claim a buffer to read a sector into it from the SD card. Fails if the sector is already there, if the
+// Mac is writing the buffer, or if it holds another sector that must be saved first. The buffer stays
+// claimed until BufferEndFill().
+inline bool BufferBeginFill(uint8_t bufferNumber, uint8_t cylinderSector)
+{
+	if (!BufferClaim(bufferNumber))
+		return false;
+	
+	// the Mac may have written the buffer before the claim
+	BufferPreemptionPoint();
+	if (SectorResident(cylinderSector, bufferNumber) || BufferDirty(bufferNumber))
+	{
+		BufferRelease(bufferNumber);
+		return false;
+	}
+	
+	bufferValid[bufferNumber] = 0;
+	bufferSector[bufferNumber] = cylinderSector;
+	return true;
+}
+
+inline void BufferEndFill(uint8_t bufferNumber)
+{
+	bufferValid[bufferNumber] = 1;
+	BufferRelease(bufferNumber);
+}
+
+#endif /* BUFFERSTATE_H_ */
@@ -0,0 +1,235 @@
+/* 
+    Floppy Emu, copyright 2013 Steve Chamberlin, "Big Mess o' Wires". All rights reserved.
+	
+    Floppy Emu is licensed under a Creative Commons Attribution-NonCommercial 3.0 Unported 
+	license. (CC BY-NC 3.0) The terms of the license may be viewed at 	
+	http://creativecommons.org/licenses/by-nc/3.0/
+	
+	Based on a work at http://www.bigmessowires.com/macintosh-floppy-emu/
+	
+    Permissions beyond the scope of this license may be available at www.bigmessowires.com
+	or from mailto:steve@bigmessowires.com.
+*/
+
+#include <avr/pgmspace.h>
+#include <stdlib.h>
+#include <string.h>
+#include "diskformat.h"
+#include "SdFat.h"
+#include "SdBaseFile.h"
+
+// Mac GCR disks have five speed zones of 16 tracks, with 12 sectors per track on the outermost zone down to 8
+// on the innermost
+extern const uint16_t sony_track_start[] PROGMEM;
+const uint16_t sony_track_start[80] = {
+	0,    12,  24,  36,  48,  60 , 72,  84,
+	96,  108, 120, 132, 144, 156, 168, 180,
+
+	192, 203, 214, 225, 236, 247, 258, 269,
+	280, 291, 302, 313, 324, 335, 346, 357,
+
+	368, 378, 388, 398, 408, 418, 428, 438,
+	448, 458, 468, 478, 488, 498, 508, 518,
+
+	528, 537, 546, 555, 564, 573, 582, 591,
+	600, 609, 618, 627, 636, 645, 654, 663,
+
+	672, 680, 688, 696, 704, 712, 720, 728,
+	736, 744, 752, 760, 768, 776, 784, 792
+};
+
+extern const uint8_t sony_track_len[] PROGMEM;
+const uint8_t sony_track_len[80] = {
+	12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12,
+	11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11,
+	10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10,
+	9,  9,  9,  9,  9,  9,  9,  9,  9,  9,  9,  9,  9,  9,  9,  9,
+	8,  8,  8,  8,  8,  8,  8,  8,  8,  8,  8,  8,  8,  8,  8,  8
+};
+
+extern const DiskFormat diskFormats[] PROGMEM;
+const DiskFormat diskFormats[NUM_DISK_FORMATS] = {
+	// kBytes, encoding, sides, trackSectors, interleave, skew, fastSeek, sectorGap, addressDataGap, syncs, name
+	{ 400, ENCODING_GCR, 1, 0, 2, 0, false, 55, 10, 0, "400K" },
+	{ 800, ENCODING_GCR, 2, 0, 2, 0, false, 55, 10, 0, "800K" },
+	{ 1440, ENCODING_MFM, 2, 18, 1, 0, false, 50, 22, 12, "1440K" }
+};
+
+// Turbo gaps, indexed by eEncoding: sectorGap, addressDataGap, syncs. Only the gap between sectors is shortened.
+// The address to data gap and the syncs are where the Mac switches to writing a data block, so they stay the
+// lengths of the normal formats. Turbo gaps haven't been tried on a Mac yet.
+// GCR: the IWM needs 5 self-sync bytes to be sure of framing the next mark, plus one for the CPLD's stream start.
+extern const uint8_t turboGaps[][3] PROGMEM;
+const uint8_t turboGaps[NUM_ENCODINGS][3] = {
+	{ 6, 10, 0 },
+	{ 10, 22, 12 }
+};
+
+// interleave and skew from FORMATS.CFG, 0xFF to use the descriptor's
+uint8_t interleaveSetting[NUM_DISK_FORMATS] = { 0xFF, 0xFF, 0xFF };
+uint8_t skewSetting[NUM_DISK_FORMATS] = { 0xFF, 0xFF, 0xFF };
+bool fastSeekSetting[NUM_DISK_FORMATS];
+bool turboSetting[NUM_DISK_FORMATS];
+
+void LoadDiskFormat(uint8_t format, DiskFormat& f)
+{
+	memcpy_P(&f, &diskFormats[format], sizeof(DiskFormat));
+	
+	if (interleaveSetting[format] != 0xFF)
+		f.interleave = interleaveSetting[format];
+	if (skewSetting[format] != 0xFF)
+		f.skew = skewSetting[format];
+	if (fastSeekSetting[format])
+		f.fastSeek = true;
+	if (turboSetting[format])
+		FormatUseTurboGaps(f);
+}
+
+void FormatUseTurboGaps(DiskFormat& f)
+{
+	f.sectorGap = pgm_read_byte(&turboGaps[f.encoding][0]);
+	f.addressDataGap = pgm_read_byte(&turboGaps[f.encoding][1]);
+	f.syncs = pgm_read_byte(&turboGaps[f.encoding][2]);
+}
+
+// Parse an interleave or skew from FORMATS.CFG into *pValue. A - gives 0xFF, to keep the format's own value.
+// Fails unless it's a number from min to max, checked before it's narrowed to a byte.
+static bool ParseFormatSetting(const char* s, uint8_t min, uint8_t max, uint8_t* pValue)
+{
+	if (strcmp(s, "-") == 0)
+	{
+		*pValue = 0xFF;
+		return true;
+	}
+	
+	char* end;
+	long n = strtol(s, &end, 10);
+	if (end == s || *end != '\0' || n < min || n > max)
+		return false;
+		
+	*pValue = (uint8_t)n;
+	return true;
+}
+
+void LoadDiskFormatSettings()
+{
+	SdBaseFile cfg;
+	char line[32];
+	
+	if (!cfg.open("formats.cfg", O_READ))
+		return;
+		
+	while (cfg.fgets(line, sizeof(line)) > 0)
+	{
+		if (line[0] == '#')
+			continue;
+			
+		char* name = strtok(line, " \t\r\n");
+		char* interleave = strtok(NULL, " \t\r\n");
+		char* skew = strtok(NULL, " \t\r\n");
+		if (!name || !interleave || !skew)
+			continue;
+			
+		// every interleave from 1 up gives a valid order, but past 9 they only repeat smaller ones. A line with
+		// a value out of range is ignored.
+		uint8_t interleaveValue, skewValue;
+		if (!ParseFormatSetting(interleave, 1, 9, &interleaveValue) ||
+			!ParseFormatSetting(skew, 0, FORMAT_MAX_TRACK_SECTORS-1, &skewValue))
+			continue;
+			
+		bool fastSeek = false;
+		bool turbo = false;
+		char* option;
+		while ((option = strtok(NULL, " \t\r\n")) != NULL)
+		{
+			if (strcmp(option, "fast") == 0)
+				fastSeek = true;
+			else if (strcmp(option, "turbo") == 0)
+				turbo = true;
+		}
+			
+		for (uint8_t i=0; i<NUM_DISK_FORMATS; i++)
+		{
+			if (strcmp(name, "*") == 0 || strcmp_P(name, diskFormats[i].name) == 0)
+			{
+				if (interleaveValue != 0xFF)
+					interleaveSetting[i] = interleaveValue;
+				if (skewValue != 0xFF)
+					skewSetting[i] = skewValue;
+					
+				fastSeekSetting[i] = fastSeek;
+				turboSetting[i] = turbo;
+			}
+		}
+	}
+	
+	cfg.close();
+}
+
+uint8_t DiskFormatForSize(uint16_t kBytes)
+{
+	for (uint8_t i=0; i<NUM_DISK_FORMATS; i++)
+	{
+		if (pgm_read_word(&diskFormats[i].kBytes) == kBytes)
+			return i;
+	}
+	
+	return FORMAT_NONE;
+}
+
+uint8_t FormatTrackLength(const DiskFormat& f, uint8_t trackNumber)
+{
+	return f.trackSectors ? f.trackSectors : pgm_read_byte(&sony_track_len[trackNumber]);
+}
+
+uint16_t FormatTrackStart(const DiskFormat& f, uint8_t trackNumber)
+{
+	return f.trackSectors ? (uint16_t)trackNumber * f.trackSectors : pgm_read_word(&sony_track_start[trackNumber]);
+}
+
+uint8_t FormatOrderBase(const DiskFormat& f, uint8_t trackNumber)
+{
+	if (f.trackSectors)
+		return 0;
+		
+	// the zones before this one have 12, 11, 10... sectors per track
+	uint8_t zone = trackNumber >> 4;
+	return zone * 12 - ((zone * (zone - 1)) >> 1);
+}
+
+void FormatBuildSectorOrder(const DiskFormat& f, uint8_t* sectorAfter)
+{
+	uint8_t slots[FORMAT_MAX_TRACK_SECTORS];
+	
+	// one order per speed zone, built on the zone's first track
+	for (uint8_t track=0; track<80; track += f.trackSectors ? 80 : 16)
+	{
+		uint8_t trackLen = FormatTrackLength(f, track);
+		uint8_t* next = &sectorAfter[FormatOrderBase(f, track)];
+		
+		// lay the sectors around the track, each one interleave slots after the previous one, or in the next free
+		// slot after that:
+		// 2:1, 12 sector tracks: 0 6 1 7 2 8 3 9 4 10 5 11 
+		// 2:1, 11 sector tracks: 0 6 1 7 2 8 3 9 4 10 5
+		// 2:1, 10 sector tracks: 0 5 1 6 2 7 3 8 4 9
+		// 2:1,  9 sector tracks: 0 5 1 6 2 7 3 8 4
+		// 2:1,  8 sector tracks: 0 4 1 5 2 6 3 7
+		//       This is how real floppies are formatted, and should improve read performance if the Mac
+		//       can't completely process sector N before sector N+1 begins. It should also improve sector-by-sector
+		//       write performance, because the Mac alternately reads (address header) and writes (data section) in
+		//       this mode, and proper interleaving means it will read the desired address header sooner if the Mac
+		//       isn't fast enough to process the sectors linearly (which it likely isn't).
+		memset(slots, 0xFF, trackLen);
+		uint8_t slot = 0;
+		for (uint8_t s=0; s<trackLen; s++)
+		{
+			while (slots[slot] != 0xFF)
+				slot = (slot + 1) % trackLen;
+			slots[slot] = s;
+			slot = (slot + f.interleave) % trackLen;
+		}
+		
+		for (uint8_t i=0; i<trackLen; i++)
+			next[slots[i]] = slots[(i + 1) % trackLen];
+	}
+}
@@ -0,0 +1,92 @@
+/* 
+    Floppy Emu, copyright 2013 Steve Chamberlin, "Big Mess o' Wires". All rights reserved.
+	
+    Floppy Emu is licensed under a Creative Commons Attribution-NonCommercial 3.0 Unported 
+	license. (CC BY-NC 3.0) The terms of the license may be viewed at 	
+	http://creativecommons.org/licenses/by-nc/3.0/
+	
+	Based on a work at http://www.bigmessowires.com/macintosh-floppy-emu/
+	
+    Permissions beyond the scope of this license may be available at www.bigmessowires.com
+	or from mailto:steve@bigmessowires.com.
+*/
+
+#ifndef DISKFORMAT_H_
+#define DISKFORMAT_H_
+
+#include <inttypes.h>
+
+// The kinds of disk the emulator can present to the Mac. Each is described by a DiskFormat, and the rest of
+// the firmware only uses a disk's format through its descriptor: the sector loop picks the sector encoder by
+// its encoding, the geometry and interleave come from the functions below, and the CPLD is configured from
+// its encoding. Adding a format means adding a descriptor, and an encoder if it needs a new encoding.
+typedef enum {
+	FORMAT_GCR_400K = 0,
+	FORMAT_GCR_800K,
+	FORMAT_MFM_1440K,
+	NUM_DISK_FORMATS,
+	FORMAT_NONE = 0xFF
+} eDiskFormat;
+
+typedef enum {
+	ENCODING_GCR = 0,	// Apple 6-and-2 GCR, through the Sony drive interface
+	ENCODING_MFM,		// IBM MFM, through the SuperDrive interface
+	NUM_ENCODINGS
+} eEncoding;
+
+typedef struct DiskFormat
+{
+	uint16_t kBytes;		// size of the disk image, not counting a DiskCopy header
+	uint8_t encoding;		// eEncoding
+	uint8_t sides;
+	uint8_t trackSectors;	// sectors per track on every track, or 0 for the Sony GCR speed zones
+	uint8_t interleave;		// sector interleave factor, 1 for none
+	uint8_t skew;			// sectors the next track is rotated by, relative to this one
+	bool fastSeek;			// send the sector the Mac is most likely waiting for, instead of the next one around the track,
+							// see LoadDiskFormatSettings() for when it's slower
+	uint8_t sectorGap;		// gap bytes before each sector
+	uint8_t addressDataGap;	// gap bytes between the address and data blocks
+	uint8_t syncs;			// MFM: 00 bytes before each address and data block
+	char name[6];			// for the LCD, like "800K"
+} DiskFormat;
+
+// Copy a format's descriptor from program memory, with any interleave and skew from FORMATS.CFG.
+void LoadDiskFormat(uint8_t format, DiskFormat& f);
+
+// Read FORMATS.CFG from the current directory, if there is one. Each line is a format name, or * for all of
+// them, an interleave factor and a track-to-track skew, like "800K 1 3". A - leaves the format's own value.
+// They can be followed by "fast" to turn on fast seek, and "turbo" to shorten the gap between sectors, for more
+// throughput than a real drive. Turbo is untested on a Mac. Lines starting with #, and lines with an interleave
+// outside 1-9 or a skew outside 0-17, are ignored.
+// Fast seek is only faster when the interleave gives the Mac enough time between sectors. With 1440K at 1:1 and
+// a Mac that needs 2:1, seekbench has sequential writes taking 9 times as long with it, and file sized runs 68%
+// longer, so it's off unless a line asks for it.
+void LoadDiskFormatSettings();
+
+// Replace a format's gaps with the turbo ones.
+void FormatUseTurboGaps(DiskFormat& f);
+
+// Get the format of an image of kBytes, or FORMAT_NONE.
+uint8_t DiskFormatForSize(uint16_t kBytes);
+
+uint8_t FormatTrackLength(const DiskFormat& f, uint8_t trackNumber);
+
+// image sector of the first sector of the track on side 0, counting only one side of the disk
+uint16_t FormatTrackStart(const DiskFormat& f, uint8_t trackNumber);
+
+// Fill in the order the sectors are sent in, for every track length of the format. sectorAfter[base + n] is the
+// sector sent after sector n, where base is FormatOrderBase() of the track. The table is built once when the disk
+// is inserted, so picking the next sector is a single lookup.
+void FormatBuildSectorOrder(const DiskFormat& f, uint8_t* sectorAfter);
+
+uint8_t FormatOrderBase(const DiskFormat& f, uint8_t trackNumber);
+
+// sectors on the longest GCR track, for sizing the drive buffers
+#define FORMAT_MAX_GCR_TRACK_SECTORS 12
+
+#define FORMAT_MAX_TRACK_SECTORS 18
+
+// size of a sector order table: one entry per sector of each of the five GCR speed zones, 12+11+10+9+8
+#define FORMAT_SECTOR_ORDER_SIZE 50
+
+#endif /* DISKFORMAT_H_ */
@@ -23,9 +23,8 @@
 #include "SdFat.h"
 #include "SdBaseFile.h"
 #include "noklcd.h"
+#include "arena.h"
 
-#define SECTORBUF_SIZE (23 * 512) // use the 24th buffer for directory breadcrumbs
-extern uint8_t sectorBuf[24][512];
 extern uint8_t extraBuf[512];
 
 typedef struct FileEntry
@@ -33,6 +32,7 @@ typedef struct FileEntry
 	char longName[FILENAME_LEN+1];
 	char shortName[SHORTFILENAME_LEN+1];
 	eImageType imageFileType;
+	uint8_t diskFormat;
 } FileEntry;
 
 bool dirLfnNext(SdFat& sd, dir_t& dir, char* lfn)
@@ -109,8 +109,10 @@ bool dirLfnNext(SdFat& sd, dir_t& dir, char* lfn)
   return false;
 }
 
-eImageType DiskImageFileType(dir_t& dir, const char *filename)
+eImageType DiskImageFileType(dir_t& dir, const char *filename, uint8_t& diskFormat)
 {
+	diskFormat = FORMAT_NONE;
+	
 	if (filename[0] == '.')
 		return DISK_IMAGE_NONE;
 		
@@ -122,12 +124,9 @@ eImageType DiskImageFileType(dir_t& dir, const char *filename)
 		
 	uint32_t size = dir.fileSize;
 		
-	if (size == (unsigned long)1024 * 400)
-		return DISK_IMAGE_400K;
-	else if (size == (unsigned long)1024 * 800)
-		return DISK_IMAGE_800K;
-	else if (size == (unsigned long)1024 * 1440)
-		return DISK_IMAGE_1440K;			
+	if ((size & 1023) == 0 && size <= (unsigned long)1024 * 1440 &&
+		(diskFormat = DiskFormatForSize(size / 1024)) != FORMAT_NONE)
+		return DISK_IMAGE_RAW;
 	else if (size > (unsigned long)1024 * 400 && 
 			 size < (unsigned long)1024 * 1500)
 	{
@@ -148,12 +147,8 @@ eImageType DiskImageFileType(dir_t& dir, const char *filename)
 			{
 				size = ((unsigned long)extraBuf[0x41] * 65536 + (unsigned long)extraBuf[0x42] * 256 + (unsigned long)extraBuf[0x43]) / 1024;
 			
-				if (size == 400)
-					return DISK_IMAGE_DISKCOPY_400K;
-				else if (size == 800)
-					return DISK_IMAGE_DISKCOPY_800K;
-				else if (size == 1440)
-					return DISK_IMAGE_DISKCOPY_1440K;
+				if ((diskFormat = DiskFormatForSize(size)) != FORMAT_NONE)
+					return DISK_IMAGE_DISKCOPY;
 			}	
 		}					
 	}		
@@ -167,7 +162,10 @@ uint16_t diskMenuSelection = 0;
 char selectedFile[FILENAME_LEN+1];
 char selectedLongFile[FILENAME_LEN+1];
 eImageType selectedFileType;
+uint8_t selectedDiskFormat;
 uint8_t subdirDepth = 0;
+char subdirNames[MAX_SUBDIR_DEPTH][SHORTFILENAME_LEN+1];
+uint8_t menuBuffer;
 
 #define LONGFILENAME_LEN 130
 
@@ -178,20 +176,28 @@ void InitDiskMenu(SdFat& sd)
 	
 	diskMenuEntryCount = 0;
 	
-	// use the sector buffers to hold the filenames
-	uint16_t maxEntries = SECTORBUF_SIZE / sizeof(FileEntry);
-	FileEntry* pFileEntries = (FileEntry*)sectorBuf;
+	// use the free sector buffers to hold the filenames, leaving room for the up directory entry
+	uint8_t numBuffers;
+	ArenaFree(ARENA_MENU);
+	menuBuffer = ArenaAlloc(ARENA_MENU, 1, NUM_BUFFERS, &numBuffers);
+	if (menuBuffer == ARENA_NONE)
+		return;
+		
+	uint16_t maxEntries = ((uint16_t)numBuffers * BUFFER_SIZE) / sizeof(FileEntry) - 1;
+	FileEntry* pFileEntries = (FileEntry*)sectorBuf[menuBuffer];
 	
 	sd.vwd()->rewind();	
 	while (dirLfnNext(sd, dir, name) && diskMenuEntryCount < maxEntries)
 	{		
 		eImageType imageType;
+		uint8_t diskFormat;
 		
-		if ((imageType = DiskImageFileType(dir, name)) != DISK_IMAGE_NONE)
+		if ((imageType = DiskImageFileType(dir, name, diskFormat)) != DISK_IMAGE_NONE)
 		{
 			strncpy(pFileEntries[diskMenuEntryCount].longName, name, FILENAME_LEN+1);
 			SdBaseFile::dirName(dir, pFileEntries[diskMenuEntryCount].shortName);
 			pFileEntries[diskMenuEntryCount].imageFileType = imageType;
+			pFileEntries[diskMenuEntryCount].diskFormat = diskFormat;
 			diskMenuEntryCount++;	
 		}
 	} 
@@ -202,11 +208,13 @@ void InitDiskMenu(SdFat& sd)
 		strncpy(pFileEntries[diskMenuEntryCount].longName, "..", FILENAME_LEN+1);
 		strncpy(pFileEntries[diskMenuEntryCount].shortName, "..", SHORTFILENAME_LEN+1);
 		pFileEntries[diskMenuEntryCount].imageFileType = DISK_IMAGE_UP_DIRECTORY;
+		pFileEntries[diskMenuEntryCount].diskFormat = FORMAT_NONE;
 		diskMenuEntryCount++;	
 	}
 
 	char file1[FILENAME_LEN+1], file2[FILENAME_LEN+1], temp[FILENAME_LEN+1];
 	eImageType tempType;
+	uint8_t tempFormat;
 	
 	// sort the names by longname
 	for (uint16_t i=0; i<diskMenuEntryCount; i++)
@@ -259,6 +267,10 @@ void InitDiskMenu(SdFat& sd)
 				tempType = 	pFileEntries[i].imageFileType;
 				pFileEntries[i].imageFileType = pFileEntries[j].imageFileType;
 				pFileEntries[j].imageFileType = tempType;	
+				
+				tempFormat = pFileEntries[i].diskFormat;
+				pFileEntries[i].diskFormat = pFileEntries[j].diskFormat;
+				pFileEntries[j].diskFormat = tempFormat;
 			}
 		}
 	}
@@ -272,6 +284,9 @@ void DrawDiskMenu(SdFat& sd)
 	if (diskMenuSelection > diskMenuOffset+4)
 		diskMenuOffset = diskMenuSelection-4;
 			
+	// draw in RAM, then send only what changed
+	LcdBeginFrame();
+	
 	LcdGoto(0,0);
 	LcdWrite(LCD_DATA, 0x7F);
 	for (int i=0; i<19; i++)
@@ -290,7 +305,7 @@ void DrawDiskMenu(SdFat& sd)
 	}	
 	else
 	{
-		FileEntry* pFileEntries = (FileEntry*)sectorBuf;
+		FileEntry* pFileEntries = (FileEntry*)sectorBuf[menuBuffer];
 			
 		int row = 0;
 		for (uint16_t i=diskMenuOffset; i<diskMenuOffset+5 && i<diskMenuEntryCount; i++)
@@ -328,6 +343,7 @@ void DrawDiskMenu(SdFat& sd)
 				strncpy(selectedLongFile, pFileEntries[i].longName, FILENAME_LEN+1);
 				strncpy(selectedFile, pFileEntries[i].shortName, SHORTFILENAME_LEN+1);
 				selectedFileType = pFileEntries[i].imageFileType;
+				selectedDiskFormat = pFileEntries[i].diskFormat;
 			}
 												
 			row++;	
@@ -379,4 +395,6 @@ void DrawDiskMenu(SdFat& sd)
 			DrawDiskMenu(sd); // draw again
 		}
 	}	
+	
+	LcdFlush();
 }
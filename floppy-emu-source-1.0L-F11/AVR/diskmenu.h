@@ -15,27 +15,27 @@
 #define DISKMENU_H_
 
 #include <inttypes.h>
+#include "diskformat.h"
 
 typedef enum {
 	DISK_IMAGE_NONE = 0,
 	DISK_IMAGE_DIRECTORY,
 	DISK_IMAGE_UP_DIRECTORY,
-	DISK_IMAGE_400K,
-	DISK_IMAGE_800K,
-	DISK_IMAGE_1440K,
-	DISK_IMAGE_DISKCOPY_400K,
-	DISK_IMAGE_DISKCOPY_800K,
-	DISK_IMAGE_DISKCOPY_1440K
+	DISK_IMAGE_RAW,			// the disk's sectors, in order
+	DISK_IMAGE_DISKCOPY		// a DiskCopy 4.2 header followed by the disk's sectors
 } eImageType;
 
 #define FILENAME_LEN 21
 #define SHORTFILENAME_LEN 12 // 8.3
+#define MAX_SUBDIR_DEPTH 8
 
 extern uint16_t diskMenuSelection;
 extern char selectedFile[];
 extern char selectedLongFile[];
 extern eImageType selectedFileType;
+extern uint8_t selectedDiskFormat; // eDiskFormat of the selected image
 extern uint8_t subdirDepth;
+extern char subdirNames[][SHORTFILENAME_LEN+1]; // path from the root to the current directory
 
 class SdFat;
 
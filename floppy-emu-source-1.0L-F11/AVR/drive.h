@@ -0,0 +1,63 @@
+/*
+    Floppy Emu, copyright 2013 Steve Chamberlin, "Big Mess o' Wires". All rights reserved.
+
+    Floppy Emu is licensed under a Creative Commons Attribution-NonCommercial 3.0 Unported
+	license. (CC BY-NC 3.0) The terms of the license may be viewed at
+	http://creativecommons.org/licenses/by-nc/3.0/
+
+	Based on a work at http://www.bigmessowires.com/macintosh-floppy-emu/
+
+    Permissions beyond the scope of this license may be available at www.bigmessowires.com
+	or from mailto:steve@bigmessowires.com.
+*/
+
+#ifndef DRIVE_H_
+#define DRIVE_H_
+
+#include <inttypes.h>
+#include "diskformat.h"
+
+// everything the firmware knows about the emulated drive and the disk inserted in it. The CPLD decodes a single
+// drive enable, so there is one drive.
+typedef struct DriveContext
+{
+	// modified by the interrupt routines
+	volatile uint8_t currentTrack;
+	volatile uint8_t currentSide;
+	volatile uint8_t wrTrack;
+	volatile uint8_t wrSide;
+	volatile uint8_t wrSector;
+
+	// main loop state
+	volatile uint8_t prevTrack; // the track the buffers hold, also read by the write interrupt routines
+	uint8_t prevSide;
+	uint8_t currentSector;
+
+	// disk image
+	DiskFormat format;
+	bool diskInserted;
+	bool readOnly;
+	bool mfmMode;
+	bool diskCopyFormat;
+	uint8_t numberOfDiskSides;
+	uint32_t imageFirstBlock;
+	uint32_t imageLastBlock;
+	uint8_t sectorAfter[FORMAT_SECTOR_ORDER_SIZE]; // sector order of each track length, see FormatBuildSectorOrder()
+	
+	// geometry of currentTrack, kept by SetTrackGeometry() so the interrupt routines and the sector loop
+	// don't look it up for every sector
+	volatile uint8_t trackSectors;
+	volatile uint16_t trackFirstSector;
+	volatile uint8_t trackOrderBase;
+
+	// this drive's share of the sector buffers, sectorBuf[firstBuffer] to sectorBuf[firstBuffer+numBuffers-1]
+	uint8_t firstBuffer;
+	uint8_t numBuffers;
+	
+	// sector writes dropped by the interrupt routines since the disk was inserted, see WriteError()
+	volatile uint16_t writeErrors;
+} DriveContext;
+
+extern DriveContext drive;
+
+#endif /* DRIVE_H_ */
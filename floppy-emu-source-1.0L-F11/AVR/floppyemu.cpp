@@ -38,6 +38,13 @@
 #include "micro.h"
 #include "ports.h"
 #include "diskmenu.h"
+#include "arena.h"
+#include "bufferstate.h"
+#include "drive.h"
+#include "gcr.h"
+#include "handshakestats.h"
+#include "scheduler.h"
+#include "tach.h"
 
 #ifdef PROGMEM_WORKAROUND
 // work-around for compiler bug
@@ -116,8 +123,6 @@
 #define CARD_WPROT_PIN 7
 
 #define SECTOR_DATA_SIZE 512
-#define INTER_SECTOR_GAP_SIZE 55
-#define ADDRESS_DATA_GAP_SIZE 10
 #define SECTOR_DATA_HEADER_SIZE 3
 #define SECTOR_DATA_SECTORNUM_START SECTOR_DATA_HEADER_SIZE
 #define SECTOR_DATA_SECTORNUM_SIZE 1
@@ -136,94 +141,23 @@ const uint16_t bootloader_info[] __attribute__(( section(".bootldrinfo") )) = {
 	
 const char versionStr[] PROGMEM = "App Version 1.0 L";
 
-volatile uint8_t currentTrack;
-volatile uint8_t prevTrack;
-volatile uint8_t currentSide;
-volatile uint8_t prevSide;
+DriveContext drive;
 volatile uint8_t writeMode;
 volatile bool restartDisk;
 volatile bool writeError;
 
-bool diskInserted;
-bool readOnly;
-bool mfmMode;
 uint16_t crc;
-uint8_t numberOfDiskSides;
-uint8_t currentSector;
-uint16_t driveTachHalfPeriod;
-uint8_t tachFlutter;
 
 uint8_t writeDisplayTimer;
 uint8_t cpldFirmwareVersion;
+uint8_t cpldCapabilities;
 
 #define TEXTBUF_SIZE 22
 char textBuf[TEXTBUF_SIZE];
 
-#define NUM_BUFFERS 24
-uint8_t sectorBuf[NUM_BUFFERS][SECTOR_DATA_SIZE];
 uint8_t extraBuf[SECTOR_DATA_SIZE];
 
-bool selectedFileIsDiskCopyFormat;
-
-extern const uint16_t sony_track_start[] PROGMEM;
-const uint16_t sony_track_start[80] = {
-	0,    12,  24,  36,  48,  60 , 72,  84,
-	96,  108, 120, 132, 144, 156, 168, 180,
-
-	192, 203, 214, 225, 236, 247, 258, 269,
-	280, 291, 302, 313, 324, 335, 346, 357,
-
-	368, 378, 388, 398, 408, 418, 428, 438,
-	448, 458, 468, 478, 488, 498, 508, 518,
-
-	528, 537, 546, 555, 564, 573, 582, 591,
-	600, 609, 618, 627, 636, 645, 654, 663,
-
-	672, 680, 688, 696, 704, 712, 720, 728,
-	736, 744, 752, 760, 768, 776, 784, 792
-};
-
-extern const uint8_t sony_track_len[] PROGMEM;
-const uint8_t sony_track_len[80] = {
-	12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12,
-	11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11,
-	10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10,
-	9,  9,  9,  9,  9,  9,  9,  9,  9,  9,  9,  9,  9,  9,  9,  9,
-	8,  8,  8,  8,  8,  8,  8,  8,  8,  8,  8,  8,  8,  8,  8,  8
-};
-	
-extern const uint8_t sony_to_disk_byte[] PROGMEM;
-const uint8_t sony_to_disk_byte[] = {
-	0x96, 0x97, 0x9A, 0x9B,  0x9D, 0x9E, 0x9F, 0xA6, /* 0x00 */
-	0xA7, 0xAB, 0xAC, 0xAD,  0xAE, 0xAF, 0xB2, 0xB3,
-	0xB4, 0xB5, 0xB6, 0xB7,  0xB9, 0xBA, 0xBB, 0xBC, /* 0x10 */
-	0xBD, 0xBE, 0xBF, 0xCB,  0xCD, 0xCE, 0xCF, 0xD3,
-	0xD6, 0xD7, 0xD9, 0xDA,  0xDB, 0xDC, 0xDD, 0xDE, /* 0x20 */
-	0xDF, 0xE5, 0xE6, 0xE7,  0xE9, 0xEA, 0xEB, 0xEC,
-	0xED, 0xEE, 0xEF, 0xF2,  0xF3, 0xF4, 0xF5, 0xF6, /* 0x30 */
-	0xF7, 0xF9, 0xFA, 0xFB,  0xFC, 0xFD, 0xFE, 0xFF
-};
-
-extern const uint8_t disk_byte_to_sony[] PROGMEM;
-const uint8_t disk_byte_to_sony[] = {
-	/* table begins at disk byte 0x96, value of 0xFF is an invalid disk byte */
-	/* 0x96 */ 0x00, 0x01, 0xFF, 0xFF, 0x02, 0x03, 0xFF, 0x04,
-	/* 0x9E */ 0x05, 0x06, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-	/* 0xA6 */ 0x07, 0x08, 0xFF, 0xFF, 0xFF, 0x09, 0x0A, 0x0B,
-	/* 0xAE */ 0x0C, 0x0D, 0xFF, 0xFF, 0x0E, 0x0F, 0x10, 0x11,
-	/* 0xB6 */ 0x12, 0x13, 0xFF, 0x14, 0x15, 0x16, 0x17, 0x18,
-	/* 0xBE */ 0x19, 0x1A, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-	/* 0xC6 */ 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x1B, 0xFF, 0x1C,
-	/* 0xCE */ 0x1D, 0x1E, 0xFF, 0xFF, 0xFF, 0x1F, 0xFF, 0xFF,
-	/* 0xD6 */ 0x20, 0x21, 0xFF, 0x22, 0x23, 0x24, 0x25, 0x26,
-	/* 0xDE */ 0x27, 0x28, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x29,
-	/* 0xE6 */ 0x2A, 0x2B, 0xFF, 0x2C, 0x2D, 0x2E, 0x2F, 0x30,
-	/* 0xEE */ 0x31, 0x32, 0xFF, 0xFF, 0x33, 0x34, 0x35, 0x36,
-	/* 0xF6 */ 0x37, 0x38, 0xFF, 0x39, 0x3A, 0x3B, 0x3C, 0x3D,
-	/* 0xFE */ 0x3E, 0x3F
-};	
-	
-uint8_t sectorDataHeaderGCR[] = { 0xD5, 0xAA, 0xAD };
+uint8_t sectorDataHeaderGCR[] = { GCR_MARK_D5, GCR_MARK_AA, GCR_BYTE_AD };
 
 extern const uint16_t crc_ccitt[] PROGMEM;
 const uint16_t crc_ccitt[] = {
@@ -265,28 +199,17 @@ void ResetDiskState();
 
 uint16_t writeErrorNumber;
 
+// Halt with a message, for errors the firmware can't continue after. Failed sector writes from the Mac aren't
+// among them, see WriteError().
 void error(const char* msg)
 {
-	bool wasWriteError = writeError;
-	uint16_t wasWriteErrorNumber = writeErrorNumber;
-	
-	ResetDiskState(); // clears writeError and writeErrorNumber
+	ResetDiskState();
 
 	LcdClear();
 	LcdGoto(0,0);
-	if (wasWriteError)
-		LcdTinyStringP(PSTR("WRITE ERROR          "), TEXT_INVERSE);		
-	else
-		LcdTinyStringP(PSTR("FATAL ERROR          "), TEXT_INVERSE);
+	LcdTinyStringP(PSTR("FATAL ERROR          "), TEXT_INVERSE);
 	LcdGoto(0,1);
 	LcdTinyString(msg, TEXT_NORMAL);
-	
-	if (wasWriteError)
-	{		
-		snprintf(textBuf, TEXTBUF_SIZE, "%u", wasWriteErrorNumber);
-		LcdGoto(0,5);
-		LcdTinyString(textBuf, TEXT_NORMAL);
-	}
 					
 	while (1);	
 }	
@@ -333,71 +256,75 @@ void InitPorts()
 	//CPLD_RD_ACK_WR_TICK_INT_MSK |= (1<<CPLD_RD_ACK_WR_TICK_INT_PIN);
 }
 
-void SetTach()
-{	
-	/*
-	Produces 60 pulses for each rotation of the drive motor
-	Data from Apple/Sony docs:
-	   Tracks	RPM   Acceptable Speed Range in ROM
-	   00-15:   394   1135-11E9
-	   16-31:   429   12C6-138A
-	   32-47:   472   14A7-157F
-	   48-63:   525   16F2-17E2
-	   64-79:   590   19D0-1ADE
-			
-	Experimentally determined TACH toggle rates for Plus Too, running at 8.125 MHz:
-		TACH Half Period Clocks		Resulting Timing Value Computed By Mac
-					9996				    $117B (4475)           
-					9122  				    $1328 (4904)
-					8292  				    $1513 (5395)
-					7463  				    $176A (5994)
-					6634				    $1A56 (6742)
-		
-	A real Mac runs slightly slower than Plus Too (7.8336 MHz vs 8.125 MHz), so those
-	timing values should be scaled by multiplying by 7.8336/8.125 = 0.96414
-	
-	Scaling these values and converting to real time units, we get:
-	   Tracks	TACH Half Period    Implied RPM   
-	   00-15:      1276.04 us         391.84
-	   16-31:      1164.47 us         429.38
-	   32-47:      1058.52 us         472.36
-	   48-63:       952.69 us         524.83
-	   64-79:       846.86 us         590.41
-
-	*/
-	
-	const uint16_t zoneRPM[] = { 394, 429, 472, 525, 590 };	
-	uint8_t speedZone = currentTrack >> 4;	
-	if (speedZone > 4)
-		speedZone = 4;
-				
-	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
-	{
-		driveTachHalfPeriod = F_CPU / (2 * zoneRPM[speedZone]);		
-		// OCR1A update will be performed during the next sector 0 read			
-	}	
-	
-	TIFR1 = (1 << OCF1A); // Clear the timer 1 compare A match flag. Not sure this is actually necessary.
-}
-
 uint16_t trackStart(uint8_t trackNumber)
 {
-	return mfmMode ? trackNumber * 18 : pgm_read_word(&sony_track_start[trackNumber]);
+	return FormatTrackStart(drive.format, trackNumber);
 }
 
 uint8_t trackLength(uint8_t trackNumber)
 {
-	return mfmMode ? 18 : pgm_read_byte(&sony_track_len[trackNumber]);
+	return FormatTrackLength(drive.format, trackNumber);
+}
+
+// Cache the geometry of the drive's current track. Call with interrupts disabled whenever the track or the
+// disk format changes.
+void SetTrackGeometry(DriveContext& d)
+{
+	// tracks past the end of the disk are never sent, but keep the lookup in the tables
+	uint8_t track = d.currentTrack <= 79 ? d.currentTrack : 79;
+	
+	d.trackSectors = FormatTrackLength(d.format, track);
+	d.trackFirstSector = FormatTrackStart(d.format, track);
+	d.trackOrderBase = FormatOrderBase(d.format, track);
 }
 	
-#define BUFFER_DIRTY 1
-#define BUFFER_DATA_VALID 2
-#define BUFFER_LOCKED 4
+// Get the sector buffer for a sector of the current cylinder. The side 1 sectors follow the side 0 sectors, 
+// wrapping around to the drive's first buffer if the whole cylinder doesn't fit. For 1440K disks, 24 buffers
+// hold one side of the cylinder plus 6 sectors of the other side, so switching sides doesn't require reloading
+// every sector. bufferSector tells which of the sectors sharing a buffer is currently in it.
+uint8_t BufferNumber(uint8_t side, uint8_t trackLen, uint8_t sector)
+{
+	uint8_t n = side * trackLen + sector;
+	
+	// the drive always has at least trackLen buffers, so n wraps at most once
+	if (n >= drive.numBuffers)
+		n -= drive.numBuffers;
+		
+	return drive.firstBuffer + n;
+}
+
+// Get the end of the drive's buffers used by a track, for scanning the dirty range.
+uint8_t TrackBuffersEnd(uint8_t trackLen)
+{
+	uint8_t count = trackLen * drive.numberOfDiskSides;
+	if (count > drive.numBuffers)
+		count = drive.numBuffers;
+		
+	return drive.firstBuffer + count;
+}
 
-volatile uint8_t bufferState[NUM_BUFFERS];
-volatile uint8_t wrTrack;
-volatile uint8_t wrSide;
-volatile uint8_t wrSector;
+// Claim a buffer for a sector the Mac is writing, and return its number. The sector goes to its track cache
+// buffer if it can. It's staged instead after a step until the main loop has saved the previous track's dirty
+// sectors and switched the buffers to the new track, while the main loop owns the cache buffer, and while an
+// earlier write of the sector is still staged (see bufferstate.h). Returns BUFFER_NONE if the staging slots
+// are all waiting to be merged too.
+uint8_t BeginSectorWrite(uint8_t trackLen, uint8_t sector)
+{
+	uint8_t cylinderSector = drive.currentSide * trackLen + sector;
+	uint8_t bufferNumber = BufferNumber(drive.currentSide, trackLen, sector);
+	
+	if (drive.prevTrack == drive.currentTrack && !BufferStaged(drive.currentTrack, cylinderSector) &&
+		BufferBeginWrite(bufferNumber, cylinderSector))
+	{
+		// where the last write to the track cache went
+		drive.wrTrack = drive.currentTrack;
+		drive.wrSide = drive.currentSide;
+		drive.wrSector = sector;
+		return bufferNumber;
+	}
+		
+	return BufferBeginStagedWrite(drive.currentTrack, cylinderSector);
+}
 
 // these variables are used only within the interrupt routine, and do not need to be declared volatile
 uint8_t wrTick;
@@ -408,12 +335,65 @@ uint8_t ck5, ck6, ck7;
 uint8_t XBit;
 uint8_t* pSectorBuf;
 	
+// Drop the sector being written, and count it for the main loop to report. The sector keeps what it held before
+// the write, and a Mac that was interrupted part way writes it again. writeMode is left alone, so the routine looks
+// for the next sector header, and the data bus is handed back when the Mac ends the write.
 void WriteError()
 {
-	writeMode = false;
+	BufferAbortWrite();
+	drive.writeErrors++;
 	restartDisk = true;
 	writeError = true;
 	writeCount = 0;
+	
+	// turn off the LED, as at the end of a sector write
+	PORT(STATUS_LED_PORT) |= (1<<STATUS_LED_PIN);
+}
+
+// Step the drive to a new track. Called with interrupts disabled, so it only does the handshake and
+// what the other interrupt routines need for the new track. The main loop does the rest when it sees the
+// track change: it saves the old track's dirty sectors, sets the tach speed, and reloads the buffers. Until then
+// BeginSectorWrite() stages writes, so a write for the new track can't land among the old track's sectors.
+void StepDrive()
+{
+	// step to the next track
+	if (bit_is_set(PIN(CPLD_STEP_DIR_MOTOR_ON_PORT), CPLD_STEP_DIR_MOTOR_ON_PIN))
+	{
+		// bounds check at 0
+		if (drive.currentTrack != 0)
+			drive.currentTrack--;			
+	}
+	else
+	{
+		drive.currentTrack++;
+	}
+	
+	// assert ack and send new TK0 indicator
+	if (drive.currentTrack == 0)
+		PORT(CPLD_RD_READY_TK0_PORT) &= ~(1<<CPLD_RD_READY_TK0_PIN);
+	else
+		PORT(CPLD_RD_READY_TK0_PORT) |= (1<<CPLD_RD_READY_TK0_PIN);		
+	PORT(CPLD_STEP_ACK_DISK_IN_PORT) |= (1<<CPLD_STEP_ACK_DISK_IN_PIN);
+			
+	// wait for de-assertion of step request. The CPLD clears it on the clock after it sees ack.
+	while (bit_is_set(PIN(CPLD_STEP_REQ_PORT), CPLD_STEP_REQ_PIN))
+	{
+	}
+		
+	// de-assert ack, and leave RD_READY high: an MFM handshake that this interrupted is still waiting for its ack
+	PORT(CPLD_STEP_ACK_DISK_IN_PORT) &= ~(1<<CPLD_STEP_ACK_DISK_IN_PIN);
+	PORT(CPLD_RD_READY_TK0_PORT) |= (1<<CPLD_RD_READY_TK0_PIN);
+	
+	SetTrackGeometry(drive);
+	
+	// premature end of a write?
+	if (writeCount >= SECTOR_DATA_SECTORNUM_START)
+	{
+		writeErrorNumber = 1000 + writeCount;
+		WriteError();		
+	}
+									
+	restartDisk = true;
 }
 
 // pin state change interrupt: STEP
@@ -422,74 +402,9 @@ ISR(PCINT3_vect)
 	// step to a new track?
 	if (bit_is_set(PIN(CPLD_STEP_REQ_PORT), CPLD_STEP_REQ_PIN))
 	{	
-		// determine the range of dirty sector buffers
-		uint8_t trackLen = trackLength(currentTrack);
-		uint8_t firstDirtyBuffer = NUM_BUFFERS, lastDirtyBuffer=0;
-	
-		for (uint8_t i=0; i<trackLen*2 && i<NUM_BUFFERS; i++)
-		{
-			if (bufferState[i] & BUFFER_DIRTY)
-			{
-				if (firstDirtyBuffer == NUM_BUFFERS)
-					firstDirtyBuffer = i;
-				
-				lastDirtyBuffer = i;
-			}
-		}
-	
-		// Lock all the buffers in the dirty range, preventing writes to them. This prevents a problem:
-		// A write for the new track could fill a buffer before the old track's data was completely flushed back to SD, 
-		// causing some of track N+1's data to get written to track N.
-		// Also mark all buffers in the dirty range as dirty if they have valid data, even if they weren't actually 
-		// dirty. The dirty range will have to be written out as a contiguous block anyway. The flush method
-		// can then detect when buffers in the range don't have valid data, because they won't have the dirty flag.
-		for (uint8_t i=firstDirtyBuffer; i<=lastDirtyBuffer; i++)					
-		{
-			if (bufferState[i] & BUFFER_DATA_VALID)
-				bufferState[i] |= BUFFER_DIRTY;
-				
-			bufferState[i] |= BUFFER_LOCKED;
-		}
-				
-		// step to the next track
-		if (bit_is_set(PIN(CPLD_STEP_DIR_MOTOR_ON_PORT), CPLD_STEP_DIR_MOTOR_ON_PIN))
-		{
-			// bounds check at 0
-			if (currentTrack != 0)
-				currentTrack--;			
-		}
-		else
-		{
-			currentTrack++;
-		}
-		
-		// assert ack and send new TK0 indicator
-		if (currentTrack == 0)
-			PORT(CPLD_RD_READY_TK0_PORT) &= ~(1<<CPLD_RD_READY_TK0_PIN);
-		else
-			PORT(CPLD_RD_READY_TK0_PORT) |= (1<<CPLD_RD_READY_TK0_PIN);		
-		PORT(CPLD_STEP_ACK_DISK_IN_PORT) |= (1<<CPLD_STEP_ACK_DISK_IN_PIN);
-				
-		// wait for de-assertion of step request
-		while (bit_is_set(PIN(CPLD_STEP_REQ_PORT), CPLD_STEP_REQ_PIN))
-		{
-		}
-			
-		// de-assert ack and RD_READY
-		PORT(CPLD_STEP_ACK_DISK_IN_PORT) &= ~(1<<CPLD_STEP_ACK_DISK_IN_PIN);
-		PORT(CPLD_RD_READY_TK0_PORT) |= (1<<CPLD_RD_READY_TK0_PIN);
-		
-		SetTach();
-		
-		// premature end of a write?
-		if (writeCount >= SECTOR_DATA_SECTORNUM_START)
-		{
-			strncpy(textBuf, "incomplete write", TEXTBUF_SIZE);
-			writeErrorNumber = 1000 + writeCount;
-			WriteError();		
-		}
-										
-		restartDisk = true;
+		HandshakeTimestamp(stepStart);
+		StepDrive();
+		HandshakeStepRecord(stepStart);
 	}
 }
 		
@@ -498,18 +413,17 @@ ISR(PCINT2_vect)
 { 				
 	// did the current side change?
 	uint8_t newSide = ((PIN(CPLD_CURRENT_SIDE_PORT) >> CPLD_CURRENT_SIDE_PIN) & 0x01);
-	if (newSide != currentSide)
+	if (newSide != drive.currentSide)
 	{
-		if (numberOfDiskSides == 2)
-			currentSide = newSide;
+		if (drive.numberOfDiskSides == 2)
+			drive.currentSide = newSide;
 		else
-			currentSide = 0;
+			drive.currentSide = 0;
 		restartDisk = true;
 		
 		// premature end of a write?
 		if (writeCount >= SECTOR_DATA_SECTORNUM_START)
 		{
-			strncpy(textBuf, "incomplete write", TEXTBUF_SIZE);
 			writeErrorNumber = 2000 + writeCount;
 			WriteError();		
 		}		
@@ -550,7 +464,6 @@ ISR(PCINT2_vect)
 			// premature end of a write?
 			if (writeCount >= SECTOR_DATA_SECTORNUM_START)
 			{
-				strncpy(textBuf, "incomplete write", TEXTBUF_SIZE);
 				writeErrorNumber = 3000 + writeCount;
 				WriteError();		
 			}
@@ -562,7 +475,11 @@ ISR(PCINT2_vect)
 
 void HandleGCRWrite()
 {			
+#if CPLD_GCR_TRANSLATE
+	uint8_t diskByte = PIN(CPLD_DATA_PORT) & 0x7F;
+#else
 	uint8_t diskByte = 0x80 | PIN(CPLD_DATA_PORT);
+#endif
 			
 	if (writeCount < SECTOR_DATA_ENCODED_TAGS_START)
 	{
@@ -570,38 +487,33 @@ void HandleGCRWrite()
 		// the final header byte is the sector number
 		if (writeCount == SECTOR_DATA_SECTORNUM_START)
 		{
-			uint8_t sector = pgm_read_byte(&disk_byte_to_sony[diskByte - 0x96]);
+			uint8_t sector = DiskByteToSony(diskByte);
 		
-			if (sector >= trackLength(currentTrack))
+			uint8_t trackLen = drive.trackSectors;
+			if (sector >= trackLen)
 			{
-				snprintf(textBuf, TEXTBUF_SIZE, "bad sector %d for t%d", sector, currentTrack);
 				writeErrorNumber = 60;
 				WriteError();	
+				return;
 			}		
 		
-			uint8_t trackLen = trackLength(currentTrack);
-			currentWriteBufferNumber = trackLen * currentSide + sector;	
+			currentWriteBufferNumber = BeginSectorWrite(trackLen, sector);	
 					
-			if (bufferState[currentWriteBufferNumber] & BUFFER_LOCKED)
+			if (currentWriteBufferNumber == BUFFER_NONE)
 			{
-				snprintf(textBuf, TEXTBUF_SIZE, "buf locked %d/%d:%d", currentTrack, currentSide, sector);
 				writeErrorNumber = 61;
 				WriteError();			
+				return;
 			}
 										
 			pSectorBuf = sectorBuf[currentWriteBufferNumber];
-			bufferState[currentWriteBufferNumber] |= BUFFER_LOCKED;
-			bufferState[currentWriteBufferNumber] &= ~BUFFER_DATA_VALID;
-			wrTrack = currentTrack;
-			wrSide = currentSide;
-			wrSector = sector; 
 					
 			// turn on the LED when receiving a sector write
 			PORT(STATUS_LED_PORT) &= ~(1<<STATUS_LED_PIN);
 			
 			ck5 = ck6 = ck7 = 0;	
 		}
-		else if (diskByte != sectorDataHeaderGCR[writeCount] || readOnly)
+		else if (diskByte != sectorDataHeaderGCR[writeCount] || drive.readOnly)
 		{
 			// header doesn't match: start over
 			writeCount = 0;
@@ -610,7 +522,7 @@ void HandleGCRWrite()
 	}
 	else
 	{
-		uint8_t dataIn = pgm_read_byte(&disk_byte_to_sony[diskByte - 0x96]);
+		uint8_t dataIn = DiskByteToSony(diskByte);
 		uint8_t b;
 				
 		// read the sector data
@@ -684,9 +596,9 @@ void HandleGCRWrite()
 				writeTemp <<= 2;
 				if (b != ck5)
 				{
-					strncpy(textBuf, "checksum failure 0", TEXTBUF_SIZE);
 					writeErrorNumber = 62;
-					WriteError();				
+					WriteError();
+					return;
 				}
 			}
 			else if (writeCount == SECTOR_DATA_CHECKSUM_START+2)
@@ -695,9 +607,9 @@ void HandleGCRWrite()
 				writeTemp <<= 2;
 				if (b != ck6)
 				{
-					strncpy(textBuf, "checksum failure 1", TEXTBUF_SIZE);
 					writeErrorNumber = 63;
 					WriteError();
+					return;
 				}
 			}
 			else if (writeCount == SECTOR_DATA_CHECKSUM_START+3)
@@ -706,15 +618,12 @@ void HandleGCRWrite()
 				writeTemp <<= 2;
 				if (b != ck7)
 				{
-					strncpy(textBuf, "checksum failure 2", TEXTBUF_SIZE);
 					writeErrorNumber = 64;
 					WriteError();
 				}
 						
-				// success! 
-				bufferState[currentWriteBufferNumber] |= BUFFER_DATA_VALID;
-				bufferState[currentWriteBufferNumber] |= BUFFER_DIRTY;
-				bufferState[currentWriteBufferNumber] &= ~BUFFER_LOCKED;
+				// success, unless a checksum failed
+				BufferEndWrite();
 						
 				// turn off the LED at the end of a sector write
 				PORT(STATUS_LED_PORT) |= (1<<STATUS_LED_PIN);
@@ -735,6 +644,12 @@ void HandleGCRWrite()
 	writeCount++;				
 }
 
+void MFMChecksumError()
+{
+	writeErrorNumber = 70;
+	WriteError();
+}
+
 void CheckMFMCRC(uint8_t bufferNumber)
 {
 	uint16_t receivedCRC = crc;
@@ -751,11 +666,7 @@ void CheckMFMCRC(uint8_t bufferNumber)
 	}			
 	
 	if (crc != receivedCRC)
-	{
-		strncpy(textBuf, "checksum fail", TEXTBUF_SIZE);
-		writeErrorNumber = 70;
-		WriteError();
-	}	
+		MFMChecksumError();
 }
 
 // pin state change interrupt: WR_TICK
@@ -768,7 +679,7 @@ ISR(PCINT0_vect)
 	{
 		wrTick = wrTickBit;
 		
-		if (!mfmMode)
+		if (!drive.mfmMode)
 		{
 			HandleGCRWrite();
 		}	
@@ -791,22 +702,17 @@ ISR(PCINT0_vect)
 						writeCount++;
 						
 						// header received OK!
-						currentWriteBufferNumber = currentSector; // assume the buffer to write was the last one read	
+						uint8_t trackLen = drive.trackSectors;
+						currentWriteBufferNumber = BeginSectorWrite(trackLen, drive.currentSector); // assume the sector to write was the last one read	
 					
-						if (bufferState[currentWriteBufferNumber] & BUFFER_LOCKED)
+						if (currentWriteBufferNumber == BUFFER_NONE)
 						{
-							snprintf(textBuf, TEXTBUF_SIZE, "buf locked %d/%d:%d", currentTrack, currentSide, currentSector);
 							writeErrorNumber = 71;
 							WriteError();
 							return;		
 						}
 										
 						pSectorBuf = sectorBuf[currentWriteBufferNumber];
-						bufferState[currentWriteBufferNumber] |= BUFFER_LOCKED;
-						bufferState[currentWriteBufferNumber] &= ~BUFFER_DATA_VALID;
-						wrTrack = currentTrack;
-						wrSide = currentSide;
-						wrSector = currentSector; // assume the buffer to write was the last one read		
 						
 						// turn on the LED when receiving a sector write
 						PORT(STATUS_LED_PORT) &= ~(1<<STATUS_LED_PIN);
@@ -845,10 +751,8 @@ ISR(PCINT0_vect)
 					
 					CheckMFMCRC(currentWriteBufferNumber);
 					
-					// success! 
-					bufferState[currentWriteBufferNumber] |= BUFFER_DATA_VALID;
-					bufferState[currentWriteBufferNumber] |= BUFFER_DIRTY;
-					bufferState[currentWriteBufferNumber] &= ~BUFFER_LOCKED;
+					// success, unless the CRC failed
+					BufferEndWrite();
 						
 					// turn off the LED at the end of a sector write
 					PORT(STATUS_LED_PORT) |= (1<<STATUS_LED_PIN);
@@ -861,183 +765,248 @@ ISR(PCINT0_vect)
 	}
 }
 	
-void SendByte(uint8_t b)
-{								
+// Hand one byte to the CPLD, and wait until it has taken the byte. Interrupts are disabled so the STEP interrupt,
+// which borrows RD_READY to send TK0, can't land in the middle of the handshake.
+static inline void PutCpldByte(uint8_t b)
+{
 	cli();
 	
-	if (!writeMode)
-	{		
-		PORT(CPLD_DATA_PORT) = b & 0x7F;	
-		PORT(CPLD_RD_READY_TK0_PORT) |= (1<<CPLD_RD_READY_TK0_PIN);		
-		
-		// wait for ack to go high, then low
-		// TODO: find a way to avoid two busy waits here-- can it be done with just one?
-		while (bit_is_clear(PIN(CPLD_RD_ACK_WR_TICK_PORT), CPLD_RD_ACK_WR_TICK_PIN)) 
-		{}
-	
-		// is this really needed? Probably - when sending literal data like the GCR address header
-		// the AVR is probably fast enough to call SendByte twice within the space of a single bit (320 clock cycles)
-		// which would then do the wrong thing without this second busy wait.
-		while (bit_is_set(PIN(CPLD_RD_ACK_WR_TICK_PORT), CPLD_RD_ACK_WR_TICK_PIN)) 
-		{}
-						
-		// clear the read byte ready flag	
-		PORT(CPLD_RD_READY_TK0_PORT) &= ~(1<<CPLD_RD_READY_TK0_PIN);	
+	// the Mac started writing, and the data port is an input. No CPLD acks a byte during a write.
+	if (writeMode)
+	{
+		sei();
+		return;
 	}
-		
-	sei();	
-}
-
-// make a 6-bit result from the top 2 bits of three input bytes
-#define nib4(__c0, __c1, __c2) \
-	(((__c0 & 0xC0) >> 2) | ((__c1 & 0xC0) >> 4) | ((__c2 & 0xC0) >> 6))
+	
+	PORT(CPLD_DATA_PORT) = b;	
+	PORT(CPLD_RD_READY_TK0_PORT) |= (1<<CPLD_RD_READY_TK0_PIN);		
+	HandshakeTimestamp(readyTime);
+	
+	// wait for ack to go high, then low
+	while (bit_is_clear(PIN(CPLD_RD_ACK_WR_TICK_PORT), CPLD_RD_ACK_WR_TICK_PIN)) 
+	{}
+	HandshakeTimestamp(ackTime);
 
-// rotate left
-#define rot_ck0(__ck0)						\
-	do {									\
-		__ck0 &= 0xFF;						\
-		__ck0 = (__ck0 << 1) | (__ck0 >> 7);\
-	} while(0)
+	// the second wait is still needed: the next call would otherwise see this byte's ack and return early
+	while (bit_is_set(PIN(CPLD_RD_ACK_WR_TICK_PORT), CPLD_RD_ACK_WR_TICK_PIN)) 
+	{}
+					
+	// clear the read byte ready flag	
+	PORT(CPLD_RD_READY_TK0_PORT) &= ~(1<<CPLD_RD_READY_TK0_PIN);	
+	
+	sei();
+	
+	HandshakeRecord(readyTime, ackTime);
+}
 
-// ADC __ckr, __in; __out = __in ^ __ckl
-#define enc_byte(__in, __out, __ckl, __ckr)	\
-	do {									\
-		uint8_t __d = __in;					\
-		__ckr += __d;						\
-		__ckr += (__ckl & 0x100) >> 8;		\
-		__ckl &= 0xFF;						\
-		__out = __d ^ __ckl;				\
-	} while(0)
+void SendByte(uint8_t b)
+{								
+	PutCpldByte(b & 0x7F);
+}
 
 #define SendByteAndCheckRestart(b)			\
 	do {									\
 		if (restartDisk)					\
-			goto restart;					\
+			return false;					\
 		SendByte(b);						\
 	} while(0)
 		
-void SendMFMSync()
+// Hand half of an MFM byte to the CPLD: X 0 0 M D3 D2 D1 D0, where M is the sync flag. Unlike PutCpldByte(),
+// this leaves interrupts enabled.
+static inline void PutMFMNibble(uint8_t nibble)
 {
-	// send A1 sync
-	
-	// SendByte
 	// TODO: what if an interrupt has switched the data port to an input? This will turn on pull-ups
-	PORT(CPLD_DATA_PORT) = 0x0A; // data in bits 3-0, sync flag in bit 4	
+	PORT(CPLD_DATA_PORT) = nibble;	
 	PORT(CPLD_RD_READY_TK0_PORT) |= (1<<CPLD_RD_READY_TK0_PIN);		
+	HandshakeTimestamp(readyTime);
+	
 	// wait for ack to go high, then low
 	while (bit_is_clear(PIN(CPLD_RD_ACK_WR_TICK_PORT), CPLD_RD_ACK_WR_TICK_PIN));
+	HandshakeTimestamp(ackTime);
 	while (bit_is_set(PIN(CPLD_RD_ACK_WR_TICK_PORT), CPLD_RD_ACK_WR_TICK_PIN));
 	PORT(CPLD_RD_READY_TK0_PORT) &= ~(1<<CPLD_RD_READY_TK0_PIN);
+	
+	HandshakeRecord(readyTime, ackTime);
+}
+
+void SendMFMSync()
+{
+	// send A1 sync
+	PutMFMNibble(0x0A); // data in bits 3-0, sync flag in bit 4
 
 	crc = (crc << 8) ^ pgm_read_word(&crc_ccitt[(uint8_t)(crc >> 8) ^ 0xA1]);
 	
-	// SendByte
-	// TODO: what if an interrupt has switched the data port to an input? This will turn on pull-ups
-	PORT(CPLD_DATA_PORT) = 0x11; // data in bits 3-0, sync flag in bit 4	
-	PORT(CPLD_RD_READY_TK0_PORT) |= (1<<CPLD_RD_READY_TK0_PIN);		
-	// wait for ack to go high, then low
-	while (bit_is_clear(PIN(CPLD_RD_ACK_WR_TICK_PORT), CPLD_RD_ACK_WR_TICK_PIN));
-	while (bit_is_set(PIN(CPLD_RD_ACK_WR_TICK_PORT), CPLD_RD_ACK_WR_TICK_PIN));
-	PORT(CPLD_RD_READY_TK0_PORT) &= ~(1<<CPLD_RD_READY_TK0_PIN);		
-}	
+	PutMFMNibble(0x11);
+}
+
+// Reset the CRC, and send the three A1 syncs that begin an address or data block
+void SendMFMSyncs()
+{
+	crc = 0xFFFF;
+	SendMFMSync();
+	SendMFMSync();
+	SendMFMSync();
+}
 	
 void SendMFMByte(uint8_t data)
 {	
 	// send X 0 0 0 D7 D6 D5 D4
-	uint8_t out = (data >> 4) & 0x0F;
-	
-	//if (restartDisk)
-	//	return;
-		 
-	// SendByte
-	// TODO: what if an interrupt has switched the data port to an input? This will turn on pull-ups
-	PORT(CPLD_DATA_PORT) = out;	
-	PORT(CPLD_RD_READY_TK0_PORT) |= (1<<CPLD_RD_READY_TK0_PIN);		
-	// wait for ack to go high, then low
-	while (bit_is_clear(PIN(CPLD_RD_ACK_WR_TICK_PORT), CPLD_RD_ACK_WR_TICK_PIN));
-	while (bit_is_set(PIN(CPLD_RD_ACK_WR_TICK_PORT), CPLD_RD_ACK_WR_TICK_PIN));
-	PORT(CPLD_RD_READY_TK0_PORT) &= ~(1<<CPLD_RD_READY_TK0_PIN);
-
-	// send X 0 0 0 D3 D2 D1 d0
-	out = (data & 0x0F);
+	PutMFMNibble((data >> 4) & 0x0F);
 		
 	crc = (crc << 8) ^ pgm_read_word(&crc_ccitt[(uint8_t)(crc >> 8) ^ data]);		
 	
-	//if (restartDisk)
-	//	return;
-			
-	// SendByte
-	// TODO: what if an interrupt has switched the data port to an input? This will turn on pull-ups
-	PORT(CPLD_DATA_PORT) = out;	
-	PORT(CPLD_RD_READY_TK0_PORT) |= (1<<CPLD_RD_READY_TK0_PIN);		
-	// wait for ack to go high, then low
-	while (bit_is_clear(PIN(CPLD_RD_ACK_WR_TICK_PORT), CPLD_RD_ACK_WR_TICK_PIN));
-	while (bit_is_set(PIN(CPLD_RD_ACK_WR_TICK_PORT), CPLD_RD_ACK_WR_TICK_PIN));
-	PORT(CPLD_RD_READY_TK0_PORT) &= ~(1<<CPLD_RD_READY_TK0_PIN);
+	// send X 0 0 0 D3 D2 D1 D0
+	PutMFMNibble(data & 0x0F);
+}
+
+// send the CRC of everything since the syncs
+void SendMFMCRC()
+{
+	uint16_t c = crc;
+	SendMFMByte(c >> 8);
+	SendMFMByte(c & 0xFF);
 }
 	
 #define SendMFMAndCheckRestart(d)			\
 	do {									\
 		if (restartDisk)					\
-			goto restart;					\
+			return false;					\
 		SendMFMByte(d);						\
 	} while(0)
-			
-void SendGCRSectorData(const uint8_t* data)
-{
-	uint16_t ck0, ck1, ck2;
-	uint8_t b0, b1, b2;
-	uint8_t i;
-	static const uint8_t tags[] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
-	const uint8_t* p = tags;
 
-	ck0 = ck1 = ck2 = 0;
+// Sector encoders: send one sector, with the gap before it, and return false if the disk must restart first.
+// The gap lengths come from the disk's format, so a turbo format sends shorter ones.
 
-	// Do 12 bytes of tags plus 510 bytes of data
-	for (i = 0; i < 174; i++) 
+bool SendMFMSector(uint8_t trackNumber, uint8_t sideNumber, uint8_t sector, const uint8_t* data)
+{
+	uint8_t syncs = drive.format.syncs;
+	uint8_t addressDataGap = drive.format.addressDataGap;
+	
+	// insert sector-to-sector gap bytes
+	HandshakeSite(HS_SITE_GAP);
+	for (uint8_t i=drive.format.sectorGap; i>0; i--)
 	{
-		if (i == 4)
-			p = data;
-	
-		rot_ck0(ck0); // ROL byte by 1 bit
-		enc_byte(*(p++), b0, ck0, ck2);
-		enc_byte(*(p++), b1, ck2, ck1);
-		enc_byte(*(p++), b2, ck1, ck0);
-		SendByte(pgm_read_byte(&sony_to_disk_byte[nib4(b0, b1, b2)]));
-		SendByte(pgm_read_byte(&sony_to_disk_byte[b0 & 0x3F]));
-		
-		// was there a disk restart?
-		if (restartDisk)
-			return;
-			
-		SendByte(pgm_read_byte(&sony_to_disk_byte[b1 & 0x3F]));	
-		SendByte(pgm_read_byte(&sony_to_disk_byte[b2 & 0x3F]));	
+		SendMFMAndCheckRestart(0x4E);
 	}
+	
+	// insert sync bytes
+	for (uint8_t i=0; i<syncs; i++)
+	{
+		SendMFMAndCheckRestart(0x00);
+	}
+	
+	// send the address block
+	HandshakeSite(HS_SITE_HEADER);
+	SendMFMSyncs();
+	SendMFMAndCheckRestart(0xFE);									
+	SendMFMAndCheckRestart(trackNumber);
+	SendMFMAndCheckRestart(sideNumber);
+	SendMFMAndCheckRestart(sector+1); // MFM sector numbers are 1-based
+	SendMFMAndCheckRestart(2); // size = 128 * 2^N bytes, so 2 means 512
+	SendMFMCRC();
+	
+	// insert Address to Data gap bytes
+	HandshakeSite(HS_SITE_GAP);
+	for (uint8_t i=0; i<addressDataGap; i++)
+	{
+		SendMFMAndCheckRestart(0x4E);
+	}	
+	
+	// insert sync bytes
+	for (uint8_t i=0; i<syncs; i++)
+	{
+		SendMFMAndCheckRestart(0x00);
+	}
+	
+	// send the data block
+	HandshakeSite(HS_SITE_DATA);
+	SendMFMSyncs();
+	SendMFMAndCheckRestart(0xFB);
+	
+	for (uint16_t i=0; i<SECTOR_DATA_SIZE; i++)
+	{
+		uint8_t d = data[i];
+		SendMFMAndCheckRestart(d);
+	}
+	
+	HandshakeSite(HS_SITE_CHECKSUM);
+	SendMFMCRC();
+	
+	return true;
+}
 
-	// Then do remaining 2 bytes of data
-	rot_ck0(ck0);
-	enc_byte(*(p++), b0, ck0, ck2);
-	enc_byte(*(p++), b1, ck2, ck1);
-
-	SendByte(pgm_read_byte(&sony_to_disk_byte[nib4(b0, b1, 0)]));
-	SendByte(pgm_read_byte(&sony_to_disk_byte[b0 & 0x3F]));
-	SendByte(pgm_read_byte(&sony_to_disk_byte[b1 & 0x3F]));
-
-	// And write out checksum
-	SendByte(pgm_read_byte(&sony_to_disk_byte[nib4(ck2, ck1, ck0)]));
-	SendByte(pgm_read_byte(&sony_to_disk_byte[ck2 & 0x3F]));		
-	SendByte(pgm_read_byte(&sony_to_disk_byte[ck1 & 0x3F]));		
-	SendByte(pgm_read_byte(&sony_to_disk_byte[ck0 & 0x3F]));
+bool SendGCRSector(uint8_t trackNumber, uint8_t sideNumber, uint8_t sector, const uint8_t* data)
+{
+	// ensure a short gap between sectors - otherwise once they're all cached, one sector will appear
+	// to immediately follow another on disk, which may cause problems for the Mac.
+	// Bad voodoo here:
+	// 1. In the Finder StuffIt copy test that sometimes dies after the first 18 tracks, the length of delay here
+	// seems to affect what track it will freeze on.
+	// 2. With a longer delay here, the first ~10 sectors of copying seem to have fewer or no "long writes".
+	// 3. Depending on the delay here, the Transcend 2GB SD card sometimes gets "writeStop fail" when saving tracks.
+	uint8_t addressDataGap = drive.format.addressDataGap;
+	
+	HandshakeSite(HS_SITE_GAP);
+	for (uint8_t i=drive.format.sectorGap; i>0; i--)
+	{
+		SendByteAndCheckRestart(GCR_BYTE_FF);
+	}
+																		
+	// send the address block
+	uint8_t format = (drive.numberOfDiskSides == 2) ? 0x22 : 0x02; // 0x22 = MacOS double-sided, 0x02 = single sided
+	uint8_t trackLow = (uint8_t)(trackNumber & 0x3F);
+	uint8_t trackHigh = (uint8_t)((sideNumber << 5) | (trackNumber >> 6));
+	uint8_t checksum = (uint8_t)((trackLow ^ sector ^ trackHigh ^ format) & 0x3F);                  
+
+	HandshakeSite(HS_SITE_HEADER);
+	SendByteAndCheckRestart(GCR_MARK_D5);	
+	SendByteAndCheckRestart(GCR_MARK_AA);
+	SendByteAndCheckRestart(GCR_BYTE_96);
+	SendByteAndCheckRestart(GCRDiskByte(trackLow));
+	SendByteAndCheckRestart(GCRDiskByte(sector));
+	SendByteAndCheckRestart(GCRDiskByte(trackHigh));
+	SendByteAndCheckRestart(GCRDiskByte(format));
+	SendByteAndCheckRestart(GCRDiskByte(checksum));
+	SendByteAndCheckRestart(GCR_BYTE_DE);
+	SendByteAndCheckRestart(GCR_MARK_AA);
+
+	// insert sync bytes between the address and data blocks
+	HandshakeSite(HS_SITE_GAP);
+	for (uint8_t i=0; i<addressDataGap; i++)
+	{
+		SendByteAndCheckRestart(GCR_BYTE_FF);
+	}	
+			  
+	// send the data block
+	HandshakeSite(HS_SITE_DATA);
+	SendByteAndCheckRestart(GCR_MARK_D5);			
+	SendByteAndCheckRestart(GCR_MARK_AA);
+	SendByteAndCheckRestart(GCR_BYTE_AD);
+	SendByteAndCheckRestart(GCRDiskByte(sector));
+					
+	SendGCRSectorData(data);
+	
+	SendByteAndCheckRestart(GCR_BYTE_DE);
+	SendByteAndCheckRestart(GCR_MARK_AA);
+	SendByteAndCheckRestart(GCR_BYTE_FF);
+	
+	return true;
 }
 
+typedef bool (*SectorEncoder)(uint8_t trackNumber, uint8_t sideNumber, uint8_t sector, const uint8_t* data);
+
+// indexed by eEncoding
+const SectorEncoder sectorEncoders[NUM_ENCODINGS] = { SendGCRSector, SendMFMSector };
+			
 SdBaseFile f;
 unsigned int sectorOffset;
+uint8_t* firmwareBuf;
 unsigned char GetNextFirmwareByte()
 {			
 	if (sectorOffset == SECTOR_DATA_SIZE)
 	{
 		// read the next sector of the XSVF file
-		if (f.read(&sectorBuf[0], SECTOR_DATA_SIZE) < 0)
+		if (f.read(firmwareBuf, SECTOR_DATA_SIZE) < 0)
 		{
 			error("SD read error R");
 		}
@@ -1046,7 +1015,7 @@ unsigned char GetNextFirmwareByte()
 		PORT(STATUS_LED_PORT) ^= (1<<STATUS_LED_PIN);
 	}
 
-	unsigned char result = sectorBuf[0][sectorOffset];
+	unsigned char result = firmwareBuf[sectorOffset];
 	
 	sectorOffset++;
 		
@@ -1064,10 +1033,20 @@ void UpdateFirmware()
 	{}
 	
 	_delay_ms(400);
+	
+	// borrow a sector buffer for the XSVF file
+	uint8_t count;
+	uint8_t bufferNumber = ArenaAlloc(ARENA_SCRATCH, 1, 1, &count);
 			
+	if (bufferNumber == ARENA_NONE)
+	{
+		LcdGoto(0,2);
+		LcdTinyStringP(PSTR("No free buffer"), TEXT_NORMAL);
+	}
 	// open the XSVF file on the SD card			
-	if (!f.open("firmware.xvf", O_RDONLY)) 
+	else if (!f.open("firmware.xvf", O_RDONLY)) 
 	{
+		ArenaFree(ARENA_SCRATCH);
 		LcdGoto(0,2);
 		LcdTinyStringP(PSTR("Could not open"), TEXT_NORMAL);
 		LcdGoto(0,3);
@@ -1075,8 +1054,10 @@ void UpdateFirmware()
 	}	
 	else
 	{	
+		firmwareBuf = sectorBuf[bufferNumber];
+		
 		// read the first sector of the XSVF file
-		if (f.read(&sectorBuf[0], SECTOR_DATA_SIZE) < 0)
+		if (f.read(firmwareBuf, SECTOR_DATA_SIZE) < 0)
 		{
 			error("SD read error R");
 		}
@@ -1092,6 +1073,7 @@ void UpdateFirmware()
 		}
 		
 		f.close();
+		ArenaFree(ARENA_SCRATCH);
 		
 		LcdGoto(0,2);
 		
@@ -1244,8 +1226,42 @@ void PromptForFirmwareUpdate()
 	}
 }
 
-uint32_t imageFirstBlock, imageLastBlock;
+// Give the drive a share of the sector buffers for its disk image, enough for a whole cylinder if there's room.
+// Fails if there isn't room for one side of the drive's longest track.
+bool AllocateDriveBuffers()
+{
+	uint8_t minBuffers = trackLength(0);
+	uint8_t wantBuffers = minBuffers * drive.numberOfDiskSides;
+	
+	// The write staging slots come first if they leave room for the drive. Without them writes to a busy buffer
+	// are refused.
+	if (stageSlots == 0)
+	{
+		uint8_t needFree = STAGE_SLOTS + minBuffers;
+		uint8_t count;
+		if (ArenaFreeCount() >= needFree)
+			BufferSetStaging(ArenaAlloc(ARENA_STAGING, STAGE_SLOTS, STAGE_SLOTS, &count));
+	}
+	
+	drive.firstBuffer = ArenaAlloc(ARENA_DRIVE, minBuffers, wantBuffers, &drive.numBuffers);
+	return drive.firstBuffer != ARENA_NONE;
+}
+
+// Try to grow the drive's track cache to hold a whole cylinder, if it was allocated fewer buffers because
+// they were in use elsewhere. Only called when none of the drive's buffers hold valid or dirty data.
+void GrowDriveBuffers()
+{
+	uint8_t wantBuffers = trackLength(0) * drive.numberOfDiskSides;
 	
+	if (drive.numBuffers < wantBuffers)
+	{
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		{
+			drive.numBuffers = ArenaResize(ARENA_DRIVE, drive.firstBuffer, drive.numBuffers, wantBuffers);
+		}
+	}
+}
+
 bool OpenImageFile()
 {	
 	LcdClear();
@@ -1262,7 +1278,7 @@ bool OpenImageFile()
 		if (f.open(selectedFile, O_RDONLY))
 		{
 			// TODO: How do we tell the CPLD the disk is read-only?
-			readOnly = true;
+			drive.readOnly = true;
 		}
 		else			
 		{	
@@ -1270,25 +1286,28 @@ bool OpenImageFile()
 			openOK = false;
 		}			
 	}	
-	else
-	{	
-		if (selectedFileType == DISK_IMAGE_400K || selectedFileType == DISK_IMAGE_DISKCOPY_400K)	
-		{
-			numberOfDiskSides = 1;
-		}
-		else 	
-		{
-			numberOfDiskSides = 2;
-		}	
-	}	
 		
 	// get address of file on SD
-	if (openOK && !f.contiguousRange(&imageFirstBlock, &imageLastBlock)) 
+	if (openOK && !f.contiguousRange(&drive.imageFirstBlock, &drive.imageLastBlock)) 
 	{
 		LcdTinyStringP(PSTR("image not contiguous"), TEXT_NORMAL);
 		openOK = false;
 	}
 	
+	if (openOK)
+	{
+		LoadDiskFormat(selectedDiskFormat, drive.format);
+		FormatBuildSectorOrder(drive.format, drive.sectorAfter);
+		drive.numberOfDiskSides = drive.format.sides;
+		drive.mfmMode = (drive.format.encoding == ENCODING_MFM);
+		
+		if (!AllocateDriveBuffers())
+		{
+			LcdTinyStringP(PSTR("not enough buffers"), TEXT_NORMAL);
+			openOK = false;
+		}
+	}
+	
 	if (!openOK)
 	{
 		_delay_ms(4000); // wait 4 seconds
@@ -1297,53 +1316,27 @@ bool OpenImageFile()
 	{
 		LcdGoto(0,1);
 		// show disk image type
-		switch (selectedFileType)
-		{
-			case DISK_IMAGE_400K:
-				LcdTinyStringP(PSTR("400K raw image"), TEXT_NORMAL);
-				break;
-				
-			case DISK_IMAGE_800K:
-				LcdTinyStringP(PSTR("800K raw image"), TEXT_NORMAL);
-				break;	
-
-			case DISK_IMAGE_1440K:
-				LcdTinyStringP(PSTR("1440K raw image"), TEXT_NORMAL);
-				mfmMode = true;
-				break;
-					
-			case DISK_IMAGE_DISKCOPY_400K:
-				LcdTinyStringP(PSTR("400K DiskCopy image"), TEXT_NORMAL);
-				break;
-				
-			case DISK_IMAGE_DISKCOPY_800K:
-				LcdTinyStringP(PSTR("800K DiskCopy image"), TEXT_NORMAL);
-				break;	
-
-			case DISK_IMAGE_DISKCOPY_1440K:
-				LcdTinyStringP(PSTR("1440K DiskCopy image"), TEXT_NORMAL);
-				mfmMode = true;
-				break;	
-											
-			default:
-				break;	
-		}
+		drive.diskCopyFormat = (selectedFileType == DISK_IMAGE_DISKCOPY);
+		snprintf(textBuf, TEXTBUF_SIZE, drive.diskCopyFormat ? "%s DiskCopy image" : "%s raw image", drive.format.name);
+		LcdTinyString(textBuf, TEXT_NORMAL);
 		
-		selectedFileIsDiskCopyFormat = (selectedFileType >= DISK_IMAGE_DISKCOPY_400K);
+		drive.writeErrors = 0;
 	
 		if (bit_is_set(PIN(CARD_WPROT_PORT), CARD_WPROT_PIN))
-			readOnly = true;
+			drive.readOnly = true;
 
 		// mount DiskCopy images read-only
-		if (selectedFileIsDiskCopyFormat)
-			readOnly = true;
+		if (drive.diskCopyFormat)
+			drive.readOnly = true;
 											
-		uint16_t volumeNameOffset = selectedFileIsDiskCopyFormat ? 0x424 + 0x54 : 0x424;
+		uint16_t volumeNameOffset = drive.diskCopyFormat ? 0x424 + 0x54 : 0x424;
 		f.seekSet(volumeNameOffset); // offset of the Macintosh disk name in the image file
-		f.read(&sectorBuf[0][0], SECTOR_DATA_SIZE);
-		int nameLen = sectorBuf[0][0];
-		uint8_t* name = &sectorBuf[0][1];
-		name[nameLen] = 0;
+		uint8_t volumeName[28]; // Pascal string, up to 27 chars
+		f.read(volumeName, sizeof(volumeName));
+		int nameLen = volumeName[0];
+		uint8_t* name = &volumeName[1];
+		if (nameLen < 21)
+			name[nameLen] = 0;
 		name[21] = 0; // in case nameLen was bogus, terminate the string after 21 chars, which is the longest displayable name on the LCD
 		LcdGoto(0,2);
 		LcdTinyString((char*)name, TEXT_NORMAL);
@@ -1351,7 +1344,7 @@ bool OpenImageFile()
 		LcdTinyStringP(PSTR("Track    Side"), TEXT_NORMAL);
 		
 		// show a lock icon if the disk image is mounted as read-only
-		if (readOnly)
+		if (drive.readOnly)
 		{
 			LcdGoto(77,0);
 			LcdWrite(LCD_DATA, 0x00);
@@ -1374,31 +1367,43 @@ void ResetDiskState()
 	{
 		// useless code to prevent the "unused" bootloader_info array from being optimized away when optimizations are turned on
 		// there's probably a nicer way to accomplish this.
-		currentTrack = bootloader_info[currentTrack];
+		drive.currentTrack = bootloader_info[drive.currentTrack];
 	
 		InitPorts();
 	
-		currentTrack = 0;
-		prevTrack = 0;
+		drive.currentTrack = 0;
+		drive.prevTrack = 0;
+		drive.prevSide = 0;
+		drive.currentSide = 0;
+		drive.diskInserted = false;
+		drive.numberOfDiskSides = 2; 
+		drive.currentSector = 0; 
+		drive.readOnly = false;
+		drive.mfmMode = false;
+		drive.diskCopyFormat = false;
+		LoadDiskFormat(FORMAT_GCR_800K, drive.format);
+		FormatBuildSectorOrder(drive.format, drive.sectorAfter);
+		
+		// release the drive's sector buffers, and the staging slots, after their writes were merged
+		for (uint8_t i=drive.firstBuffer; i<drive.firstBuffer+drive.numBuffers; i++)
+			BufferReset(i);
+		ArenaFree(ARENA_DRIVE);
+		drive.firstBuffer = 0;
+		drive.numBuffers = 0;
+		BufferSetStaging(ARENA_NONE);
+		ArenaFree(ARENA_STAGING);
+		
+		SetTrackGeometry(drive);
 		restartDisk = false;
-		currentSide = 0;
-		prevSide = 0;
 		writeMode = 0;
-		diskInserted = false;	
-		numberOfDiskSides = 2; 
-		currentSector = 0; 
-		readOnly = false;
-		mfmMode = false;
 		writeError = false;
 		writeDisplayTimer = 0;
-		tachFlutter = 0;
 		writeErrorNumber = 0;
 		writeCount = 0;
 		
-		for (uint8_t i=0; i<NUM_BUFFERS; i++)
-			bufferState[i] = 0;
+		BufferStateReset();
 		
-		// Reset the CPLD, and get its 7-bit firmware version number.
+		// Reset the CPLD, and get its firmware version number and capability bits.
 		// switch the DATA pins to inputs
 		DDR(CPLD_DATA_PORT) = 0;	
 		// indicate that the data bus has been released
@@ -1406,7 +1411,10 @@ void ResetDiskState()
 		// put the CPLD into reset
 		PORT(CPLD_RESET_PORT) &= ~(1<<CPLD_RESET_PIN);
 		_delay_ms(20);
-		cpldFirmwareVersion = PIN(CPLD_DATA_PORT) & 0x7F;
+		// the version number is in bits 5-0, and bit 6 tells what the CPLD was built with
+		uint8_t versionByte = PIN(CPLD_DATA_PORT);
+		cpldFirmwareVersion = versionByte & 0x3F;
+		cpldCapabilities = versionByte & CPLD_CAP_GCR_TRANSLATE;
 		// indicate that the data bus has been reacquired
 		PORT(CPLD_DATA_HIZ_PORT) &= ~(1<<CPLD_DATA_HIZ_PIN);	
 		// switch the DATA pins to outputs
@@ -1414,14 +1422,7 @@ void ResetDiskState()
 		// exit the CPLD from reset
 		PORT(CPLD_RESET_PORT) |= (1<<CPLD_RESET_PIN);
 	
-		// enable power to 16-bit Timer/Counter 1
-		PRR0 &= ~(1<<PRTIM1); 
-		// toggle OC1A when a counter compare match with OCR1A occurs. 
-		// use Fast-PWM OCRnA mode - this provides double-buffering of OCR1A.
-		// no clock prescale: increment counter every on clock cycle.		
-		TCCR1A = (1<<COM1A0) | (1<<WGM11) | (1<<WGM10); 
-		TCCR1B = (1<<WGM13) | (1<<WGM12) | (1<<CS10); 
-		SetTach();
+		TachInit();
 	
 		// initialize the display
 		LcdReset();
@@ -1429,44 +1430,6 @@ void ResetDiskState()
 	}
 }
 
-uint8_t NextInterleavedSector(uint8_t trackNumber, uint8_t prevSectorNumber)
-{
-	uint8_t trackLen = trackLength(trackNumber);
-			
-	if (mfmMode)
-	{
-		// 1:1 interleave
-		if (prevSectorNumber >= trackLen - 1)
-			return 0;
-		else
-			return prevSectorNumber + 1;
-	}
-	else
-	{
-		uint8_t halfTrackLen = (trackLen + 1) >> 1;
-					
-		// process sectors in interleaved order: 
-		// 12 sector tracks: 0 6 1 7 2 8 3 9 4 10 5 11 
-		// 11 sector tracks: 0 6 1 7 2 8 3 9 4 10 5
-		// 10 sector tracks: 0 5 1 6 2 7 3 8 4 9
-		//  9 sector tracks: 0 5 1 6 2 7 3 8 4
-		//  8 sector tracks: 0 4 1 5 2 6 3 7
-		//       This is how real floppies are formatted, and should improve read performance if the Mac
-		//       can't completely process sector N before sector N+1 begins. It should also improve sector-by-sector
-		//       write performance, because the Mac alternately reads (address header) and writes (data section) in
-		//       this mode, and proper interleaving means it will read the desired address header sooner if the Mac
-		//       isn't fast enough to process the sectors linearly (which it likely isn't).
-		if (prevSectorNumber > trackLen - 1 ||
-			((trackLen & 1) == 0 && prevSectorNumber == trackLen - 1) || 
-			((trackLen & 1) == 1 && prevSectorNumber == halfTrackLen - 1))
-			return 0;
-		else if (prevSectorNumber < halfTrackLen)
-			return prevSectorNumber + halfTrackLen;
-		else
-			return prevSectorNumber + 1 - halfTrackLen;	
-	}			
-}
-
 void ReadDiskCopy42Block(SdFat& sd, uint32_t blockToRead, uint8_t bufferNumber)
 {
 	// for a DiskCopy 4.2 image, read two blocks into a temp buffer, then copy the unaligned data into the sector buffer.
@@ -1490,19 +1453,41 @@ void ReadDiskCopy42Block(SdFat& sd, uint32_t blockToRead, uint8_t bufferNumber)
 	sd.card()->readStop();
 }
 
+// times to try an SD card write before giving up, so a single failure doesn't lose the unsaved sectors
+#define SD_WRITE_TRIES 3
+
+// write cylinder sectors runStart to runEnd, whose buffers are claimed, as one multi-block write
+bool WriteSectorRun(SdFat& sd, uint32_t cylinderFirstBlock, uint8_t trackLen, uint8_t runStart, uint8_t runEnd)
+{
+	if (!sd.card()->writeStart(cylinderFirstBlock + runStart, runEnd + 1 - runStart))
+		return false;
+		
+	for (uint8_t n=runStart; n<=runEnd; n++)
+	{
+		if (!sd.card()->writeData(sectorBuf[BufferNumber(n / trackLen, trackLen, n % trackLen)]))
+		{
+			sd.card()->writeStop();
+			return false;
+		}
+	}
+	
+	return sd.card()->writeStop();
+}
+
 void FlushDirtySectors(SdFat& sd, uint8_t trackNumber)
 {					
 	uint8_t trackLen = trackLength(trackNumber);
+	uint8_t buffersEnd = TrackBuffersEnd(trackLen);
 	uint8_t firstDirtyBuffer = NUM_BUFFERS, lastDirtyBuffer=0;
 	
 	// determine the dirty range
-	for (uint8_t i=0; i<trackLen*2 && i<NUM_BUFFERS; i++)
+	for (uint8_t i=drive.firstBuffer; i<buffersEnd; i++)
 	{
-		if (bufferState[i] & BUFFER_DIRTY)
+		if (BufferDirty(i))
 		{
-			if (wrTrack != trackNumber)
+			if (drive.wrTrack != trackNumber)
 			{
-				snprintf(textBuf, TEXTBUF_SIZE, "wr wrong track %d/%d", trackNumber, wrTrack);
+				snprintf(textBuf, TEXTBUF_SIZE, "wr wrong track %d/%d", trackNumber, drive.wrTrack);
 				error(textBuf);
 			}					
 			
@@ -1515,12 +1500,16 @@ void FlushDirtySectors(SdFat& sd, uint8_t trackNumber)
 											
 	if (firstDirtyBuffer != NUM_BUFFERS) 
 	{						
-		if (readOnly)
+		if (drive.readOnly)
 		{
+			// drop the changes, except to a sector the Mac is writing right now
 			for (uint8_t i=firstDirtyBuffer; i<=lastDirtyBuffer; i++)
-			{					
-				bufferState[i] &= ~BUFFER_DIRTY;
-				bufferState[i] &= ~BUFFER_LOCKED;
+			{
+				if (BufferClaim(i))
+				{
+					BufferMarkSaved(i);
+					BufferRelease(i);
+				}
 			}
 			
 			snprintf(textBuf, TEXTBUF_SIZE, "Reverted trk %02d   ", trackNumber);
@@ -1531,48 +1520,70 @@ void FlushDirtySectors(SdFat& sd, uint8_t trackNumber)
 		{
 			millitimerOn();
 			uint32_t t0 = millis();	
-				
-			// Are there any buffers in the dirty range that aren't actually dirty?
-			// If so, they must be read back from the card, so that the whole range can be written back
-			// as a single block.
-			// (Alternatively, the range can be written out as several non-contiguous blocks, skipping 
-			// the non-dirty buffers, but I think that would be slower.)
-			for (uint8_t i=firstDirtyBuffer; i<=lastDirtyBuffer; i++)					
-			{	
-				if (!(bufferState[i] & BUFFER_DIRTY))
-				{	
-					uint32_t blockToRead = imageFirstBlock + ((uint32_t)trackStart(trackNumber) * numberOfDiskSides + i);
-					
-					if (mfmMode)
-						blockToRead += trackLen * wrSide;
-				
-					if (!sd.card()->readBlock(blockToRead, sectorBuf[i]))
-						error("SD read error W");
-				}									
-			}
-									
-			uint32_t firstBlockToWrite = imageFirstBlock + ((uint32_t)trackStart(trackNumber) * numberOfDiskSides + firstDirtyBuffer);
 			
-			if (mfmMode)
-				firstBlockToWrite += trackLen * wrSide;
+			uint8_t cylinderLen = trackLen * drive.numberOfDiskSides;
+			uint32_t cylinderFirstBlock = drive.imageFirstBlock + (uint32_t)trackStart(trackNumber) * drive.numberOfDiskSides;
+			
+			// Write the dirty sectors back in disk order. A run of consecutive dirty sectors is written as a single
+			// multi-block write, and the run is extended across clean sectors that are in RAM when more dirty sectors
+			// follow them. Sectors stay valid after they're written, so they don't need to be read again.
+			uint8_t runStart = 0;
+			while (runStart < cylinderLen)
+			{
+				uint8_t bufferNumber = BufferNumber(runStart / trackLen, trackLen, runStart % trackLen);
+				if (!BufferDirty(bufferNumber) || bufferSector[bufferNumber] != runStart)
+				{
+					runStart++;
+					continue;
+				}
+				
+				// Claim the run's buffers, so the Mac can't change them while they're written. The run ends early at
+				// a buffer the Mac is writing, or one that no longer holds its sector. A dirty sector left out is
+				// saved later.
+				uint8_t runEnd = runStart, claimEnd = runStart;
+				bool runDirty = false;
+				for (uint8_t n=runStart; n<cylinderLen; n++)
+				{
+					bufferNumber = BufferNumber(n / trackLen, trackLen, n % trackLen);
+					if (!BufferClaim(bufferNumber))
+						break;
+					claimEnd = n + 1;
+					if (!SectorResident(n, bufferNumber))
+						break;
+					if (BufferDirty(bufferNumber))
+					{
+						runEnd = n;
+						runDirty = true;
+					}
+				}
 				
-			uint32_t numBuffersToWrite = lastDirtyBuffer + 1 - firstDirtyBuffer;					
+				for (uint8_t n=(runDirty ? runEnd+1 : runStart); n<claimEnd; n++)
+					BufferRelease(BufferNumber(n / trackLen, trackLen, n % trackLen));
+					
+				if (!runDirty)
+				{
+					runStart++;
+					continue;
+				}
 						
-			if (!sd.card()->writeStart(firstBlockToWrite, numBuffersToWrite))
-				error("SD writeStart fail");
+				// the buffers stay claimed while the write is tried again
+				uint8_t tries = 1;
+				while (!WriteSectorRun(sd, cylinderFirstBlock, trackLen, runStart, runEnd))
+				{
+					if (++tries > SD_WRITE_TRIES)
+						error("SD write error");
+				}
 			
-			for (uint8_t i=firstDirtyBuffer; i<=lastDirtyBuffer; i++)
-			{				
-				if (!sd.card()->writeData(sectorBuf[i]))
-					error("SD write error");
+				for (uint8_t n=runStart; n<=runEnd; n++)
+				{				
+					bufferNumber = BufferNumber(n / trackLen, trackLen, n % trackLen);
+					BufferMarkSaved(bufferNumber);
+					BufferRelease(bufferNumber);
+				}
 					
-				bufferState[i] &= ~BUFFER_DIRTY;
-				bufferState[i] &= ~BUFFER_LOCKED;
+				runStart = runEnd + 1;
 			}
-													
-			if (!sd.card()->writeStop())
-				error("SD writeStop fail");
-						
+			
 			writeDisplayTimer = 25;	
 			millitimerOff();
 						
@@ -1585,6 +1596,255 @@ void FlushDirtySectors(SdFat& sd, uint8_t trackNumber)
 	}	
 }
 
+// state shared by the main loop and the tasks it runs between sectors
+SdFat* taskSd;
+uint8_t streamTrack;
+uint32_t streamFirstBlock;
+uint8_t streamSide;
+bool streamMotorOn;
+uint8_t fillBuffer;
+uint8_t fillSector;
+
+// what the LCD status line currently shows, 0xFF when it must be redrawn
+#define STATUS_READ 0
+#define STATUS_IDLE 1
+#define STATUS_WRITE 2
+uint8_t shownTrack = 0xFF;
+uint8_t shownSide = 0xFF;
+uint8_t shownStatus = 0xFF;
+
+void InvalidateStatus()
+{
+	shownTrack = 0xFF;
+	shownSide = 0xFF;
+	shownStatus = 0xFF;
+	TaskPost(TASK_UI);
+}
+
+// read cylinder sector fillSector of the current track into the claimed buffer fillBuffer
+void SDFillTask()
+{
+	uint32_t blockToRead = streamFirstBlock + fillSector;
+		
+	millitimerOn();
+					
+	if (drive.diskCopyFormat)
+	{
+		ReadDiskCopy42Block(*taskSd, blockToRead, fillBuffer);
+	}	
+	else
+	{
+		if (!taskSd->card()->readBlock(blockToRead, sectorBuf[fillBuffer]))
+			error("SD read error R");
+	}
+	
+	millitimerOff();
+									
+	BufferEndFill(fillBuffer);
+}
+
+// Save the writes that were staged because their track cache buffer was busy, oldest first. Each goes to the SD
+// card, and into the cache too if the cache holds the sector. Stops at a buffer the Mac is writing, and tries
+// again next time, to keep the writes in order.
+void MergeStagedSectors(SdFat& sd)
+{
+	while (stageTail != stageHead)
+	{
+		uint8_t k = stageTail & (STAGE_SLOTS-1);
+		uint8_t track = stageTrack[k];
+		uint8_t cylinderSector = stageSector[k];
+		uint8_t* pStaged = sectorBuf[stageFirstBuffer + k];
+		uint8_t bufferNumber = BUFFER_NONE;
+		
+		if (track == drive.prevTrack)
+		{
+			uint8_t trackLen = trackLength(track);
+			bufferNumber = BufferNumber(cylinderSector / trackLen, trackLen, cylinderSector % trackLen);
+			if (!BufferClaim(bufferNumber))
+				return;
+				
+			if (SectorResident(cylinderSector, bufferNumber))
+			{
+				memcpy(sectorBuf[bufferNumber], pStaged, BUFFER_SIZE);
+			}
+			else
+			{
+				BufferRelease(bufferNumber);
+				bufferNumber = BUFFER_NONE;
+			}
+		}
+		
+		if (!drive.readOnly)
+		{
+			millitimerOn();
+			uint32_t block = drive.imageFirstBlock + (uint32_t)trackStart(track) * drive.numberOfDiskSides + cylinderSector;
+			uint8_t tries = 1;
+			while (!sd.card()->writeBlock(block, pStaged))
+			{
+				if (++tries > SD_WRITE_TRIES)
+					error("SD write error S");
+			}
+			millitimerOff();
+		}
+		
+		// the cache copy is a whole new sector, so it's saved now too
+		if (bufferNumber != BUFFER_NONE)
+		{
+			BufferMarkSaved(bufferNumber);
+			BufferRelease(bufferNumber);
+		}
+		
+		stageTail++;
+	}
+}
+
+// show the disk's count of failed writes and the last error number, or clear the write alert line if there were none
+void ShowWriteErrors()
+{
+	uint16_t count, number;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		count = drive.writeErrors;
+		number = writeErrorNumber;
+	}
+	
+	LcdGoto(0,5);
+	if (count == 0)
+	{
+		LcdTinyStringP(PSTR("                     "), TEXT_NORMAL);
+		return;
+	}
+	
+	snprintf(textBuf, TEXTBUF_SIZE, "Wr err %u last %u       ", count, number);
+	LcdTinyString(textBuf, TEXT_NORMAL);
+}
+
+// Alert that a sector write failed. The error number tells what happened: 60 a bad sector number, 61 and 71 no
+// buffer was free, 62 to 64 and 70 a bad checksum, and 1000, 2000, or 3000 plus the bytes received an incomplete
+// write cut short by a step, a side change, or the end of write mode.
+void ShowWriteError()
+{
+	uint16_t number;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		number = writeErrorNumber;
+		writeError = false;
+	}
+	
+	snprintf(textBuf, TEXTBUF_SIZE, "Write error %u        ", number);
+	LcdGoto(0,5);
+	LcdTinyString(textBuf, TEXT_INVERSE);
+	writeDisplayTimer = 25;
+}
+
+// write any dirty sectors from the current track, when idle
+void WritebackTask()
+{
+	FlushDirtySectors(*taskSd, streamTrack);
+}
+
+// show the current track, side, and read/idle state, and remove old write alerts
+void StatusTask()
+{
+	LcdBeginFrame();
+	
+	if (shownTrack != streamTrack)
+	{
+		if (streamTrack > 99)
+		{
+			// stepped past the end of the disk
+			snprintf(textBuf, TEXTBUF_SIZE, "%d", streamTrack);
+			LcdGoto(24,4);
+			LcdTinyString(textBuf, TEXT_NORMAL);
+		}
+		else
+		{
+			uint8_t digits[2];
+			digits[0] = streamTrack / 10;
+			digits[1] = streamTrack - digits[0] * 10;
+			
+			// most steps only change the last digit
+			if (shownTrack <= 99 && shownTrack / 10 == digits[0])
+				LcdDigits(28, 4, &digits[1], 1);
+			else
+				LcdDigits(24, 4, digits, 2);
+		}
+		shownTrack = streamTrack;
+	}
+	
+	if (shownSide != streamSide)
+	{
+		shownSide = streamSide;
+		uint8_t digits[2] = { streamSide, LCD_DIGIT_SPACE };
+		LcdDigits(56, 4, digits, 2);
+	}
+	
+	uint8_t status = streamMotorOn ? STATUS_READ : STATUS_IDLE;
+	if (shownStatus != status && shownStatus != STATUS_WRITE)
+	{
+		shownStatus = status;
+		LcdGoto(64,4);
+		if (streamMotorOn)
+			LcdTinyStringP(PSTR(" Read"), TEXT_NORMAL);
+		else
+		{
+			LcdTinyStringP(PSTR(" Idle"), TEXT_NORMAL);
+			ShowHandshakeStats();
+		}
+	}
+	
+	// remove old write alerts when writeDisplayTimer reaches 1, leaving the count of failed writes if there were any
+	if (writeDisplayTimer == 1)
+	{
+		writeDisplayTimer = 0;
+		ShowWriteErrors();
+	}
+	
+	LcdFlush();
+}
+
+// Tell the CPLD whether the disk is read-only (bit 0, active low), whether it's GCR (bit 1, active low),
+// and whether to do the GCR translation (bit 2), then that there is a disk.
+void InsertDisk()
+{
+	uint8_t configByte = 0;
+						
+	if (!drive.readOnly)
+		configByte |= 0x01;
+
+	if (!drive.mfmMode)
+		configByte |= 0x02;			
+
+#if CPLD_GCR_TRANSLATE
+	// GCR bytes are sent and received as 6-bit values, and translated by the CPLD
+	configByte |= 0x04;
+#endif
+
+							
+	PORT(CPLD_DATA_PORT) = configByte;
+	// asserting RD_READY without DISK_IN causes the CPLD to load config options from the data bus
+	PORT(CPLD_RD_READY_TK0_PORT) |= (1<<CPLD_RD_READY_TK0_PIN);	
+	_delay_ms(1);
+	PORT(CPLD_RD_READY_TK0_PORT) &= ~(1<<CPLD_RD_READY_TK0_PIN);
+	_delay_us(10);
+						
+	// the disk format is known now
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		SetTrackGeometry(drive);
+	}
+	TachSetTrack(drive.currentTrack, drive.mfmMode);
+	
+	// tell the CPLD there is a disk	
+	PORT(CPLD_STEP_ACK_DISK_IN_PORT) &= ~(1<<CPLD_STEP_ACK_DISK_IN_PIN);			
+	drive.diskInserted = true;
+	
+	// redraw the status line for this disk
+	InvalidateStatus();
+	
+	HandshakeStatsReset(drive.format.encoding);
+}
+
 int main(void)
 {	
 	millitimerInit();
@@ -1625,46 +1885,97 @@ int main(void)
 		PromptForFirmwareUpdate();
 	}					
 	
+#if CPLD_GCR_TRANSLATE
+	// a CPLD built without the translation would put the untranslated 6-bit values on the disk
+	if (!(cpldCapabilities & CPLD_CAP_GCR_TRANSLATE))
+	{
+		snprintf(textBuf, TEXTBUF_SIZE, "CPLD fw %d: no xlate", cpldFirmwareVersion);
+		error(textBuf);
+	}
+#endif
+
+	LoadDiskFormatSettings();
 	InitDiskMenu(sd);
 	DrawDiskMenu(sd);
 	
+	taskSd = &sd;
+	SchedulerInit();
+	TaskInit(TASK_SD_FILL, SDFillTask, TASK_NOW);
+	TaskInit(TASK_WRITEBACK, WritebackTask, TASK_WHEN_IDLE);
+	TaskInit(TASK_UI, StatusTask, TASK_TICKS(100));
+	
 	// main loop				
 	while (true)
 	{	
 		if (writeError)
 		{
-			// report error encounted in the interrupt routine
-			error(textBuf);
+			// report the sector write that the interrupt routine dropped, and carry on
+			ShowWriteError();
 		}	
 		
 		cli();
-		uint8_t trackNumber = currentTrack;	// save track in a local var, since currentTrack is volatile
-		uint8_t sideNumber = currentSide; // save side in a local var, since currentSide is volatile
+		uint8_t trackNumber = drive.currentTrack;	// save track in a local var, since currentTrack is volatile
+		uint8_t sideNumber = drive.currentSide; // save side in a local var, since currentSide is volatile
+		uint8_t trackLen = drive.trackSectors;
+		uint16_t trackFirstSector = drive.trackFirstSector;
+		uint8_t orderBase = drive.trackOrderBase;
 		restartDisk = false;
 		sei();
-								
-		if (diskInserted)
+
+		if (drive.diskInserted)
 		{											
-			// show the current track and side
-			snprintf(textBuf, TEXTBUF_SIZE, "%02d", trackNumber);
-			LcdGoto(24,4);
-			LcdTinyString(textBuf, TEXT_NORMAL);
-			snprintf(textBuf, TEXTBUF_SIZE, "%d ", sideNumber);
-			LcdGoto(56,4);
-			LcdTinyString(textBuf, TEXT_NORMAL);
+			// show the current track and side, once there's time
+			streamTrack = trackNumber;
+			streamFirstBlock = drive.imageFirstBlock + (uint32_t)trackFirstSector * drive.numberOfDiskSides;
+			streamSide = sideNumber;
+			TaskPost(TASK_UI);
 									 
-			// sync RAM buffer with SD card when switching tracks, or also when switching sides for mfmMode
-			if (prevTrack != trackNumber || (mfmMode && (prevSide != sideNumber)))
+			// sync RAM buffer with SD card when switching tracks. Both sides of the cylinder share the buffers, so
+			// switching sides doesn't require a flush.
+			if (drive.prevTrack != trackNumber)
 			{		
-				// write any dirty sectors from the previous track/side back to the SD card	
-				FlushDirtySectors(sd, prevTrack);	
-				prevTrack = trackNumber;
-				prevSide = sideNumber;
-										
+				TachSetTrack(trackNumber, drive.mfmMode);
+				
+				// write any dirty sectors from the previous track back to the SD card	
+				FlushDirtySectors(sd, drive.prevTrack);	
+				
+				// pick up the new track where its skew puts it under the head
+				if (drive.format.skew)
+				{
+					if (drive.currentSector >= trackLen)
+						drive.currentSector = 0;
+					uint8_t tracksStepped = trackNumber > drive.prevTrack ? trackNumber - drive.prevTrack : drive.prevTrack - trackNumber;
+					for (uint8_t n = ((uint16_t)tracksStepped * drive.format.skew) % trackLen; n; n--)
+						drive.currentSector = drive.sectorAfter[orderBase + drive.currentSector];
+				}
+				
 				// Also mark all the buffers on this track as invalid, since they don't contain valid data for the new track.
-				for (uint8_t i=0; i<NUM_BUFFERS; i++)
-					bufferState[i] &= ~BUFFER_DATA_VALID;
+				// Each one is claimed first. The step ended any write to them, and new writes are staged until prevTrack
+				// is updated, so this doesn't wait.
+				for (uint8_t i=drive.firstBuffer; i<drive.firstBuffer+drive.numBuffers; i++)
+				{
+					while (!BufferClaim(i))
+					{}
+					bufferValid[i] = 0;
+					BufferRelease(i);
+				}
+					
+				GrowDriveBuffers();
+				
+				// only now let the interrupt routines write to the buffers for the new track
+				drive.prevTrack = trackNumber;
+				drive.prevSide = 0xFF;
+			}
+			
+			// Fast seek: the Mac usually moves to a new track or side to continue a sequential transfer, so start
+			// there from the first sector rather than wherever the rotation has got to.
+			if (drive.prevSide != sideNumber)
+			{
+				if (drive.format.fastSeek)
+					drive.currentSector = 0;
+				drive.prevSide = sideNumber;
 			}
+			
 			// continuously replay sectors from this track/side until interrupted 		
 			while (!restartDisk)
 			{																															
@@ -1675,18 +1986,25 @@ int main(void)
 					// show write state
 					LcdGoto(64,4);
 					LcdTinyStringP(PSTR("Write"), TEXT_NORMAL);
+					shownStatus = STATUS_WRITE;
 					
 					while (!restartDisk)
 					{}					
+					
+					// With fast seek, go on from the sector after the one the Mac just wrote, since that one has
+					// already gone by. Otherwise it's sent again.
+					if (drive.format.fastSeek && drive.currentSector < trackLen)
+						drive.currentSector = drive.sectorAfter[orderBase + drive.currentSector];
+					
+					// show read or idle again after the write
+					shownStatus = 0xFF;
 				}
 				else if (trackNumber <= 79)
 				{								
-					uint8_t trackLen = trackLength(trackNumber);
-					
 					// when stepping from a track with more sectors to one with fewer, current sector number could potentially
 					// end up out of range
-					if (currentSector >= trackLen)
-						currentSector = 0;
+					if (drive.currentSector >= trackLen)
+						drive.currentSector = 0;
 						
 					bool prevMotorOn = !bit_is_clear(PIN(CPLD_STEP_DIR_MOTOR_ON_PORT), CPLD_STEP_DIR_MOTOR_ON_PIN);
 					
@@ -1697,10 +2015,12 @@ int main(void)
 						{
 							PORT(CPLD_RD_READY_TK0_PORT) &= ~(1<<CPLD_RD_READY_TK0_PIN);
 							PORT(CPLD_STEP_ACK_DISK_IN_PORT) |= (1<<CPLD_STEP_ACK_DISK_IN_PIN);
-							diskInserted = false;
+							drive.diskInserted = false;
 							
-							// write any dirty sectors from the current track
+							// write any staged and dirty sectors from the current track
+							MergeStagedSectors(sd);
 							FlushDirtySectors(sd, trackNumber);
+							DumpHandshakeStats();
 					
 							_delay_ms(100);
 							ResetDiskState();
@@ -1712,209 +2032,74 @@ int main(void)
 	
 						// show read/idle state
 						bool motorOn = bit_is_clear(PIN(CPLD_STEP_DIR_MOTOR_ON_PORT), CPLD_STEP_DIR_MOTOR_ON_PIN);
+						streamMotorOn = motorOn;
 						
 						if (!motorOn)
 						{
 							// write any dirty sectors from the current track, when idle
-							FlushDirtySectors(sd, trackNumber);
+							TaskPost(TASK_WRITEBACK);
 						}
 						
 						if (prevMotorOn != motorOn)
 						{
 							prevMotorOn = motorOn;
-							LcdGoto(64,4);
-							if (motorOn)
-								LcdTinyStringP(PSTR(" Read"), TEXT_NORMAL);
-							else
+							if (!motorOn)
 							{
-								LcdTinyStringP(PSTR(" Idle"), TEXT_NORMAL);
 								// turn LED off when idle
 								PORT(STATUS_LED_PORT) |= (1<<STATUS_LED_PIN);
-								
 								writeDisplayTimer = 1; // clear old write alerts when going idle
-							}								
+							}
+							TaskPost(TASK_UI);
 						}
-							
-						// remove old write alerts when writeDisplayTimer reaches 1
-						if (writeDisplayTimer == 1)
+						else if (writeDisplayTimer == 1)
 						{
-							writeDisplayTimer = 0;
-							LcdGoto(0,5);
-							LcdTinyStringP(PSTR("                     "), TEXT_NORMAL);							
-						}			
+							TaskPost(TASK_UI);
+						}
 													
-						uint8_t bufferNumber = mfmMode ? currentSector : (sideNumber * trackLen + currentSector);
+						uint8_t cylinderSector = sideNumber * trackLen + drive.currentSector;
+						uint8_t bufferNumber = BufferNumber(sideNumber, trackLen, drive.currentSector);
 						
-						bool shouldReadSector = false;			
+						// if the buffer holds an unsaved sector from the other side, save it before reusing the buffer
+						if (BufferDirty(bufferNumber) && bufferSector[bufferNumber] != cylinderSector)
+							FlushDirtySectors(sd, trackNumber);
 						
-						// atomic check and acquire of buffer lock
-						cli();	
-						if ((bufferState[bufferNumber] & BUFFER_DATA_VALID) == 0 &&
-							(bufferState[bufferNumber] & BUFFER_LOCKED) == 0)
+						// claim the buffer, so the Mac won't write to it while we're reading it from SD
+						if (!SectorResident(cylinderSector, bufferNumber) && BufferBeginFill(bufferNumber, cylinderSector))
 						{
-							// lock the buffer, so the Mac won't write to it while we're reading it from SD
-							bufferState[bufferNumber] |= BUFFER_LOCKED;	
-							shouldReadSector = true;
+							// read the sector from the SD card before it's sent
+							fillBuffer = bufferNumber;
+							fillSector = cylinderSector;
+							TaskPost(TASK_SD_FILL);
 						}			
-						sei();
 						
-						// read the sector from the SD card, if necessary
-						if (shouldReadSector)
-						{		
-							uint32_t blockToRead = imageFirstBlock + ((uint32_t)trackStart(trackNumber) * numberOfDiskSides + sideNumber * trackLen + currentSector);
-								
-							millitimerOn();
-											
-							if (selectedFileIsDiskCopyFormat)
-							{
-								ReadDiskCopy42Block(sd, blockToRead, bufferNumber);
-							}	
-							else
-							{
-								if (!sd.card()->readBlock(blockToRead, sectorBuf[bufferNumber]))
-									error("SD read error R");
-							}
-							
-							millitimerOff();
-															
-							bufferState[bufferNumber] |= BUFFER_DATA_VALID;
-							bufferState[bufferNumber] &= ~BUFFER_LOCKED;	
-						}				
+						// run the SD read, plus any other work that's waited long enough or can run because the drive is idle
+						RunTasks(motorOn);
+						
+						// a write that was staged while the sector was read must reach the cache before it's sent
+						MergeStagedSectors(sd);
 						
-						if (currentSector == 0)
+						// toggle LED during drive activity
+						if (drive.currentSector == 0 && motorOn)
 						{
-							if (motorOn)
-							{
-								// toggle LED during drive activity
-								PORT(STATUS_LED_PORT) ^= (1<<STATUS_LED_PIN);	
-							
-								if (writeDisplayTimer > 1)
-									writeDisplayTimer--;
-							}
-															
-							// "Flutter" the drive's TACH speed slightly, every time we pass sector 0 (about every 100-150ms). This avoids a bug
-							// in P_Sony_MakeSpdTbl in the 64K ROM (used in the Mac 128K and Mac 512K) where 
-							// the Mac will crash if two successive TACH measurements see the exact same speed.
-							tachFlutter += 25;
-							if (tachFlutter >= 125)
-								tachFlutter = 0;		
-														
-							// Set the timeout. OC1A will toggle after this many counts. New timeout threshold won't take effect until the next timeout.	
-							OCR1A = driveTachHalfPeriod - tachFlutter; 
-						}	
-																			
-						if (mfmMode)
-						{																							
-							// insert sector-to-sector gap bytes
-							for (uint8_t i=0; i<50; i++)
-							{
-								SendMFMAndCheckRestart(0x4E);
-							}
-							
-							// insert sync bytes
-							for (uint8_t i=0; i<12; i++)
-							{
-								SendMFMAndCheckRestart(0x00);
-							}
-							
-							// send the address block
-							crc = 0xFFFF; // reset CRC							
-							SendMFMSync();
-							SendMFMSync();
-							SendMFMSync();
-							SendMFMAndCheckRestart(0xFE);									
-							SendMFMAndCheckRestart(trackNumber);
-							SendMFMAndCheckRestart(sideNumber);
-							SendMFMAndCheckRestart(currentSector+1); // MFM sector numbers are 1-based
-							SendMFMAndCheckRestart(2); // size = 128 * 2^N bytes, so 2 means 512
-							uint8_t crc0 = (crc >> 8) & 0xFF;
-							uint8_t crc1 = crc & 0xFF;
-							SendMFMAndCheckRestart(crc0);
-							SendMFMAndCheckRestart(crc1);
-							
-							// insert Address to Data gap bytes
-							for (uint8_t i=0; i<22; i++)
-							{
-								SendMFMAndCheckRestart(0x4E);
-							}	
-							
-							// insert sync bytes
-							for (uint8_t i=0; i<12; i++)
-							{
-								SendMFMAndCheckRestart(0x00);
-							}
-							
-							// send the data block
-							crc = 0xFFFF; // reset CRC
-							SendMFMSync();
-							SendMFMSync();
-							SendMFMSync();
-							SendMFMAndCheckRestart(0xFB);
-							
-							for (uint16_t i=0; i<SECTOR_DATA_SIZE; i++)
-							{
-								uint8_t d = sectorBuf[bufferNumber][i];
-								SendMFMAndCheckRestart(d);
-							}
-							
-							crc0 = (crc >> 8) & 0xFF;
-							crc1 = crc & 0xFF;
-							SendMFMAndCheckRestart(crc0);
-							SendMFMAndCheckRestart(crc1);
+							PORT(STATUS_LED_PORT) ^= (1<<STATUS_LED_PIN);	
+						
+							if (writeDisplayTimer > 1)
+								writeDisplayTimer--;
 						}	
-						else
-						{		
-							// ensure a short gap between sectors - otherwise once they're all cached, one sector will appear
-							// to immediately follow another on disk, which may cause problems for the Mac.
-							// Bad voodoo here:
-							// 1. In the Finder StuffIt copy test that sometimes dies after the first 18 tracks, the length of delay here
-							// seems to affect what track it will freeze on.
-							// 2. With a longer delay here, the first ~10 sectors of copying seem to have fewer or no "long writes".
-							// 3. Depending on the delay here, the Transcend 2GB SD card sometimes gets "writeStop fail" when saving tracks.
-							for (uint16_t i=0; i<INTER_SECTOR_GAP_SIZE; i++)
-							{
-								SendByteAndCheckRestart(0xFF);
-							}
-																								
-							// send the address block
-							uint8_t format = (numberOfDiskSides == 2) ? 0x22 : 0x02; // 0x22 = MacOS double-sided, 0x02 = single sided
-							uint8_t trackLow = (uint8_t)(trackNumber & 0x3F);
-							uint8_t trackHigh = (uint8_t)((sideNumber << 5) | (trackNumber >> 6));
-							uint8_t checksum = (uint8_t)((trackLow ^ currentSector ^ trackHigh ^ format) & 0x3F);                  
-
-							SendByteAndCheckRestart(0xD5);	
-							SendByteAndCheckRestart(0xAA);
-							SendByteAndCheckRestart(0x96);
-							SendByteAndCheckRestart(pgm_read_byte(&sony_to_disk_byte[trackLow]));
-							SendByteAndCheckRestart(pgm_read_byte(&sony_to_disk_byte[currentSector]));
-							SendByteAndCheckRestart(pgm_read_byte(&sony_to_disk_byte[trackHigh]));
-							SendByteAndCheckRestart(pgm_read_byte(&sony_to_disk_byte[format]));
-							SendByteAndCheckRestart(pgm_read_byte(&sony_to_disk_byte[checksum]));
-							SendByteAndCheckRestart(0xDE);
-							SendByteAndCheckRestart(0xAA);
 						
-							// insert sync bytes between the address and data blocks
-							for (uint8_t i=0; i<ADDRESS_DATA_GAP_SIZE; i++)
-							{
-								SendByteAndCheckRestart(0xFF);
-							}	
-									  
-							// send the data block
-							SendByteAndCheckRestart(0xD5);			
-							SendByteAndCheckRestart(0xAA);
-							SendByteAndCheckRestart(0xAD);
-							SendByteAndCheckRestart(pgm_read_byte(&sony_to_disk_byte[currentSector]));
-					
-							SendGCRSectorData((const uint8_t*)sectorBuf[bufferNumber]);
-							
-							SendByteAndCheckRestart(0xDE);
-							SendByteAndCheckRestart(0xAA);
-							SendByteAndCheckRestart(0xFF);			
-						}		
+																			
+						// send the sector, with the encoder for this disk's format
+						if (!sectorEncoders[drive.format.encoding](trackNumber, sideNumber, drive.currentSector, sectorBuf[bufferNumber]))
+							goto restart;
 										
-						currentSector = NextInterleavedSector(trackNumber, currentSector);
+						drive.currentSector = drive.sectorAfter[orderBase + drive.currentSector];
 					}
-				}											
+				}
+				else
+				{
+					// there's no such track to send, so just keep the status line up to date
+					RunTasks(true);
+				}
 			}		
 restart: ;					
 		}
@@ -1955,9 +2140,19 @@ restart: ;
 				{
 					if (selectedFileType == DISK_IMAGE_DIRECTORY)
 					{						
-						// remember where we came from, so we can get back later
-						char* pSubdirName = ((char*)sectorBuf[23]) + ((SHORTFILENAME_LEN+1) * subdirDepth);
-						strncpy(pSubdirName, selectedFile, SHORTFILENAME_LEN+1);
+						// remember where we came from, so we can get back later. Directories nested deeper than that can't be opened.
+						if (subdirDepth == MAX_SUBDIR_DEPTH)
+						{
+							LcdClear();
+							LcdGoto(0,2);
+							LcdTinyStringP(PSTR("Folder too deep"), TEXT_NORMAL);
+							_delay_ms(2000);
+							LcdClear();
+							DrawDiskMenu(sd);
+							break;
+						}
+						
+						strncpy(subdirNames[subdirDepth], selectedFile, SHORTFILENAME_LEN+1);
 						subdirDepth++;
 					
 						sd.chdir(selectedFile, true);
@@ -1975,8 +2170,7 @@ restart: ;
 						
 						for (uint8_t i=0; i<subdirDepth; i++)
 						{
-							char* pSubdirName = ((char*)sectorBuf[23]) + ((SHORTFILENAME_LEN+1) * i);
-							sd.chdir(pSubdirName, true);	
+							sd.chdir(subdirNames[i], true);	
 						}
 						
 						diskMenuSelection = 0;
@@ -1993,32 +2187,21 @@ restart: ;
 						PCICR |= (1<<CPLD_WR_REQ_INT_ENABLE);
 						PCICR |= (1<<CPLD_RD_ACK_WR_TICK_INT_ENABLE);
 	
-						currentTrack = 0;	
+						drive.currentTrack = 0;	
 						LcdReset(); // also resets the CPLD, ensures it knows we're now at track 0
 						LcdClear();
 						
-						// "insert" the disk
+						// "insert" the disk, giving it the sector buffers that held the menu
+						ArenaFree(ARENA_MENU);
 						if (OpenImageFile())
 						{			
-							// tell the CPLD whether the disk is read-only (bit 0, active low)
-							uint8_t configByte = 0;
-						
-							if (!readOnly)
-								configByte |= 0x01;
-
-							if (!mfmMode)
-								configByte |= 0x02;			
-							
-							PORT(CPLD_DATA_PORT) = configByte;
-							// asserting RD_READY without DISK_IN causes the CPLD to load config options from the data bus
-							PORT(CPLD_RD_READY_TK0_PORT) |= (1<<CPLD_RD_READY_TK0_PIN);	
-							_delay_ms(1);
-							PORT(CPLD_RD_READY_TK0_PORT) &= ~(1<<CPLD_RD_READY_TK0_PIN);
-							_delay_us(10);
-						
-							// tell the CPLD there is a disk	
-							PORT(CPLD_STEP_ACK_DISK_IN_PORT) &= ~(1<<CPLD_STEP_ACK_DISK_IN_PIN);			
-							diskInserted = true;
+							InsertDisk();
+						}
+						else
+						{
+							LcdClear();
+							InitDiskMenu(sd);
+							DrawDiskMenu(sd);
 						}
 					}						
 					break;			
@@ -0,0 +1,118 @@
+/* 
+    Floppy Emu, copyright 2013 Steve Chamberlin, "Big Mess o' Wires". All rights reserved.
+	
+    Floppy Emu is licensed under a Creative Commons Attribution-NonCommercial 3.0 Unported 
+	license. (CC BY-NC 3.0) The terms of the license may be viewed at 	
+	http://creativecommons.org/licenses/by-nc/3.0/
+	
+	Based on a work at http://www.bigmessowires.com/macintosh-floppy-emu/
+	
+    Permissions beyond the scope of this license may be available at www.bigmessowires.com
+	or from mailto:steve@bigmessowires.com.
+*/
+
+#include <avr/pgmspace.h>
+#include "gcr.h"
+#include "handshakestats.h"
+
+// supplied by the firmware, or by the host co-simulation in host/gcrsim.cpp
+void SendByte(uint8_t b);
+extern volatile bool restartDisk;
+
+const uint8_t sony_to_disk_byte[] = {
+	0x96, 0x97, 0x9A, 0x9B,  0x9D, 0x9E, 0x9F, 0xA6, /* 0x00 */
+	0xA7, 0xAB, 0xAC, 0xAD,  0xAE, 0xAF, 0xB2, 0xB3,
+	0xB4, 0xB5, 0xB6, 0xB7,  0xB9, 0xBA, 0xBB, 0xBC, /* 0x10 */
+	0xBD, 0xBE, 0xBF, 0xCB,  0xCD, 0xCE, 0xCF, 0xD3,
+	0xD6, 0xD7, 0xD9, 0xDA,  0xDB, 0xDC, 0xDD, 0xDE, /* 0x20 */
+	0xDF, 0xE5, 0xE6, 0xE7,  0xE9, 0xEA, 0xEB, 0xEC,
+	0xED, 0xEE, 0xEF, 0xF2,  0xF3, 0xF4, 0xF5, 0xF6, /* 0x30 */
+	0xF7, 0xF9, 0xFA, 0xFB,  0xFC, 0xFD, 0xFE, 0xFF
+};
+
+const uint8_t disk_byte_to_sony[] = {
+	/* table begins at disk byte 0x96, value of 0xFF is an invalid disk byte */
+	/* 0x96 */ 0x00, 0x01, 0xFF, 0xFF, 0x02, 0x03, 0xFF, 0x04,
+	/* 0x9E */ 0x05, 0x06, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	/* 0xA6 */ 0x07, 0x08, 0xFF, 0xFF, 0xFF, 0x09, 0x0A, 0x0B,
+	/* 0xAE */ 0x0C, 0x0D, 0xFF, 0xFF, 0x0E, 0x0F, 0x10, 0x11,
+	/* 0xB6 */ 0x12, 0x13, 0xFF, 0x14, 0x15, 0x16, 0x17, 0x18,
+	/* 0xBE */ 0x19, 0x1A, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	/* 0xC6 */ 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x1B, 0xFF, 0x1C,
+	/* 0xCE */ 0x1D, 0x1E, 0xFF, 0xFF, 0xFF, 0x1F, 0xFF, 0xFF,
+	/* 0xD6 */ 0x20, 0x21, 0xFF, 0x22, 0x23, 0x24, 0x25, 0x26,
+	/* 0xDE */ 0x27, 0x28, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x29,
+	/* 0xE6 */ 0x2A, 0x2B, 0xFF, 0x2C, 0x2D, 0x2E, 0x2F, 0x30,
+	/* 0xEE */ 0x31, 0x32, 0xFF, 0xFF, 0x33, 0x34, 0x35, 0x36,
+	/* 0xF6 */ 0x37, 0x38, 0xFF, 0x39, 0x3A, 0x3B, 0x3C, 0x3D,
+	/* 0xFE */ 0x3E, 0x3F
+};
+
+// make a 6-bit result from the top 2 bits of three input bytes
+#define nib4(__c0, __c1, __c2) \
+	(((__c0 & 0xC0) >> 2) | ((__c1 & 0xC0) >> 4) | ((__c2 & 0xC0) >> 6))
+
+// rotate left
+#define rot_ck0(__ck0)						\
+	do {									\
+		__ck0 &= 0xFF;						\
+		__ck0 = (__ck0 << 1) | (__ck0 >> 7);\
+	} while(0)
+
+// ADC __ckr, __in; __out = __in ^ __ckl
+#define enc_byte(__in, __out, __ckl, __ckr)	\
+	do {									\
+		uint8_t __d = __in;					\
+		__ckr += __d;						\
+		__ckr += (__ckl & 0x100) >> 8;		\
+		__ckl &= 0xFF;						\
+		__out = __d ^ __ckl;				\
+	} while(0)
+
+void SendGCRSectorData(const uint8_t* data)
+{
+	uint16_t ck0, ck1, ck2;
+	uint8_t b0, b1, b2;
+	uint8_t i;
+	static const uint8_t tags[] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+	const uint8_t* p = tags;
+
+	ck0 = ck1 = ck2 = 0;
+
+	// Do 12 bytes of tags plus 510 bytes of data
+	for (i = 0; i < 174; i++) 
+	{
+		if (i == 4)
+			p = data;
+	
+		rot_ck0(ck0); // ROL byte by 1 bit
+		enc_byte(*(p++), b0, ck0, ck2);
+		enc_byte(*(p++), b1, ck2, ck1);
+		enc_byte(*(p++), b2, ck1, ck0);
+		SendByte(GCRDiskByte(nib4(b0, b1, b2)));
+		SendByte(GCRDiskByte(b0 & 0x3F));
+		
+		// was there a disk restart?
+		if (restartDisk)
+			return;
+			
+		SendByte(GCRDiskByte(b1 & 0x3F));	
+		SendByte(GCRDiskByte(b2 & 0x3F));	
+	}
+
+	// Then do remaining 2 bytes of data
+	rot_ck0(ck0);
+	enc_byte(*(p++), b0, ck0, ck2);
+	enc_byte(*(p++), b1, ck2, ck1);
+
+	SendByte(GCRDiskByte(nib4(b0, b1, 0)));
+	SendByte(GCRDiskByte(b0 & 0x3F));
+	SendByte(GCRDiskByte(b1 & 0x3F));
+
+	// And write out checksum
+	HandshakeSite(HS_SITE_CHECKSUM);
+	SendByte(GCRDiskByte(nib4(ck2, ck1, ck0)));
+	SendByte(GCRDiskByte(ck2 & 0x3F));		
+	SendByte(GCRDiskByte(ck1 & 0x3F));		
+	SendByte(GCRDiskByte(ck0 & 0x3F));
+}
@@ -0,0 +1,60 @@
+/* 
+    Floppy Emu, copyright 2013 Steve Chamberlin, "Big Mess o' Wires". All rights reserved.
+	
+    Floppy Emu is licensed under a Creative Commons Attribution-NonCommercial 3.0 Unported 
+	license. (CC BY-NC 3.0) The terms of the license may be viewed at 	
+	http://creativecommons.org/licenses/by-nc/3.0/
+	
+	Based on a work at http://www.bigmessowires.com/macintosh-floppy-emu/
+	
+    Permissions beyond the scope of this license may be available at www.bigmessowires.com
+	or from mailto:steve@bigmessowires.com.
+*/
+
+#ifndef GCR_H_
+#define GCR_H_
+
+#include <inttypes.h>
+#include <avr/pgmspace.h>
+
+// Building with CPLD_GCR_TRANSLATE=1 moves the 6-and-2 GCR table lookups into the CPLD. The firmware
+// then sends 1 v5..v0 for a 6-bit value and 0 b5..b0 for the D5 and AA mark bytes, which are the only
+// disk bytes with no 6-bit value, and receives the same codes when the Mac writes. Requires a CPLD
+// built with GCR_TRANSLATE, which reports CPLD_CAP_GCR_TRANSLATE with its version number. See
+// CPLD-Xilinx/floppyemu-next.v, and "make cosim" in CPLD-Xilinx to check that both builds put the same
+// bytes on the disk. No released CPLD firmware has it, so the translation stays in the firmware by default.
+#ifndef CPLD_GCR_TRANSLATE
+#define CPLD_GCR_TRANSLATE 0
+#endif
+
+#define CPLD_CAP_GCR_TRANSLATE 0x40
+
+extern const uint8_t sony_to_disk_byte[] PROGMEM;
+extern const uint8_t disk_byte_to_sony[] PROGMEM;
+
+#if CPLD_GCR_TRANSLATE
+// what the firmware sends and receives for a 6-bit value, and for the mark bytes
+#define GCRDiskByte(v) (0x40 | (v))
+#define DiskByteToSony(b) (((b) & 0x40) ? ((b) & 0x3F) : 0xFF)
+#define GCR_MARK_D5 0x15
+#define GCR_MARK_AA 0x2A
+#define GCR_BYTE_96 GCRDiskByte(0x00)
+#define GCR_BYTE_AD GCRDiskByte(0x0B)
+#define GCR_BYTE_DE GCRDiskByte(0x27)
+#define GCR_BYTE_FF GCRDiskByte(0x3F)
+#else
+#define GCRDiskByte(v) pgm_read_byte(&sony_to_disk_byte[v])
+#define DiskByteToSony(b) pgm_read_byte(&disk_byte_to_sony[(b) - 0x96])
+#define GCR_MARK_D5 0xD5
+#define GCR_MARK_AA 0xAA
+#define GCR_BYTE_96 0x96
+#define GCR_BYTE_AD 0xAD
+#define GCR_BYTE_DE 0xDE
+#define GCR_BYTE_FF 0xFF
+#endif
+
+// Encode and send the 12 tag bytes and 512 data bytes of a sector, plus the checksum, with SendByte().
+// Returns early if restartDisk is set.
+void SendGCRSectorData(const uint8_t* data);
+
+#endif /* GCR_H_ */
@@ -0,0 +1,160 @@
+/* 
+    Floppy Emu, copyright 2013 Steve Chamberlin, "Big Mess o' Wires". All rights reserved.
+	
+    Floppy Emu is licensed under a Creative Commons Attribution-NonCommercial 3.0 Unported 
+	license. (CC BY-NC 3.0) The terms of the license may be viewed at 	
+	http://creativecommons.org/licenses/by-nc/3.0/
+	
+	Based on a work at http://www.bigmessowires.com/macintosh-floppy-emu/
+	
+    Permissions beyond the scope of this license may be available at www.bigmessowires.com
+	or from mailto:steve@bigmessowires.com.
+*/
+
+#include "handshakestats.h"
+
+#if HANDSHAKE_STATS
+
+#include <stdio.h>
+#include <string.h>
+#include <avr/pgmspace.h>
+#include "noklcd.h"
+#include "SdFat.h"
+#include "scheduler.h"
+#include "diskformat.h"
+#include "tach.h"
+
+// acks more than this many cycles later than one handshake after the last had a sync byte sent in between
+#define HS_ACK_JITTER_CYCLES 24
+
+// AVR cycles for the CPLD to shift out what one handshake hands it, indexed by eEncoding: 8 bit cells of
+// 41 CPLD clocks for a GCR byte, and 8 half-cells of 21 CPLD clocks for an MFM nibble. The CPLD runs from
+// the AVR's 20 MHz clock.
+extern const uint16_t handshakeCyclesByEncoding[] PROGMEM;
+const uint16_t handshakeCyclesByEncoding[NUM_ENCODINGS] = { 328, 168 };
+
+HandshakeSiteStats handshakeStats[HS_NUM_SITES];
+uint8_t handshakeSite;
+
+static uint16_t handshakeCycles;
+static uint16_t lastAck;
+// most cycles spent in the STEP interrupt routine
+static uint16_t stepMaxCycles;
+
+void HandshakeStatsReset(uint8_t encoding)
+{
+	handshakeCycles = pgm_read_word(&handshakeCyclesByEncoding[encoding]);
+	lastAck = TCNT1;
+	stepMaxCycles = 0;
+	
+	for (uint8_t i=0; i<HS_NUM_SITES; i++)
+	{
+		handshakeStats[i].count = 0;
+		handshakeStats[i].late = 0;
+		handshakeStats[i].minSlack = 0xFFFF;
+	}
+	handshakeSite = HS_SITE_GAP;
+}
+
+// Cycles from one Timer1 timestamp to a later one. Timer1 also makes the TACH signal: it counts from 0 to the
+// half period's TOP and wraps, setting TOV1, so TOV1 tells whether a later timestamp that looks smaller is really a whole tach half
+// period later. It's read after 'to', and left set if the wrap came after 'to'.
+static uint16_t Elapsed(uint16_t from, uint16_t to)
+{
+	bool wrapped = false;
+	if ((TIFR1 & (1<<TOV1)) && TCNT1 >= to)
+	{
+		TIFR1 = (1<<TOV1);
+		wrapped = true;
+	}
+	
+	if (to < from)
+		return to + (TachTopBefore(to) + 1 - from);
+	else if (wrapped)
+		return 0xFFFF;
+	else
+		return to - from;
+}
+
+// The CPLD acks at the byte boundary after RD_READY goes high, so the wait for ack is how much time the AVR had
+// to spare. If the boundary came first, the CPLD sent a sync byte and acks at the next one, a whole handshake
+// later than usual.
+void RecordHandshake(uint16_t readyTime, uint16_t ackTime)
+{
+	HandshakeSiteStats& s = handshakeStats[handshakeSite];
+	s.count++;
+	
+	uint16_t waited = (ackTime >= readyTime) ? ackTime - readyTime : ackTime + (TachTopBefore(ackTime) + 1 - readyTime);
+	uint16_t elapsed = Elapsed(lastAck, ackTime);
+	lastAck = ackTime;
+	
+	if (elapsed > handshakeCycles + HS_ACK_JITTER_CYCLES)
+		s.late++;
+	else if (waited < s.minSlack)
+		s.minSlack = waited;
+}
+
+// Interrupts are disabled for the whole step, so Timer1 wraps at most once in between.
+void RecordStep(uint16_t startTime)
+{
+	uint16_t endTime = TCNT1;
+	uint16_t cycles = (endTime >= startTime) ? endTime - startTime : endTime + (TachTopBefore(endTime) + 1 - startTime);
+	
+	if (cycles > stepMaxCycles)
+		stepMaxCycles = cycles;
+}
+
+static uint16_t SlackMicroseconds(uint8_t site)
+{
+	uint16_t minSlack = handshakeStats[site].minSlack;
+	if (minSlack == 0xFFFF)
+		return 999;
+	return minSlack / (F_CPU / 1000000);
+}
+
+// show the minimum slack in microseconds for the header, data, and checksum, and how many of their bytes were late
+void ShowHandshakeStats()
+{
+	char buf[22];
+	uint16_t late = handshakeStats[HS_SITE_HEADER].late + handshakeStats[HS_SITE_DATA].late + handshakeStats[HS_SITE_CHECKSUM].late;
+	
+	snprintf(buf, sizeof(buf), "h%u d%u c%u late %u    ", SlackMicroseconds(HS_SITE_HEADER), SlackMicroseconds(HS_SITE_DATA),
+		SlackMicroseconds(HS_SITE_CHECKSUM), late);
+	LcdGoto(0,3);
+	LcdTinyString(buf, TEXT_NORMAL);
+}
+
+// write the statistics to HSSTATS.TXT in the current directory, replacing any previous file
+void DumpHandshakeStats()
+{
+	static const char siteNames[HS_NUM_SITES][9] = { "gap", "header", "data", "checksum" };
+	static const char taskNames[NUM_TASKS][10] = { "sdfill", "writeback", "ui" };
+	char buf[48];
+	SdBaseFile dump;
+	
+	if (!dump.open("hsstats.txt", O_WRITE | O_CREAT | O_TRUNC))
+		return;
+		
+	snprintf(buf, sizeof(buf), "site count late minslack cycles=%u\r\n", handshakeCycles);
+	dump.write(buf, strlen(buf));
+	
+	for (uint8_t i=0; i<HS_NUM_SITES; i++)
+	{
+		snprintf(buf, sizeof(buf), "%s %lu %u %u\r\n", siteNames[i], handshakeStats[i].count, handshakeStats[i].late, handshakeStats[i].minSlack);
+		dump.write(buf, strlen(buf));
+	}
+	
+	// CPU share of the main loop's tasks, the rest is mostly sending bytes to the CPLD
+	for (uint8_t i=0; i<NUM_TASKS; i++)
+	{
+		snprintf(buf, sizeof(buf), "task %s %u%%\r\n", taskNames[i], TaskShare(i));
+		dump.write(buf, strlen(buf));
+	}
+	
+	snprintf(buf, sizeof(buf), "step max %u cycles\r\n", stepMaxCycles);
+	dump.write(buf, strlen(buf));
+	
+	dump.close();
+}
+
+#endif
@@ -0,0 +1,81 @@
+/* 
+    Floppy Emu, copyright 2013 Steve Chamberlin, "Big Mess o' Wires". All rights reserved.
+	
+    Floppy Emu is licensed under a Creative Commons Attribution-NonCommercial 3.0 Unported 
+	license. (CC BY-NC 3.0) The terms of the license may be viewed at 	
+	http://creativecommons.org/licenses/by-nc/3.0/
+	
+	Based on a work at http://www.bigmessowires.com/macintosh-floppy-emu/
+	
+    Permissions beyond the scope of this license may be available at www.bigmessowires.com
+	or from mailto:steve@bigmessowires.com.
+*/
+
+#ifndef HANDSHAKESTATS_H_
+#define HANDSHAKESTATS_H_
+
+#include <inttypes.h>
+
+// Building with HANDSHAKE_STATS=1 timestamps every read handshake with the CPLD, and measures how close
+// the AVR came to letting the CPLD run out of bytes, at which point it shifts out sync bytes of its own.
+// The estimate is kept separately for each part of the sector that was being sent. The minimum slack of the
+// header, data and checksum is shown on the LCD when the drive goes idle, and all of the statistics are
+// written to HSSTATS.TXT when the disk is ejected. The instrumentation itself costs some cycles on every
+// byte, so the measured margins are a little pessimistic. The longest time spent in the STEP interrupt routine
+// is recorded too, since everything else waits for it.
+#ifndef HANDSHAKE_STATS
+#define HANDSHAKE_STATS 0
+#endif
+
+typedef enum {
+	HS_SITE_GAP = 0,	// gap and sync bytes
+	HS_SITE_HEADER,		// address block
+	HS_SITE_DATA,		// data block marks and data
+	HS_SITE_CHECKSUM,	// data block checksum and trailing bytes
+	HS_NUM_SITES
+} eHandshakeSite;
+
+#if HANDSHAKE_STATS
+
+#include <avr/io.h>
+
+typedef struct HandshakeSiteStats
+{
+	uint32_t count;		// handshakes
+	uint16_t late;		// handshakes that came after the CPLD had run out of bytes
+	uint16_t minSlack;	// fewest AVR cycles the CPLD was waited for, 0xFFFF if never measured
+} HandshakeSiteStats;
+
+extern HandshakeSiteStats handshakeStats[HS_NUM_SITES];
+extern uint8_t handshakeSite;
+
+#define HandshakeSite(s) (handshakeSite = (s))
+#define HandshakeTimestamp(t) uint16_t t = TCNT1
+#define HandshakeRecord(readyTime, ackTime) RecordHandshake(readyTime, ackTime)
+#define HandshakeStepRecord(startTime) RecordStep(startTime)
+
+// Clear the statistics for a newly inserted disk, sent with the eEncoding
+void HandshakeStatsReset(uint8_t encoding);
+
+// Called after each handshake, with the Timer1 counts when RD_READY was raised and when ack was seen
+void RecordHandshake(uint16_t readyTime, uint16_t ackTime);
+
+// Called at the end of the STEP interrupt routine, with the Timer1 count when it started
+void RecordStep(uint16_t startTime);
+
+void ShowHandshakeStats();
+void DumpHandshakeStats();
+
+#else
+
+#define HandshakeSite(s)
+#define HandshakeTimestamp(t)
+#define HandshakeRecord(readyTime, ackTime)
+#define HandshakeStepRecord(startTime)
+#define HandshakeStatsReset(encoding)
+#define ShowHandshakeStats()
+#define DumpHandshakeStats()
+
+#endif
+
+#endif /* HANDSHAKESTATS_H_ */
@@ -0,0 +1,37 @@
+/*
+    Floppy Emu, copyright 2013 Steve Chamberlin, "Big Mess o' Wires". All rights reserved.
+
+    Floppy Emu is licensed under a Creative Commons Attribution-NonCommercial 3.0 Unported
+	license. (CC BY-NC 3.0) The terms of the license may be viewed at
+	http://creativecommons.org/licenses/by-nc/3.0/
+
+	Based on a work at http://www.bigmessowires.com/macintosh-floppy-emu/
+
+    Permissions beyond the scope of this license may be available at www.bigmessowires.com
+	or from mailto:steve@bigmessowires.com.
+*/
+
+// Stand-in for avr-libc's <avr/pgmspace.h> when building SdFat on the host.
+// There is no separate program memory, so everything maps to plain RAM access.
+
+#ifndef HOST_PGMSPACE_H_
+#define HOST_PGMSPACE_H_
+
+#include <inttypes.h>
+#include <string.h>
+
+#define PROGMEM
+#define PGM_P const char*
+#define PSTR(s) (s)
+
+#define pgm_read_byte(addr) (*(const uint8_t*)(addr))
+#define pgm_read_word(addr) (*(const uint16_t*)(addr))
+#define pgm_read_dword(addr) (*(const uint32_t*)(addr))
+
+#define strlen_P strlen
+#define strcpy_P strcpy
+#define strncpy_P strncpy
+#define strcmp_P strcmp
+#define memcpy_P memcpy
+
+#endif /* HOST_PGMSPACE_H_ */
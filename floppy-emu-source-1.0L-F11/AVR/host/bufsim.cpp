@@ -0,0 +1,413 @@
+/*
+	Floppy Emu, copyright 2013 Steve Chamberlin, "Big Mess o' Wires". All rights reserved.
+
+	Floppy Emu is licensed under a Creative Commons Attribution-NonCommercial 3.0 Unported
+	license. (CC BY-NC 3.0) The terms of the license may be viewed at
+	http://creativecommons.org/licenses/by-nc/3.0/
+
+	Based on a work at http://www.bigmessowires.com/macintosh-floppy-emu/
+
+	Permissions beyond the scope of this license may be available at www.bigmessowires.com
+	or from mailto:steve@bigmessowires.com.
+*/
+
+/*
+	Random interleavings of the track cache buffer protocol in ../bufferstate.h.
+
+	usage: bufsim [runs] [steps]
+
+	The main loop's side is the fill, flush and staged write merge code of ../floppyemu.cpp, for a
+	1440K cylinder of 36 sectors sharing 22 buffers, with the other 2 as the staging slots. As in
+	BeginSectorWrite(), a write goes to the staging slots when its cache buffer is busy, or when the
+	sector already has a staged write. BufferPreemptionPoint() runs the simulated write interrupt
+	routines at random between the main loop's accesses to the shared state, the way WR_TICK can
+	interrupt it, and so do the SD reads and writes, which are split in two halves. The interrupt
+	routines are never interrupted themselves, like on the AVR.
+
+	The Mac writes random sectors in several interrupts each, the first half of the data, then the
+	second, then the end of the sector, and 1 in 16 writes fails part way. Each sector's contents
+	are just the version number of the write that made them, in both halves, so a torn copy shows.
+	After every main loop action, and at the end once everything is saved, the test checks:
+	  - a buffer is never written by one side while the other owns it
+	  - a write is only refused when both staging slots are waiting to be merged
+	  - every valid buffer holds the last version the Mac wrote to its sector, untorn, unless
+	    the sector has a staged write to merge
+	  - a dirty buffer is valid unless the Mac is writing it
+	  - the SD card ends up with the last version of every sector
+	A failed write leaves its sector undefined until it's written again when it overwrote a sector
+	that wasn't saved yet, since the Mac will write it again.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+static void Preempt();
+#define BufferPreemptionPoint() Preempt()
+#include "bufferstate.h"
+
+#define TRACK_LEN 18
+#define CYLINDER_LEN (2 * TRACK_LEN)
+#define CACHE_BUFFERS (NUM_BUFFERS - STAGE_SLOTS)
+#define UNDEFINED 0xFFFFFFFF
+
+static uint32_t randomSeed;
+
+static uint32_t Random()
+{
+	randomSeed = randomSeed * 1103515245 + 12345;
+	return randomSeed >> 8;
+}
+
+static uint32_t bufferData[NUM_BUFFERS][2];
+static uint32_t sdData[CYLINDER_LEN][2];
+static uint32_t lastWritten[CYLINDER_LEN];
+static bool mainOwns[NUM_BUFFERS];
+
+static uint32_t runSeed;
+static unsigned failures;
+static const char* action = "";
+
+#define Check(cond, ...) do { if (!(cond)) { Fail(__LINE__); printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+static void Fail(int line)
+{
+	failures++;
+	printf("run %u, %s, line %d: ", runSeed, action, line);
+}
+
+static uint8_t BufferFor(uint8_t cylinderSector)
+{
+	return cylinderSector % CACHE_BUFFERS;
+}
+
+// is this a staging slot that the main loop hasn't merged yet?
+static bool SlotPending(uint8_t n)
+{
+	for (uint8_t i=stageTail; i!=stageHead; i++)
+	{
+		if (stageFirstBuffer + (i & (STAGE_SLOTS-1)) == n)
+			return true;
+	}
+	return false;
+}
+
+// --- the Mac and the write interrupt routines ---
+
+typedef enum { MAC_IDLE, MAC_FIRST_HALF, MAC_SECOND_HALF, MAC_END } eMacState;
+
+static struct
+{
+	uint8_t state;
+	uint8_t sector;
+	uint8_t buffer;
+	uint32_t version;
+	bool overwroteUnsaved;
+	bool enabled;
+} mac;
+
+static uint32_t nextVersion;
+static unsigned writes, staged, refused, aborted, fills, saved, merged;
+
+static void MacWriteData(uint8_t half)
+{
+	Check(!mainOwns[mac.buffer], "Mac wrote buffer %u owned by the main loop", mac.buffer);
+	Check(!SlotPending(mac.buffer), "Mac wrote staging slot %u before it was merged", mac.buffer);
+	bufferData[mac.buffer][half] = mac.version;
+}
+
+// one interrupt's worth of the Mac's current write
+static void MacInterrupt()
+{
+	switch (mac.state)
+	{
+		case MAC_IDLE:
+			mac.sector = Random() % CYLINDER_LEN;
+			mac.buffer = BufferFor(mac.sector);
+			mac.version = ++nextVersion;
+			mac.overwroteUnsaved = BufferDirty(mac.buffer);
+			if (!BufferStaged(0, mac.sector) && BufferBeginWrite(mac.buffer, mac.sector))
+			{
+				mac.state = MAC_FIRST_HALF;
+				break;
+			}
+			
+			mac.overwroteUnsaved = false;
+			mac.buffer = BufferBeginStagedWrite(0, mac.sector);
+			if (mac.buffer != BUFFER_NONE)
+			{
+				mac.state = MAC_FIRST_HALF;
+				staged++;
+			}
+			else
+			{
+				Check((uint8_t)(stageHead - stageTail) == STAGE_SLOTS, "write refused with a free staging slot");
+				refused++;
+			}
+			break;
+
+		case MAC_FIRST_HALF:
+		case MAC_SECOND_HALF:
+			if ((Random() & 15) == 0)
+			{
+				BufferAbortWrite();
+				if (mac.overwroteUnsaved)
+					lastWritten[mac.sector] = UNDEFINED;
+				aborted++;
+				mac.state = MAC_IDLE;
+				break;
+			}
+			MacWriteData(mac.state - MAC_FIRST_HALF);
+			mac.state++;
+			break;
+
+		case MAC_END:
+			BufferEndWrite();
+			lastWritten[mac.sector] = mac.version;
+			writes++;
+			mac.state = MAC_IDLE;
+			break;
+	}
+}
+
+static void Preempt()
+{
+	if (!mac.enabled)
+		return;
+
+	while ((Random() & 3) == 0)
+		MacInterrupt();
+}
+
+// --- the main loop, as in ../floppyemu.cpp ---
+
+static bool Claim(uint8_t n)
+{
+	if (!BufferClaim(n))
+		return false;
+	mainOwns[n] = true;
+	return true;
+}
+
+static void Release(uint8_t n)
+{
+	mainOwns[n] = false;
+	BufferRelease(n);
+}
+
+// copy a claimed buffer to the SD card, or the SD card to a claimed buffer
+static void CopyHalves(uint32_t* to, const uint32_t* from, uint8_t n)
+{
+	Check(bufferWriting != n, "main loop copying buffer %u that the Mac is writing", n);
+	to[0] = from[0];
+	Preempt();
+	to[1] = from[1];
+	Preempt();
+}
+
+static void FlushDirtySectors()
+{
+	uint8_t runStart = 0;
+	while (runStart < CYLINDER_LEN)
+	{
+		uint8_t n = BufferFor(runStart);
+		Preempt();
+		if (!BufferDirty(n) || bufferSector[n] != runStart)
+		{
+			runStart++;
+			continue;
+		}
+
+		uint8_t runEnd = runStart, claimEnd = runStart;
+		bool runDirty = false;
+		for (uint8_t s=runStart; s<CYLINDER_LEN; s++)
+		{
+			n = BufferFor(s);
+			if (!Claim(n))
+				break;
+			claimEnd = s + 1;
+			Preempt();
+			if (!SectorResident(s, n))
+				break;
+			if (BufferDirty(n))
+			{
+				runEnd = s;
+				runDirty = true;
+			}
+		}
+
+		for (uint8_t s=(runDirty ? runEnd+1 : runStart); s<claimEnd; s++)
+			Release(BufferFor(s));
+
+		if (!runDirty)
+		{
+			runStart++;
+			continue;
+		}
+
+		for (uint8_t s=runStart; s<=runEnd; s++)
+		{
+			n = BufferFor(s);
+			CopyHalves(sdData[s], bufferData[n], n);
+			if (BufferDirty(n))
+				saved++;
+			BufferMarkSaved(n);
+			Release(n);
+		}
+
+		runStart = runEnd + 1;
+	}
+}
+
+static void MergeStagedSectors()
+{
+	while (stageTail != stageHead)
+	{
+		uint8_t k = stageTail & (STAGE_SLOTS-1);
+		uint8_t s = stageSector[k];
+		uint8_t slot = stageFirstBuffer + k;
+		uint8_t n = BufferFor(s);
+
+		Preempt();
+		if (!Claim(n))
+			return;
+		Preempt();
+		if (SectorResident(s, n))
+		{
+			CopyHalves(bufferData[n], bufferData[slot], n);
+		}
+		else
+		{
+			Release(n);
+			n = BUFFER_NONE;
+		}
+
+		CopyHalves(sdData[s], bufferData[slot], slot);
+
+		if (n != BUFFER_NONE)
+		{
+			BufferMarkSaved(n);
+			Release(n);
+		}
+
+		stageTail++;
+		merged++;
+	}
+}
+
+// get a sector into RAM before it's sent
+static void PrepareSector(uint8_t s)
+{
+	uint8_t n = BufferFor(s);
+
+	if (BufferDirty(n) && bufferSector[n] != s)
+		FlushDirtySectors();
+
+	if (!SectorResident(s, n) && BufferBeginFill(n, s))
+	{
+		mainOwns[n] = true;
+		CopyHalves(bufferData[n], sdData[s], n);
+		mainOwns[n] = false;
+		BufferEndFill(n);
+		fills++;
+	}
+
+	MergeStagedSectors();
+}
+
+// --- checks, made without preemption ---
+
+static void CheckBuffers()
+{
+	for (uint8_t n=0; n<CACHE_BUFFERS; n++)
+	{
+		bool writing = (bufferWriting == n);
+		Check(!bufferClaimed[n], "buffer %u left claimed", n);
+		Check(!BufferDirty(n) || bufferValid[n] || writing, "buffer %u dirty but not valid", n);
+
+		if (bufferValid[n] && !writing && !BufferStaged(0, bufferSector[n]))
+		{
+			uint8_t s = bufferSector[n];
+			Check(BufferFor(s) == n, "buffer %u holds sector %u", n, s);
+			Check(bufferData[n][0] == bufferData[n][1], "buffer %u torn, %u/%u", n, bufferData[n][0], bufferData[n][1]);
+			Check(lastWritten[s] == UNDEFINED || bufferData[n][0] == lastWritten[s],
+				"buffer %u has version %u of sector %u, the last written was %u", n, bufferData[n][0], s, lastWritten[s]);
+		}
+	}
+}
+
+static void CheckCard()
+{
+	for (uint8_t s=0; s<CYLINDER_LEN; s++)
+	{
+		Check(sdData[s][0] == sdData[s][1], "sector %u torn on the card, %u/%u", s, sdData[s][0], sdData[s][1]);
+		Check(lastWritten[s] == UNDEFINED || sdData[s][0] == lastWritten[s],
+			"card has version %u of sector %u, the last written was %u", sdData[s][0], s, lastWritten[s]);
+	}
+}
+
+static void Run(uint32_t seed, uint32_t steps)
+{
+	runSeed = randomSeed = seed;
+	BufferStateReset();
+	BufferSetStaging(CACHE_BUFFERS);
+	for (uint8_t s=0; s<CYLINDER_LEN; s++)
+	{
+		sdData[s][0] = sdData[s][1] = 0;
+		lastWritten[s] = 0;
+	}
+	for (uint8_t n=0; n<NUM_BUFFERS; n++)
+		mainOwns[n] = false;
+	mac.state = MAC_IDLE;
+	mac.enabled = true;
+
+	for (uint32_t i=0; i<steps; i++)
+	{
+		if ((Random() & 7) == 0)
+		{
+			action = "flush";
+			FlushDirtySectors();
+		}
+		else
+		{
+			action = "fill";
+			PrepareSector(Random() % CYLINDER_LEN);
+		}
+		CheckBuffers();
+	}
+
+	// let the Mac finish its write, then save everything
+	action = "final flush";
+	while (mac.state != MAC_IDLE)
+		MacInterrupt();
+	mac.enabled = false;
+	MergeStagedSectors();
+	FlushDirtySectors();
+	Check(stageTail == stageHead, "staged writes left");
+
+	for (uint8_t n=0; n<NUM_BUFFERS; n++)
+		Check(!BufferDirty(n), "buffer %u still dirty", n);
+	CheckBuffers();
+	CheckCard();
+}
+
+int main(int argc, char* argv[])
+{
+	uint32_t runs = argc > 1 ? strtoul(argv[1], NULL, 0) : 200;
+	uint32_t steps = argc > 2 ? strtoul(argv[2], NULL, 0) : 5000;
+
+	for (uint32_t r=1; r<=runs && failures < 20; r++)
+		Run(r, steps);
+
+	printf("%u runs of %u steps: %u writes completed, %u started in a staging slot, %u refused, %u aborted\n",
+		runs, steps, writes, staged, refused, aborted);
+	printf("%u fills, %u dirty sectors saved, %u staged writes merged\n", fills, saved, merged);
+	if (failures)
+	{
+		printf("FAILED, %u problems\n", failures);
+		return 1;
+	}
+
+	printf("OK\n");
+	return 0;
+}
@@ -0,0 +1,109 @@
+/*
+	Floppy Emu, copyright 2013 Steve Chamberlin, "Big Mess o' Wires". All rights reserved.
+
+	Floppy Emu is licensed under a Creative Commons Attribution-NonCommercial 3.0 Unported
+	license. (CC BY-NC 3.0) The terms of the license may be viewed at
+	http://creativecommons.org/licenses/by-nc/3.0/
+
+	Based on a work at http://www.bigmessowires.com/macintosh-floppy-emu/
+
+	Permissions beyond the scope of this license may be available at www.bigmessowires.com
+	or from mailto:steve@bigmessowires.com.
+*/
+
+/*
+	GCR co-simulation input for the CPLD testbench (CPLD-Xilinx/testbench.v, "make cosim").
+
+	usage: gcrsim > file.hex
+
+	Runs the firmware's GCR encoder from ../gcr.cpp over a few sectors, and prints every byte it
+	sends to the CPLD in $readmemh format, one per line. The Makefile builds this twice: gcrsim
+	sends disk bytes like the standard firmware, and gcrsim-cpld sends the 6-bit codes of a
+	CPLD_GCR_TRANSLATE=1 build. The testbench checks that the CPLD turns the codes into exactly
+	the bytes of the standard build, and translates them back when the Mac writes them.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "gcr.h"
+
+// the sector layout sent by the main loop in ../floppyemu.cpp, with shorter gaps
+#define GAP_SIZE 5
+
+typedef struct SimSector
+{
+	uint8_t track;
+	uint8_t side;
+	uint8_t sector;
+	uint8_t fill; // data byte, or 0 for pseudo-random data
+} SimSector;
+
+static const SimSector simSectors[] = {
+	{ 0, 0, 0, 0x00 },
+	{ 47, 1, 5, 0 },
+	{ 79, 1, 7, 0xFF }
+};
+
+volatile bool restartDisk;
+
+void SendByte(uint8_t b)
+{
+	printf("%02X\n", b);
+}
+
+static void SendSector(const SimSector& s, const uint8_t* data)
+{
+	for (uint8_t i=0; i<GAP_SIZE; i++)
+		SendByte(GCR_BYTE_FF);
+
+	// address block
+	uint8_t format = 0x22;
+	uint8_t trackLow = (uint8_t)(s.track & 0x3F);
+	uint8_t trackHigh = (uint8_t)((s.side << 5) | (s.track >> 6));
+	uint8_t checksum = (uint8_t)((trackLow ^ s.sector ^ trackHigh ^ format) & 0x3F);
+
+	SendByte(GCR_MARK_D5);
+	SendByte(GCR_MARK_AA);
+	SendByte(GCR_BYTE_96);
+	SendByte(GCRDiskByte(trackLow));
+	SendByte(GCRDiskByte(s.sector));
+	SendByte(GCRDiskByte(trackHigh));
+	SendByte(GCRDiskByte(format));
+	SendByte(GCRDiskByte(checksum));
+	SendByte(GCR_BYTE_DE);
+	SendByte(GCR_MARK_AA);
+
+	for (uint8_t i=0; i<GAP_SIZE; i++)
+		SendByte(GCR_BYTE_FF);
+
+	// data block
+	SendByte(GCR_MARK_D5);
+	SendByte(GCR_MARK_AA);
+	SendByte(GCR_BYTE_AD);
+	SendByte(GCRDiskByte(s.sector));
+
+	SendGCRSectorData(data);
+
+	SendByte(GCR_BYTE_DE);
+	SendByte(GCR_MARK_AA);
+	SendByte(GCR_BYTE_FF);
+}
+
+int main()
+{
+	uint8_t data[512];
+
+	// the same pseudo-random data for both builds
+	srand(1);
+
+	for (unsigned s=0; s<sizeof(simSectors)/sizeof(simSectors[0]); s++)
+	{
+		for (int i=0; i<512; i++)
+			data[i] = simSectors[s].fill ? simSectors[s].fill : (uint8_t)rand();
+
+		SendSector(simSectors[s], data);
+	}
+
+	return 0;
+}
@@ -0,0 +1,460 @@
+/*
+    Floppy Emu, copyright 2013 Steve Chamberlin, "Big Mess o' Wires". All rights reserved.
+
+    Floppy Emu is licensed under a Creative Commons Attribution-NonCommercial 3.0 Unported
+	license. (CC BY-NC 3.0) The terms of the license may be viewed at
+	http://creativecommons.org/licenses/by-nc/3.0/
+
+	Based on a work at http://www.bigmessowires.com/macintosh-floppy-emu/
+
+    Permissions beyond the scope of this license may be available at www.bigmessowires.com
+	or from mailto:steve@bigmessowires.com.
+*/
+
+/*
+	Host benchmark for the SdFat layer, run against FAT16 and FAT32 image files.
+
+	usage: sdbench [profile] [scratch directory]
+	profile is one of none, fullspeed, slowcard (default fullspeed)
+
+	Each test reports host wall time, plus the simulated card time and the number of
+	commands and blocks that the firmware would have sent to the SD card. The simulated
+	numbers depend only on the code paths taken, so they can be compared between builds.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// SdBaseFile.h declares its own fpos_t, which collides with the one in glibc's stdio.h
+#define fpos_t SdFatPos_t
+#include "SdFat.h"
+#include "SdBaseFile.h"
+#undef fpos_t
+#include "sdimage.h"
+
+#define IMAGE_1440K_BLOCKS 2880
+#define DIR_FILE_COUNT 60
+#define CONTIGUOUS_ITERATIONS 50
+#define TRACK_BLOCKS 12
+
+typedef struct VolumeConfig
+{
+	const char* name;
+	uint8_t fatType;
+	uint32_t totalBlocks;
+	uint8_t blocksPerCluster;
+} VolumeConfig;
+
+// one block per cluster is the worst case for cluster chain walking
+static const VolumeConfig volumes[] = {
+	{ "fat16-512", 16, 16UL * 2048, 1 },
+	{ "fat16-4k", 16, 128UL * 2048, 8 },
+	{ "fat32-512", 32, 96UL * 2048, 1 },
+	{ "fat32-4k", 32, 512UL * 2048, 8 }
+};
+
+static uint8_t block[512];
+static uint8_t trackBuf[TRACK_BLOCKS][512];
+
+static uint64_t NowNs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//------------------------------------------------------------------------------
+// write an empty "super floppy" FAT volume to path
+
+static bool WriteBlock(FILE* fp, uint32_t blockNumber, const void* data)
+{
+	return fseek(fp, (long)blockNumber * 512, SEEK_SET) == 0 && fwrite(data, 1, 512, fp) == 512;
+}
+
+static bool FormatImage(const char* path, const VolumeConfig& v)
+{
+	FILE* fp = fopen(path, "w+b");
+	if (!fp)
+		return false;
+
+	uint16_t reserved = v.fatType == 32 ? 32 : 1;
+	uint16_t rootEntries = v.fatType == 32 ? 0 : 512;
+	uint32_t rootBlocks = (32UL * rootEntries + 511) / 512;
+	uint32_t entriesPerBlock = v.fatType == 32 ? 128 : 256;
+
+	// size the FAT so it covers every data cluster
+	uint32_t blocksPerFat = 1;
+	uint32_t clusters;
+	for (;;)
+	{
+		clusters = (v.totalBlocks - reserved - rootBlocks - 2 * blocksPerFat) / v.blocksPerCluster;
+		uint32_t needed = (clusters + 2 + entriesPerBlock - 1) / entriesPerBlock;
+		if (needed <= blocksPerFat)
+			break;
+		blocksPerFat = needed;
+	}
+
+	memset(block, 0, sizeof(block));
+	if (!WriteBlock(fp, v.totalBlocks - 1, block))
+		goto fail;
+
+	{
+		fat32_boot_t* fbs = (fat32_boot_t*)block;
+		fbs->jump[0] = 0xEB;
+		memcpy(fbs->oemId, "FEMUBNCH", 8);
+		fbs->bytesPerSector = 512;
+		fbs->sectorsPerCluster = v.blocksPerCluster;
+		fbs->reservedSectorCount = reserved;
+		fbs->fatCount = 2;
+		fbs->rootDirEntryCount = rootEntries;
+		fbs->mediaType = 0xF8;
+		fbs->totalSectors32 = v.totalBlocks;
+		if (v.fatType == 32)
+		{
+			fbs->sectorsPerFat32 = blocksPerFat;
+			fbs->fat32RootCluster = 2;
+			fbs->fat32FSInfo = 1;
+		}
+		else
+		{
+			fbs->sectorsPerFat16 = blocksPerFat;
+		}
+		fbs->bootSectorSig0 = 0x55;
+		fbs->bootSectorSig1 = 0xAA;
+		if (!WriteBlock(fp, 0, block))
+			goto fail;
+	}
+
+	// reserved FAT entries, plus the FAT32 root directory cluster
+	for (uint8_t f = 0; f < 2; f++)
+	{
+		uint32_t fatBlock = reserved + f * blocksPerFat;
+		memset(block, 0, sizeof(block));
+		if (v.fatType == 32)
+		{
+			uint32_t* fat = (uint32_t*)block;
+			fat[0] = 0x0FFFFFF8;
+			fat[1] = 0x0FFFFFFF;
+			fat[2] = 0x0FFFFFFF;
+		}
+		else
+		{
+			uint16_t* fat = (uint16_t*)block;
+			fat[0] = 0xFFF8;
+			fat[1] = 0xFFFF;
+		}
+		if (!WriteBlock(fp, fatBlock, block))
+			goto fail;
+
+		memset(block, 0, sizeof(block));
+		for (uint32_t i = 1; i < blocksPerFat; i++)
+			if (!WriteBlock(fp, fatBlock + i, block))
+				goto fail;
+	}
+
+	// empty root directory
+	{
+		uint32_t dataStart = reserved + 2 * blocksPerFat;
+		uint32_t rootSize = v.fatType == 32 ? v.blocksPerCluster : rootBlocks;
+		for (uint32_t i = 0; i < rootSize; i++)
+			if (!WriteBlock(fp, dataStart + i, block))
+				goto fail;
+	}
+
+	fclose(fp);
+	return true;
+
+fail:
+	fclose(fp);
+	return false;
+}
+
+//------------------------------------------------------------------------------
+// populate the volume the way a typical Floppy Emu card looks: a folder's worth
+// of small files, and a contiguous 1440K disk image after them
+
+static bool PopulateVolume(SdFat& sd)
+{
+	char name[13];
+	SdBaseFile f;
+
+	memset(block, 0xE5, sizeof(block));
+
+	for (uint8_t i = 0; i < DIR_FILE_COUNT; i++)
+	{
+		snprintf(name, sizeof(name), "FILE%02d.DSK", i);
+		if (!f.open(name, O_RDWR | O_CREAT | O_EXCL))
+			return false;
+		// files of varying length, so the small files' clusters are interleaved in the FAT
+		for (uint8_t j = 0; j <= (i & 3); j++)
+			if (f.write(block, sizeof(block)) != sizeof(block))
+				return false;
+		if (!f.close())
+			return false;
+	}
+
+	if (!f.createContiguous(sd.vwd(), "DISK1440.IMG", 512UL * IMAGE_1440K_BLOCKS))
+		return false;
+	return f.close();
+}
+
+//------------------------------------------------------------------------------
+
+static uint64_t testStartNs;
+
+static void StartTest()
+{
+	SdImageResetStats();
+	testStartNs = NowNs();
+}
+
+static void EndTest(const char* name, uint32_t iterations)
+{
+	uint64_t wallNs = NowNs() - testStartNs;
+	const SdImageStats& s = SdImageGetStats();
+
+	printf("  %-26s %10.1f %12.1f %8.1f %8.1f %8.1f\n", name,
+		wallNs / 1000.0 / iterations,
+		(double)s.simulatedUs / iterations,
+		(double)s.commands / iterations,
+		(double)s.blocksRead / iterations,
+		(double)s.blocksWritten / iterations);
+}
+
+// the original contiguousRange(): one fatGet() per cluster
+static bool LegacyContiguousRange(SdVolume* vol, uint32_t firstCluster, uint32_t* bgnBlock, uint32_t* endBlock)
+{
+	for (uint32_t c = firstCluster; ; c++)
+	{
+		uint32_t next;
+		if (!vol->dbgFat(c, &next))
+			return false;
+
+		if (next != (c + 1))
+		{
+			if (next < (vol->fatType() == 16 ? (uint32_t)FAT16EOC_MIN : FAT32EOC_MIN))
+				return false;
+			*bgnBlock = vol->dataStartBlock() + ((firstCluster - 2) << vol->clusterSizeShift());
+			*endBlock = vol->dataStartBlock() + ((c - 2) << vol->clusterSizeShift()) + vol->blocksPerCluster() - 1;
+			return true;
+		}
+	}
+}
+
+// Write value to the image's FAT entry at the first cluster of a FAT block inside its chain, so the chain ends or
+// breaks there, and check that contiguousRange() agrees with the legacy walk. The entry is restored afterwards.
+static bool CheckChainAtFatBlockStart(SdFat& sd, SdBaseFile& f, const char* name, bool endChain)
+{
+	SdVolume* vol = sd.vol();
+	uint32_t entriesPerBlock = vol->fatType() == 16 ? 256 : 128;
+	uint32_t cluster = (f.firstCluster() / entriesPerBlock + 1) * entriesPerBlock;
+	uint32_t fatBlock = vol->fatStartBlock() + cluster / entriesPerBlock;
+	uint32_t value = endChain ? 0x0FFFFFFF : cluster + 2;
+
+	uint32_t firstBlock, lastBlock, legacyFirst, legacyLast;
+	uint8_t saved[512];
+	vol->cacheClear();
+	if (!sd.card()->readBlock(fatBlock, saved))
+		return false;
+	memcpy(block, saved, sizeof(block));
+	if (vol->fatType() == 16)
+		((uint16_t*)block)[0] = value;
+	else
+		((uint32_t*)block)[0] = value;
+	if (!sd.card()->writeBlock(fatBlock, block))
+		return false;
+
+	vol->cacheClear();
+	bool contiguous = f.contiguousRange(&firstBlock, &lastBlock);
+	vol->cacheClear();
+	bool legacyContiguous = LegacyContiguousRange(vol, f.firstCluster(), &legacyFirst, &legacyLast);
+
+	if (!sd.card()->writeBlock(fatBlock, saved))
+		return false;
+	vol->cacheClear();
+
+	bool ok = contiguous == endChain && legacyContiguous == endChain &&
+		(!endChain || (firstBlock == legacyFirst && lastBlock == legacyLast));
+	printf("  %-26s %s\n", name, ok ? "ok" : "FAILED");
+	return ok;
+}
+
+static bool RunBenchmarks(const VolumeConfig& v, const char* scratchDir, const SdLatencyProfile* profile)
+{
+	char path[256];
+	snprintf(path, sizeof(path), "%s/sdbench-%s.img", scratchDir, v.name);
+
+	if (!FormatImage(path, v) || !SdImageOpen(path))
+	{
+		printf("%s: can't create %s\n", v.name, path);
+		return false;
+	}
+
+	SdImageSetProfile(&sdProfileNone);
+
+	SdFat sd;
+	if (!sd.init(SPI_FULL_SPEED) || sd.vol()->fatType() != v.fatType || !PopulateVolume(sd))
+	{
+		printf("%s: volume setup failed\n", v.name);
+		return false;
+	}
+
+	SdImageSetProfile(profile);
+
+	printf("%s: FAT%d, %lu clusters of %d blocks, latency profile %s\n", v.name, sd.vol()->fatType(),
+		(unsigned long)sd.vol()->clusterCount(), sd.vol()->blocksPerCluster(), profile->name);
+	printf("  %-26s %10s %12s %8s %8s %8s\n", "test", "wall us", "card us", "cmds", "rd blks", "wr blks");
+
+	// mount
+	StartTest();
+	if (!sd.init(SPI_FULL_SPEED))
+		return false;
+	EndTest("mount", 1);
+
+	// open the image by name, as OpenImageFile() does
+	SdBaseFile f;
+	StartTest();
+	for (uint8_t i = 0; i < CONTIGUOUS_ITERATIONS; i++)
+	{
+		sd.vol()->cacheClear();
+		if (!f.open("DISK1440.IMG", O_RDWR) || !f.close())
+			return false;
+	}
+	EndTest("open", CONTIGUOUS_ITERATIONS);
+
+	if (!f.open("DISK1440.IMG", O_RDWR))
+		return false;
+
+	uint32_t firstBlock, lastBlock, legacyFirst, legacyLast;
+
+	StartTest();
+	for (uint8_t i = 0; i < CONTIGUOUS_ITERATIONS; i++)
+	{
+		sd.vol()->cacheClear();
+		if (!f.contiguousRange(&firstBlock, &lastBlock))
+			return false;
+	}
+	EndTest("contiguousRange", CONTIGUOUS_ITERATIONS);
+
+	StartTest();
+	for (uint8_t i = 0; i < CONTIGUOUS_ITERATIONS; i++)
+	{
+		sd.vol()->cacheClear();
+		if (!LegacyContiguousRange(sd.vol(), f.firstCluster(), &legacyFirst, &legacyLast))
+			return false;
+	}
+	EndTest("contiguousRange (fatGet)", CONTIGUOUS_ITERATIONS);
+
+	if (!CheckChainAtFatBlockStart(sd, f, "chain ends at FAT block", true) ||
+		!CheckChainAtFatBlockStart(sd, f, "chain breaks at FAT block", false))
+		return false;
+	f.close();
+
+	if (firstBlock != legacyFirst || lastBlock != legacyLast || lastBlock + 1 - firstBlock != IMAGE_1440K_BLOCKS)
+	{
+		printf("  contiguousRange mismatch: %lu-%lu, expected %lu-%lu\n", (unsigned long)firstBlock,
+			(unsigned long)lastBlock, (unsigned long)legacyFirst, (unsigned long)legacyLast);
+		return false;
+	}
+
+	// directory enumeration, as InitDiskMenu() does
+	dir_t dir;
+	uint16_t entries = 0;
+	StartTest();
+	sd.vol()->cacheClear();
+	sd.vwd()->rewind();
+	while (sd.vwd()->read(&dir, sizeof(dir)) == sizeof(dir) && dir.name[0] != DIR_NAME_FREE)
+		entries++;
+	EndTest("directory enumeration", 1);
+	if (entries != DIR_FILE_COUNT + 1)
+		return false;
+
+	// sequential reads of the whole image, one block at a time like the main loop
+	StartTest();
+	for (uint32_t b = firstBlock; b <= lastBlock; b++)
+		if (!sd.card()->readBlock(b, block))
+			return false;
+	EndTest("sequential readBlock x2880", 1);
+
+	// the same with one multi-block read per track, like ReadDiskCopy42Block
+	StartTest();
+	for (uint32_t b = firstBlock; b <= lastBlock; b += TRACK_BLOCKS)
+	{
+		if (!sd.card()->readStart(b))
+			return false;
+		for (uint8_t i = 0; i < TRACK_BLOCKS; i++)
+			if (!sd.card()->readData(trackBuf[i]))
+				return false;
+		sd.card()->readStop();
+	}
+	EndTest("sequential readData x2880", 1);
+
+	// random reads within the image
+	uint32_t seed = 12345;
+	StartTest();
+	for (uint16_t i = 0; i < IMAGE_1440K_BLOCKS; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		if (!sd.card()->readBlock(firstBlock + (seed >> 8) % IMAGE_1440K_BLOCKS, block))
+			return false;
+	}
+	EndTest("random readBlock x2880", 1);
+
+	// write a track back one block at a time
+	StartTest();
+	for (uint8_t i = 0; i < TRACK_BLOCKS; i++)
+		if (!sd.card()->writeBlock(firstBlock + i, trackBuf[i]))
+			return false;
+	EndTest("track writeBlock x12", 1);
+
+	// write a track back as one multi-block write, like FlushDirtySectors()
+	StartTest();
+	if (!sd.card()->writeStart(firstBlock, TRACK_BLOCKS))
+		return false;
+	for (uint8_t i = 0; i < TRACK_BLOCKS; i++)
+		if (!sd.card()->writeData(trackBuf[i]))
+			return false;
+	if (!sd.card()->writeStop())
+		return false;
+	EndTest("track writeStart x12", 1);
+
+	printf("\n");
+	SdImageClose();
+	remove(path);
+	return true;
+}
+
+int main(int argc, char* argv[])
+{
+	const SdLatencyProfile* profile = &sdProfileFullSpeed;
+	const char* scratchDir = "/tmp";
+
+	if (argc > 1)
+	{
+		if (strcmp(argv[1], sdProfileNone.name) == 0)
+			profile = &sdProfileNone;
+		else if (strcmp(argv[1], sdProfileSlowCard.name) == 0)
+			profile = &sdProfileSlowCard;
+		else if (strcmp(argv[1], sdProfileFullSpeed.name) != 0)
+		{
+			printf("usage: %s [none|fullspeed|slowcard] [scratch directory]\n", argv[0]);
+			return 2;
+		}
+	}
+	if (argc > 2)
+		scratchDir = argv[2];
+
+	int failures = 0;
+	for (uint8_t i = 0; i < sizeof(volumes) / sizeof(volumes[0]); i++)
+	{
+		if (!RunBenchmarks(volumes[i], scratchDir, profile))
+		{
+			printf("%s: FAILED\n\n", volumes[i].name);
+			failures++;
+		}
+	}
+
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,236 @@
+/*
+    Floppy Emu, copyright 2013 Steve Chamberlin, "Big Mess o' Wires". All rights reserved.
+
+    Floppy Emu is licensed under a Creative Commons Attribution-NonCommercial 3.0 Unported
+	license. (CC BY-NC 3.0) The terms of the license may be viewed at
+	http://creativecommons.org/licenses/by-nc/3.0/
+
+	Based on a work at http://www.bigmessowires.com/macintosh-floppy-emu/
+
+    Permissions beyond the scope of this license may be available at www.bigmessowires.com
+	or from mailto:steve@bigmessowires.com.
+*/
+
+#include <stdio.h>
+
+#include "Sd2Card.h"
+#include "sdimage.h"
+
+// no card latency at all, measures only the filesystem code
+const SdLatencyProfile sdProfileNone = { "none", 0, 0, 0, 0, 0 };
+
+// SPI at F_CPU/2 = 10 MHz: 512 bytes take ~410 us on the wire, plus command and token overhead
+const SdLatencyProfile sdProfileFullSpeed = { "fullspeed", 60, 430, 430, 250, 40 };
+
+// a slow card that takes a long time to program each block, like the one that caused "writeStop fail"
+const SdLatencyProfile sdProfileSlowCard = { "slowcard", 100, 450, 450, 2500, 400 };
+
+static FILE* imageFile;
+static uint32_t imageBlocks;
+static const SdLatencyProfile* profile = &sdProfileNone;
+static SdImageStats stats;
+
+// state of an open multi-block read or write
+static uint32_t streamBlock;
+static bool streamWrite;
+
+bool SdImageOpen(const char* path)
+{
+	SdImageClose();
+
+	imageFile = fopen(path, "r+b");
+	if (!imageFile)
+		return false;
+
+	fseek(imageFile, 0, SEEK_END);
+	imageBlocks = ftell(imageFile) / 512;
+	return true;
+}
+
+void SdImageClose()
+{
+	if (imageFile)
+		fclose(imageFile);
+	imageFile = 0;
+	imageBlocks = 0;
+}
+
+void SdImageSetProfile(const SdLatencyProfile* p)
+{
+	profile = p;
+}
+
+const SdImageStats& SdImageGetStats()
+{
+	return stats;
+}
+
+void SdImageResetStats()
+{
+	stats.commands = 0;
+	stats.blocksRead = 0;
+	stats.blocksWritten = 0;
+	stats.simulatedUs = 0;
+}
+
+static void Command()
+{
+	stats.commands++;
+	stats.simulatedUs += profile->commandUs;
+}
+
+static bool ReadImageBlock(uint32_t block, uint8_t* dst)
+{
+	if (block >= imageBlocks ||
+		fseek(imageFile, (long)block * 512, SEEK_SET) != 0 ||
+		fread(dst, 1, 512, imageFile) != 512)
+		return false;
+
+	stats.blocksRead++;
+	stats.simulatedUs += profile->readBlockUs;
+	return true;
+}
+
+static bool WriteImageBlock(uint32_t block, const uint8_t* src)
+{
+	if (block >= imageBlocks ||
+		fseek(imageFile, (long)block * 512, SEEK_SET) != 0 ||
+		fwrite(src, 1, 512, imageFile) != 512)
+		return false;
+
+	stats.blocksWritten++;
+	stats.simulatedUs += profile->writeBlockUs;
+	return true;
+}
+
+//------------------------------------------------------------------------------
+// Sd2Card methods, replacing the SPI versions in SdFat/Sd2Card.cpp
+
+uint32_t Sd2Card::cardSize()
+{
+	return imageBlocks;
+}
+
+bool Sd2Card::erase(uint32_t firstBlock, uint32_t lastBlock)
+{
+	static const uint8_t zero[512] = { 0 };
+
+	Command();
+	for (uint32_t b = firstBlock; b <= lastBlock; b++)
+	{
+		if (!WriteImageBlock(b, zero))
+		{
+			error(SD_CARD_ERROR_ERASE);
+			return false;
+		}
+	}
+	return true;
+}
+
+bool Sd2Card::eraseSingleBlockEnable()
+{
+	return true;
+}
+
+bool Sd2Card::init(uint8_t sckRateID)
+{
+	errorCode_ = 0;
+	status_ = 0;
+
+	if (!imageFile)
+	{
+		error(SD_CARD_ERROR_CMD0);
+		return false;
+	}
+
+	type(SD_CARD_TYPE_SDHC);
+	return setSckRate(sckRateID);
+}
+
+bool Sd2Card::readBlock(uint32_t blockNumber, uint8_t* dst)
+{
+	Command();
+	if (!ReadImageBlock(blockNumber, dst))
+	{
+		error(SD_CARD_ERROR_CMD17);
+		return false;
+	}
+	return true;
+}
+
+bool Sd2Card::readData(uint8_t *dst)
+{
+	if (!ReadImageBlock(streamBlock, dst))
+	{
+		error(SD_CARD_ERROR_READ);
+		return false;
+	}
+	streamBlock++;
+	return true;
+}
+
+bool Sd2Card::readStart(uint32_t blockNumber)
+{
+	Command();
+	streamBlock = blockNumber;
+	streamWrite = false;
+	return true;
+}
+
+bool Sd2Card::readStop()
+{
+	Command();
+	return true;
+}
+
+bool Sd2Card::setSckRate(uint8_t sckRateID)
+{
+	if (sckRateID > 6)
+	{
+		error(SD_CARD_ERROR_SCK_RATE);
+		return false;
+	}
+	spiRate_ = sckRateID;
+	return true;
+}
+
+bool Sd2Card::writeBlock(uint32_t blockNumber, const uint8_t* src)
+{
+	Command();
+	if (!WriteImageBlock(blockNumber, src))
+	{
+		error(SD_CARD_ERROR_CMD24);
+		return false;
+	}
+	stats.simulatedUs += profile->programUs;
+	return true;
+}
+
+bool Sd2Card::writeData(const uint8_t* src)
+{
+	if (!streamWrite || !WriteImageBlock(streamBlock, src))
+	{
+		error(SD_CARD_ERROR_WRITE_MULTIPLE);
+		return false;
+	}
+	streamBlock++;
+	stats.simulatedUs += profile->multiBlockUs;
+	return true;
+}
+
+bool Sd2Card::writeStart(uint32_t blockNumber, uint32_t eraseCount)
+{
+	// ACMD23 pre-erase followed by CMD25
+	Command();
+	Command();
+	streamBlock = blockNumber;
+	streamWrite = true;
+	return true;
+}
+
+bool Sd2Card::writeStop()
+{
+	streamWrite = false;
+	stats.simulatedUs += profile->programUs;
+	return true;
+}
@@ -0,0 +1,52 @@
+/*
+    Floppy Emu, copyright 2013 Steve Chamberlin, "Big Mess o' Wires". All rights reserved.
+
+    Floppy Emu is licensed under a Creative Commons Attribution-NonCommercial 3.0 Unported
+	license. (CC BY-NC 3.0) The terms of the license may be viewed at
+	http://creativecommons.org/licenses/by-nc/3.0/
+
+	Based on a work at http://www.bigmessowires.com/macintosh-floppy-emu/
+
+    Permissions beyond the scope of this license may be available at www.bigmessowires.com
+	or from mailto:steve@bigmessowires.com.
+*/
+
+#ifndef SDIMAGE_H_
+#define SDIMAGE_H_
+
+#include <inttypes.h>
+
+// Host replacement for the SPI transport in Sd2Card.cpp. The Sd2Card methods are
+// implemented on top of a FAT image file, and every card operation is charged a
+// simulated cost from the active latency profile. Simulated time is a plain counter,
+// so benchmark results are deterministic no matter how fast the host is.
+
+typedef struct SdLatencyProfile
+{
+	const char* name;
+	uint16_t commandUs;			// per CMD17/18/24/25 and stop transmission
+	uint16_t readBlockUs;		// data transfer for one 512 byte block
+	uint16_t writeBlockUs;		// data transfer for one 512 byte block
+	uint16_t programUs;			// card busy after a single block write, or after writeStop
+	uint16_t multiBlockUs;		// card busy between blocks of a multi-block write
+} SdLatencyProfile;
+
+typedef struct SdImageStats
+{
+	uint32_t commands;
+	uint32_t blocksRead;
+	uint32_t blocksWritten;
+	uint32_t simulatedUs;
+} SdImageStats;
+
+extern const SdLatencyProfile sdProfileNone;
+extern const SdLatencyProfile sdProfileFullSpeed;
+extern const SdLatencyProfile sdProfileSlowCard;
+
+bool SdImageOpen(const char* path);
+void SdImageClose();
+void SdImageSetProfile(const SdLatencyProfile* profile);
+const SdImageStats& SdImageGetStats();
+void SdImageResetStats();
+
+#endif /* SDIMAGE_H_ */
@@ -0,0 +1,242 @@
+/*
+	Floppy Emu, copyright 2013 Steve Chamberlin, "Big Mess o' Wires". All rights reserved.
+
+	Floppy Emu is licensed under a Creative Commons Attribution-NonCommercial 3.0 Unported
+	license. (CC BY-NC 3.0) The terms of the license may be viewed at
+	http://creativecommons.org/licenses/by-nc/3.0/
+
+	Based on a work at http://www.bigmessowires.com/macintosh-floppy-emu/
+
+	Permissions beyond the scope of this license may be available at www.bigmessowires.com
+	or from mailto:steve@bigmessowires.com.
+*/
+
+/*
+	Rotational latency of the main loop's sector order, with and without fast seek, and the time
+	to send a sector with a real drive's gaps and with the turbo ones.
+
+	usage: seekbench [requests]
+
+	Models the sector loop in ../floppyemu.cpp with the sector order tables from ../diskformat.cpp,
+	and a Mac that asks for one sector at a time. Time is counted in sector slots. After each sector
+	the Mac spends some slots processing it (the turnaround, 1 for a Mac that needs 2:1 interleave),
+	then selects the head for the next request and waits for the sector's address header. The
+	latency of a request is every slot from the end of the previous sector to the end of this one.
+	
+	The access patterns are random single sectors, a sequential read and write of the whole disk,
+	and runs of 16 sectors at random places, like reading and writing files. Fast seek can't help
+	the random single sectors, since nothing the Mac does says which sector it will want next.
+	It also relies on the interleave giving the Mac enough turnaround: the last setup, 1:1 for a
+	Mac that needs 2:1, shows how much worse it gets when it doesn't.
+	
+	Sector times count the bits the CPLD shifts out for the bytes the sector encoders in
+	../floppyemu.cpp send, at the nominal bit rate. The gaps are the only part that turbo changes.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "diskformat.h"
+
+#define RUN_LENGTH 16
+
+// GCR: address block, data block header, 524 bytes of tags and data encoded as 703 bytes with the
+// checksum, and the bitslip bytes. Each sync byte in the gaps takes 10 bits.
+#define GCR_SECTOR_BYTES (10 + 4 + 703 + 3)
+#define GCR_BIT_US 2.0
+
+// MFM: A1 syncs, ID, CRC, FB mark, data, CRC. A byte is 16 cells.
+#define MFM_SECTOR_BYTES (3 + 5 + 2 + 3 + 1 + 512 + 2)
+#define MFM_HD_CELL_US 1.0
+
+typedef struct Emulator
+{
+	DiskFormat format;
+	uint8_t sectorAfter[FORMAT_SECTOR_ORDER_SIZE];
+	uint8_t track;
+	uint8_t side;
+	uint8_t sector;
+} Emulator;
+
+typedef struct Request
+{
+	uint8_t track;
+	uint8_t side;
+	uint8_t sector;
+	bool write;
+} Request;
+
+static void Mount(Emulator& e, uint8_t format, uint8_t interleave, bool fastSeek)
+{
+	LoadDiskFormat(format, e.format);
+	e.format.interleave = interleave;
+	e.format.fastSeek = fastSeek;
+	FormatBuildSectorOrder(e.format, e.sectorAfter);
+	e.track = 0;
+	e.side = 0;
+	e.sector = 0;
+}
+
+static void NextSlot(Emulator& e)
+{
+	e.sector = e.sectorAfter[FormatOrderBase(e.format, e.track) + e.sector];
+}
+
+// slots until the request is done, following the main loop's handling of steps, side changes and writes
+static uint32_t Access(Emulator& e, const Request& r, uint8_t turnaround)
+{
+	uint32_t slots = 0;
+	
+	for (uint8_t i=0; i<turnaround; i++, slots++)
+		NextSlot(e);
+		
+	if (r.track != e.track || r.side != e.side)
+	{
+		e.track = r.track;
+		e.side = r.side;
+		if (e.format.fastSeek || e.sector >= FormatTrackLength(e.format, e.track))
+			e.sector = 0;
+	}
+	
+	while (e.sector != r.sector)
+	{
+		NextSlot(e);
+		slots++;
+	}
+	slots++;
+	
+	// a written sector is sent again afterwards, unless fast seek moves on
+	if (!r.write || e.format.fastSeek)
+		NextSlot(e);
+		
+	return slots;
+}
+
+static uint32_t randomSeed;
+
+static uint32_t Random()
+{
+	randomSeed = randomSeed * 1103515245 + 12345;
+	return randomSeed >> 8;
+}
+
+// the request for a disk image sector number, counting both sides of each track
+static Request ImageSector(const DiskFormat& f, uint16_t n, bool write)
+{
+	Request r;
+	uint8_t track = 0;
+	
+	while (track < 79 && n >= (uint16_t)(FormatTrackStart(f, track + 1) * f.sides))
+		track++;
+	n -= FormatTrackStart(f, track) * f.sides;
+	
+	r.track = track;
+	r.side = n / FormatTrackLength(f, track);
+	r.sector = n % FormatTrackLength(f, track);
+	r.write = write;
+	return r;
+}
+
+typedef enum {
+	PATTERN_RANDOM,
+	PATTERN_SEQUENTIAL_READ,
+	PATTERN_SEQUENTIAL_WRITE,
+	PATTERN_FILE_RUNS,
+	NUM_PATTERNS
+} ePattern;
+
+static const char* patternNames[NUM_PATTERNS] = { "random", "seq read", "seq write", "file runs" };
+
+static double AverageLatency(uint8_t format, uint8_t interleave, uint8_t turnaround, bool fastSeek, uint8_t pattern,
+	uint32_t requests)
+{
+	Emulator e;
+	Mount(e, format, interleave, fastSeek);
+	uint16_t imageSectors = e.format.kBytes * 2;
+	uint64_t total = 0;
+	uint16_t n = 0;
+	bool write = false;
+	
+	randomSeed = 1;
+	for (uint32_t i=0; i<requests; i++)
+	{
+		switch (pattern)
+		{
+		case PATTERN_RANDOM:
+			n = Random() % imageSectors;
+			write = (Random() & 3) == 0;
+			break;
+		case PATTERN_SEQUENTIAL_READ:
+		case PATTERN_SEQUENTIAL_WRITE:
+			n = i % imageSectors;
+			write = (pattern == PATTERN_SEQUENTIAL_WRITE);
+			break;
+		case PATTERN_FILE_RUNS:
+			if (i % RUN_LENGTH == 0)
+			{
+				n = Random() % (imageSectors - RUN_LENGTH);
+				write = (Random() & 1) == 0;
+			}
+			else
+				n++;
+			break;
+		}
+		
+		total += Access(e, ImageSector(e.format, n, write), turnaround);
+	}
+	
+	return (double)total / requests;
+}
+
+static double SectorMicroseconds(const DiskFormat& f)
+{
+	if (f.encoding == ENCODING_GCR)
+		return (GCR_SECTOR_BYTES * 8 + (f.sectorGap + f.addressDataGap) * 10) * GCR_BIT_US;
+		
+	uint16_t bytes = MFM_SECTOR_BYTES + f.sectorGap + f.addressDataGap + 2 * f.syncs;
+	return bytes * 16 * MFM_HD_CELL_US;
+}
+
+int main(int argc, char* argv[])
+{
+	uint32_t requests = argc > 1 ? strtoul(argv[1], NULL, 0) : 100000;
+	
+	static const struct { uint8_t format; uint8_t interleave; uint8_t turnaround; } setups[] = {
+		{ FORMAT_GCR_800K, 2, 1 },
+		{ FORMAT_GCR_800K, 1, 0 },
+		{ FORMAT_MFM_1440K, 1, 0 },
+		{ FORMAT_MFM_1440K, 1, 1 }
+	};
+	
+	printf("average sector slots per request, %u requests\n", requests);
+	printf("%-6s %-10s %-4s %-10s %8s %8s %8s\n", "format", "interleave", "turn", "pattern", "normal", "fast", "change");
+	
+	for (unsigned s=0; s<sizeof(setups)/sizeof(setups[0]); s++)
+	{
+		DiskFormat f;
+		LoadDiskFormat(setups[s].format, f);
+		
+		for (uint8_t p=0; p<NUM_PATTERNS; p++)
+		{
+			double normal = AverageLatency(setups[s].format, setups[s].interleave, setups[s].turnaround, false, p, requests);
+			double fast = AverageLatency(setups[s].format, setups[s].interleave, setups[s].turnaround, true, p, requests);
+			printf("%-6s %u:1        %-4u %-10s %8.2f %8.2f %7.1f%%\n", f.name, setups[s].interleave, setups[s].turnaround,
+				patternNames[p], normal, fast, 100.0 * (fast - normal) / normal);
+		}
+	}
+	
+	printf("\nsector time in microseconds, and sequential read throughput at 1:1 interleave\n");
+	printf("%-6s %8s %8s %8s %8s %7s\n", "format", "normal", "KB/s", "turbo", "KB/s", "change");
+	for (uint8_t i=0; i<NUM_DISK_FORMATS; i++)
+	{
+		DiskFormat f;
+		LoadDiskFormat(i, f);
+		double normal = SectorMicroseconds(f);
+		FormatUseTurboGaps(f);
+		double turbo = SectorMicroseconds(f);
+		printf("%-6s %8.0f %8.1f %8.0f %8.1f %6.1f%%\n", f.name, normal, 500000.0 / normal, turbo, 500000.0 / turbo,
+			100.0 * (normal - turbo) / turbo);
+	}
+	
+	return 0;
+}
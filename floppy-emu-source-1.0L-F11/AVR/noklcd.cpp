@@ -140,11 +140,37 @@ const uint8_t tiny_font[][3] = {
 	{0x08,0x0c,0x04}, // 7e ~																
 };
 
-void LcdWrite(uint8_t dc, uint8_t data)
+// Tiny font digits 0-9 and a space, shifted and followed by their blank column, so numbers that change often
+// can be drawn without snprintf or font lookups. Filled by LcdReset().
+static uint8_t digitGlyphs[LCD_DIGIT_SPACE+1][4];
+
+// A copy of the display RAM, in the display's own layout: one byte is a column of 8 pixels, and each of the
+// LCD_ROWS rows is LCD_WIDTH bytes. Within a frame, drawing only changes this copy and records the changed
+// columns of each row. Outside a frame it's kept up to date as the bytes are sent.
+static uint8_t lcdFrame[LCD_ROWS][LCD_WIDTH];
+static uint8_t dirtyStart[LCD_ROWS];
+static uint8_t dirtyEnd[LCD_ROWS];
+static bool inFrame;
+static uint8_t cursorX;
+static uint8_t cursorRow;
+
+static inline void LcdSpiSetup()
 {
 	// set SPI speed to "half speed": clock speed / 4
 	SPCR = (1 << SPE) | (1 << MSTR);
 	SPSR = 0;
+}
+
+static inline void LcdSpiSend(uint8_t data)
+{
+	SPDR = data; 
+	while(!(SPSR & (1<<SPIF))) 
+	{}
+}
+
+static void LcdSend(uint8_t dc, uint8_t data)
+{
+	LcdSpiSetup();
 			
 	if (dc)
 	{
@@ -157,17 +183,119 @@ void LcdWrite(uint8_t dc, uint8_t data)
 
 	PORT(LCD_CS_PORT) &= ~(1<<LCD_CS_PIN);
 
-	SPDR = data; 
-	while(!(SPSR & (1<<SPIF))) 
-	{}
+	LcdSpiSend(data);
 
 	PORT(LCD_CS_PORT) |= (1<<LCD_CS_PIN);
 }
 
+// draw one column at the cursor, then advance it the way the display advances its address
+static void LcdPut(uint8_t data)
+{
+	uint8_t* p = &lcdFrame[cursorRow][cursorX];
+	
+	if (!inFrame)
+	{
+		*p = data;
+		LcdSend(LCD_DATA, data);
+	}
+	else if (*p != data)
+	{
+		*p = data;
+		if (cursorX < dirtyStart[cursorRow])
+			dirtyStart[cursorRow] = cursorX;
+		if (cursorX >= dirtyEnd[cursorRow])
+			dirtyEnd[cursorRow] = cursorX + 1;
+	}
+	
+	if (++cursorX == LCD_WIDTH)
+	{
+		cursorX = 0;
+		if (++cursorRow == LCD_ROWS)
+			cursorRow = 0;
+	}
+}
+
+static void LcdMarkAllDirty()
+{
+	for (uint8_t row = 0; row < LCD_ROWS; row++)
+	{
+		dirtyStart[row] = 0;
+		dirtyEnd[row] = LCD_WIDTH;
+	}
+}
+
+void LcdWrite(uint8_t dc, uint8_t data)
+{
+	if (dc)
+		LcdPut(data);
+	else
+		LcdSend(LCD_CMD, data);
+}
+
+void LcdBeginFrame(void)
+{
+	inFrame = true;
+}
+
+void LcdFlush(void)
+{
+	inFrame = false;
+	
+	// set up the SPI port once, then send every changed run of columns back-to-back
+	LcdSpiSetup();
+	PORT(LCD_CS_PORT) &= ~(1<<LCD_CS_PIN);
+	
+	for (uint8_t row = 0; row < LCD_ROWS; row++)
+	{
+		uint8_t x = dirtyStart[row];
+		uint8_t end = dirtyEnd[row];
+		if (x >= end)
+			continue;
+			
+		PORT(SPI_DC_PORT) &= ~(1<<SPI_DC_PIN);
+		LcdSpiSend(0x80 | x);
+		LcdSpiSend(0x40 | row);
+		PORT(SPI_DC_PORT) |= (1<<SPI_DC_PIN);
+		
+		const uint8_t* p = &lcdFrame[row][x];
+		for (; x < end; x++)
+			LcdSpiSend(*p++);
+			
+		dirtyStart[row] = LCD_WIDTH;
+		dirtyEnd[row] = 0;
+	}
+	
+	// leave the display's address at the cursor, for drawing outside a frame
+	PORT(SPI_DC_PORT) &= ~(1<<SPI_DC_PIN);
+	LcdSpiSend(0x80 | cursorX);
+	LcdSpiSend(0x40 | cursorRow);
+	
+	PORT(LCD_CS_PORT) |= (1<<LCD_CS_PIN);
+}
+
+// draw count digits at x,y from the cached glyphs
+void LcdDigits(uint8_t x, uint8_t y, const uint8_t* digits, uint8_t count)
+{
+	LcdGoto(x, y);
+	
+	for (uint8_t i=0; i<count; i++)
+	{
+		const uint8_t* glyph = digitGlyphs[digits[i]];
+		for (uint8_t column=0; column<4; column++)
+			LcdPut(glyph[column]);
+	}
+}
+
 void LcdGoto(uint8_t x, uint8_t y)
 {
-	LcdWrite(LCD_CMD, 0x80 | x);  
-	LcdWrite(LCD_CMD, 0x40 | y);
+	cursorX = x;
+	cursorRow = y;
+	
+	if (!inFrame)
+	{
+		LcdSend(LCD_CMD, 0x80 | x);  
+		LcdSend(LCD_CMD, 0x40 | y);
+	}
 }
 
 void LcdTinyString(const char *characters, uint8_t inverse, uint8_t maxWidth)
@@ -298,10 +426,18 @@ void LcdTinyStringFramed(const char *characters)
 
 void LcdClear(void)
 {
-	for (int index = 0; index < LCD_WIDTH * LCD_HEIGHT / 8; index++)
+	bool wasInFrame = inFrame;
+	
+	// like writing a whole screen of blank columns, which leaves the cursor where it was
+	inFrame = true;
+	for (uint8_t row = 0; row < LCD_ROWS; row++)
 	{
-		LcdWrite(LCD_DATA, 0x00);
+		for (uint8_t x = 0; x < LCD_WIDTH; x++)
+			LcdPut(0x00);
 	}
+	
+	if (!wasInFrame)
+		LcdFlush();
 }
 
 void LcdReset(void)
@@ -347,4 +483,16 @@ void LcdReset(void)
 	LcdWrite(LCD_CMD, lcd_bias); // LCD bias mode 
 	LcdWrite(LCD_CMD, 0x20);
 	LcdWrite(LCD_CMD, 0x0C); // LCD in normal mode. 0x0d for inverse
+	
+	// the display RAM is unknown after a reset
+	inFrame = false;
+	LcdMarkAllDirty();
+	
+	for (uint8_t digit = 0; digit < LCD_DIGIT_SPACE; digit++)
+	{
+		for (uint8_t index = 0; index < 3; index++)
+			digitGlyphs[digit][index] = pgm_read_byte((unsigned char*)tiny_font + ('0' - 0x20 + digit) * 3 + index) << 1;
+		digitGlyphs[digit][3] = 0x00;
+	}
+	memset(digitGlyphs[LCD_DIGIT_SPACE], 0, 4);
 }
@@ -18,6 +18,7 @@
 
 #define LCD_WIDTH 84
 #define LCD_HEIGHT 48
+#define LCD_ROWS (LCD_HEIGHT / 8)
 
 #define LCD_CMD 0
 #define LCD_DATA 1
@@ -25,6 +26,9 @@
 #define TEXT_NORMAL 0
 #define TEXT_INVERSE 1
 
+// digit value for a blank character in LcdDigits()
+#define LCD_DIGIT_SPACE 10
+
 extern volatile uint8_t lcd_vop;
 extern volatile uint8_t lcd_bias;
 extern volatile uint8_t lcd_tempCoef;
@@ -33,8 +37,15 @@ void LcdReset(void);
 void LcdClear(void);
 void LcdGoto(uint8_t x, uint8_t y);
 void LcdWrite(uint8_t dc, uint8_t data);
+
+// Drawing between LcdBeginFrame() and LcdFlush() only updates a RAM copy of the display. LcdFlush() then
+// sends the changed columns of each row in one SPI transfer. Outside a frame, drawing goes straight to the
+// display, one byte at a time.
+void LcdBeginFrame(void);
+void LcdFlush(void);
 void LcdTinyString(const char *characters, uint8_t inverse, uint8_t maxWidth = 84);
 void LcdTinyStringP(PGM_P characters, uint8_t inverse);
 void LcdTinyStringFramed(const char *characters);
+void LcdDigits(uint8_t x, uint8_t y, const uint8_t* digits, uint8_t count);
 
 #endif /* NOKLCD_H_ */
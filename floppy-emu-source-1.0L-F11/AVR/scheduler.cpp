@@ -0,0 +1,118 @@
+/* 
+    Floppy Emu, copyright 2013 Steve Chamberlin, "Big Mess o' Wires". All rights reserved.
+	
+    Floppy Emu is licensed under a Creative Commons Attribution-NonCommercial 3.0 Unported 
+	license. (CC BY-NC 3.0) The terms of the license may be viewed at 	
+	http://creativecommons.org/licenses/by-nc/3.0/
+	
+	Based on a work at http://www.bigmessowires.com/macintosh-floppy-emu/
+	
+    Permissions beyond the scope of this license may be available at www.bigmessowires.com
+	or from mailto:steve@bigmessowires.com.
+*/
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include "scheduler.h"
+
+typedef struct Task
+{
+	TaskFunction run;
+	uint16_t maxDelay;
+	bool pending;
+	uint32_t postedAt;
+	uint32_t runTicks;
+} Task;
+
+static Task tasks[NUM_TASKS];
+static uint32_t startTicks;
+static volatile uint16_t overflowCount;
+
+ISR(TIMER3_OVF_vect)
+{
+	// every 3.4 seconds
+	overflowCount++;
+}
+
+static uint32_t Now()
+{
+	uint16_t high, low;
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		low = TCNT3;
+		high = overflowCount;
+		// an overflow that hasn't been counted yet
+		if ((TIFR3 & (1<<TOV3)) && low < 0x8000)
+			high++;
+	}
+	
+	return ((uint32_t)high << 16) | low;
+}
+
+void SchedulerInit()
+{
+	// free-running Timer3, with a rare overflow interrupt to extend it to 32 bits
+	PRR1 &= ~(1<<PRTIM3);
+	TCCR3A = 0;
+	TCCR3B = (1<<CS32) | (1<<CS30);
+	TIMSK3 = (1<<TOIE3);
+	
+	for (uint8_t i=0; i<NUM_TASKS; i++)
+	{
+		tasks[i].pending = false;
+		tasks[i].runTicks = 0;
+	}
+	startTicks = Now();
+}
+
+void TaskInit(uint8_t task, TaskFunction run, uint16_t maxDelay)
+{
+	tasks[task].run = run;
+	tasks[task].maxDelay = maxDelay;
+}
+
+void TaskPost(uint8_t task)
+{
+	if (!tasks[task].pending)
+	{
+		tasks[task].pending = true;
+		tasks[task].postedAt = Now();
+	}
+}
+
+void RunTasks(bool streaming)
+{
+	uint32_t now = Now();
+	
+	for (uint8_t i=0; i<NUM_TASKS; i++)
+	{
+		Task& t = tasks[i];
+		
+		if (!t.pending)
+			continue;
+			
+		bool delayed = streaming && t.maxDelay != TASK_NOW;
+		if (delayed && (t.maxDelay == TASK_WHEN_IDLE || now - t.postedAt < t.maxDelay))
+			continue;
+		
+		t.pending = false;
+		t.run();
+		
+		uint32_t end = Now();
+		t.runTicks += end - now;
+		now = end;
+		
+		if (delayed)
+			break;
+	}
+}
+
+uint8_t TaskShare(uint8_t task)
+{
+	uint32_t hundredth = (Now() - startTicks) / 100;
+	if (hundredth == 0)
+		return 0;
+	return (uint8_t)(tasks[task].runTicks / hundredth);
+}
@@ -0,0 +1,48 @@
+/* 
+    Floppy Emu, copyright 2013 Steve Chamberlin, "Big Mess o' Wires". All rights reserved.
+	
+    Floppy Emu is licensed under a Creative Commons Attribution-NonCommercial 3.0 Unported 
+	license. (CC BY-NC 3.0) The terms of the license may be viewed at 	
+	http://creativecommons.org/licenses/by-nc/3.0/
+	
+	Based on a work at http://www.bigmessowires.com/macintosh-floppy-emu/
+	
+    Permissions beyond the scope of this license may be available at www.bigmessowires.com
+	or from mailto:steve@bigmessowires.com.
+*/
+
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include <inttypes.h>
+
+// Work that the main loop does between sectors, in priority order. Sending the disk bytes to the CPLD isn't a
+// task: it's the main loop itself, which runs the pending tasks at each sector boundary and then sends the next
+// sector without interruption. While the Mac is reading, a task only runs once it has waited its maximum delay,
+// and at most one such delayed task runs per sector, so the gap between sectors stays short. When the drive is
+// idle every pending task runs at once.
+typedef enum {
+	TASK_SD_FILL = 0,	// read the next sector from the SD card, never delayed
+	TASK_WRITEBACK,		// write dirty sectors back to the SD card, only when idle
+	TASK_UI,			// LCD status line
+	NUM_TASKS
+} eTask;
+
+// maximum delays
+#define TASK_NOW 0
+#define TASK_WHEN_IDLE 0xFFFF
+
+// Timer3 ticks, oscillator/1024: 51.2 microseconds at 20 MHz
+#define TASK_TICKS(ms) ((uint16_t)((uint32_t)(ms) * (F_CPU / 1024) / 1000))
+
+typedef void (*TaskFunction)();
+
+void SchedulerInit();
+void TaskInit(uint8_t task, TaskFunction run, uint16_t maxDelay);
+void TaskPost(uint8_t task);
+void RunTasks(bool streaming);
+
+// percentage of the time since SchedulerInit() spent in a task
+uint8_t TaskShare(uint8_t task);
+
+#endif /* SCHEDULER_H_ */
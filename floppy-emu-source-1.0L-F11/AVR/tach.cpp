@@ -0,0 +1,179 @@
+/* 
+    Floppy Emu, copyright 2013 Steve Chamberlin, "Big Mess o' Wires". All rights reserved.
+	
+    Floppy Emu is licensed under a Creative Commons Attribution-NonCommercial 3.0 Unported 
+	license. (CC BY-NC 3.0) The terms of the license may be viewed at 	
+	http://creativecommons.org/licenses/by-nc/3.0/
+	
+	Based on a work at http://www.bigmessowires.com/macintosh-floppy-emu/
+	
+    Permissions beyond the scope of this license may be available at www.bigmessowires.com
+	or from mailto:steve@bigmessowires.com.
+*/
+
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
+#include "tach.h"
+
+/*
+	Produces 60 pulses for each rotation of the drive motor
+	Data from Apple/Sony docs:
+	   Tracks	RPM   Acceptable Speed Range in ROM
+	   00-15:   394   1135-11E9
+	   16-31:   429   12C6-138A
+	   32-47:   472   14A7-157F
+	   48-63:   525   16F2-17E2
+	   64-79:   590   19D0-1ADE
+			
+	Experimentally determined TACH toggle rates for Plus Too, running at 8.125 MHz:
+		TACH Half Period Clocks		Resulting Timing Value Computed By Mac
+					9996				    $117B (4475)           
+					9122  				    $1328 (4904)
+					8292  				    $1513 (5395)
+					7463  				    $176A (5994)
+					6634				    $1A56 (6742)
+		
+	A real Mac runs slightly slower than Plus Too (7.8336 MHz vs 8.125 MHz), so those
+	timing values should be scaled by multiplying by 7.8336/8.125 = 0.96414
+	
+	Scaling these values and converting to real time units, we get:
+	   Tracks	TACH Half Period    Implied RPM   
+	   00-15:      1276.04 us         391.84
+	   16-31:      1164.47 us         429.38
+	   32-47:      1058.52 us         472.36
+	   48-63:       952.69 us         524.83
+	   64-79:       846.86 us         590.41
+*/
+
+#define TACH_HALF_PERIOD(rpm) (F_CPU / (2UL * (rpm)))
+#define TACH_HALF_PERIODS_PER_REV 120
+
+extern const uint16_t tachHalfPeriods[] PROGMEM;
+const uint16_t tachHalfPeriods[5] = { 
+	TACH_HALF_PERIOD(394), TACH_HALF_PERIOD(429), TACH_HALF_PERIOD(472), TACH_HALF_PERIOD(525), TACH_HALF_PERIOD(590) 
+};
+
+// "Flutter" the drive's TACH speed slightly, once per revolution. This avoids a bug in P_Sony_MakeSpdTbl in the 64K ROM
+// (used in the Mac 128K and Mac 512K) where the Mac will crash if two successive TACH measurements see the exact same
+// speed. The half period is shortened by one of five steps, chosen pseudo-randomly but never the same twice in a row.
+#define FLUTTER_STEP 25
+#define FLUTTER_STEPS 5
+
+// MFM drives spin at 300 RPM, with an index pulse once per revolution. The timer keeps counting AVR cycles, since
+// HANDSHAKE_STATS timestamps with it, so a revolution is 100 half periods of 2 ms, and OC1A only toggles at the start
+// and end of the first one. OC1A is on PD5.
+#define INDEX_HALF_PERIOD (F_CPU / 500)
+#define INDEX_HALF_PERIODS 100
+#define TACH_PIN_HIGH() bit_is_set(PIND, 5)
+
+static volatile uint16_t halfPeriod;
+// the TOP last written to OCR1A, which the timer switches to at the next compare match
+static volatile uint16_t nextTop;
+// TOPs of the half period now counting, the one before it, and the one before that
+static volatile uint16_t tops[3];
+static volatile bool indexMode;
+static uint8_t halfPeriodsLeft;
+static uint8_t flutter;
+static uint8_t flutterRandom = 1;
+
+void TachInit()
+{
+	// enable power to 16-bit Timer/Counter 1
+	PRR0 &= ~(1<<PRTIM1); 
+	
+	halfPeriod = pgm_read_word(&tachHalfPeriods[0]);
+	indexMode = false;
+	halfPeriodsLeft = TACH_HALF_PERIODS_PER_REV;
+	OCR1A = halfPeriod;
+	nextTop = tops[0] = tops[1] = tops[2] = halfPeriod;
+	
+	// toggle OC1A when a counter compare match with OCR1A occurs. 
+	// use Fast-PWM OCRnA mode - this provides double-buffering of OCR1A.
+	// no clock prescale: increment counter every on clock cycle.		
+	TCCR1A = (1<<COM1A0) | (1<<WGM11) | (1<<WGM10); 
+	TCCR1B = (1<<WGM13) | (1<<WGM12) | (1<<CS10); 
+	
+	TIFR1 = (1 << OCF1A);
+	TIMSK1 |= (1 << OCIE1A);
+}
+
+void TachSetTrack(uint8_t track, bool mfm)
+{
+	uint8_t speedZone = track >> 4;	
+	if (speedZone > 4)
+		speedZone = 4;
+	uint16_t period = pgm_read_word(&tachHalfPeriods[speedZone]);
+				
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		// the interrupt loads it for the next half period
+		halfPeriod = period;
+		
+		if (mfm != indexMode)
+		{
+			indexMode = mfm;
+			halfPeriodsLeft = mfm ? INDEX_HALF_PERIODS : TACH_HALF_PERIODS_PER_REV;
+			nextTop = mfm ? INDEX_HALF_PERIOD : period;
+			OCR1A = nextTop;
+			TCCR1A |= (1<<COM1A0);
+		}
+	}	
+}
+
+uint16_t TachTopBefore(uint16_t to)
+{
+	uint16_t top;
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		// tops[1] is right unless the timer wrapped again after 'to', or the interrupt hasn't run for the wrap
+		uint8_t ago = 1;
+		if (TCNT1 < to)
+			ago++;
+		if (TIFR1 & (1<<OCF1A))
+			ago--;
+		top = tops[ago];
+	}
+	
+	return top;
+}
+
+// A compare match ends a half period, and starts the next one. OCR1A is double-buffered, so the value written
+// here is the length of the half period after that.
+ISR(TIMER1_COMPA_vect)
+{
+	tops[2] = tops[1];
+	tops[1] = tops[0];
+	tops[0] = nextTop;
+	
+	if (indexMode)
+	{
+		if (--halfPeriodsLeft == 0)
+			halfPeriodsLeft = INDEX_HALF_PERIODS;
+			
+		// Let the next compare match toggle OC1A only if the next half period needs the other level: high for the
+		// pulse, when it's the last one counted down, and low for the rest. When OC1A isn't toggling the pin shows
+		// its PORTD bit, which is low, the same as OC1A whenever it stops toggling.
+		bool pulse = (halfPeriodsLeft == 1);
+		if (pulse != (TACH_PIN_HIGH() != 0))
+			TCCR1A |= (1<<COM1A0);
+		else
+			TCCR1A &= ~(1<<COM1A0);
+		return;
+	}
+	
+	if (--halfPeriodsLeft == 0)
+	{
+		halfPeriodsLeft = TACH_HALF_PERIODS_PER_REV;
+		
+		// 8-bit Galois LFSR, then move 1 to 4 steps on around the flutter values
+		flutterRandom = (flutterRandom >> 1) ^ ((flutterRandom & 1) ? 0xB8 : 0);
+		flutter += FLUTTER_STEP * (1 + (flutterRandom & 3));
+		if (flutter >= FLUTTER_STEP * FLUTTER_STEPS)
+			flutter -= FLUTTER_STEP * FLUTTER_STEPS;
+	}
+	
+	nextTop = halfPeriod - flutter;
+	OCR1A = nextTop;
+}
@@ -0,0 +1,32 @@
+/* 
+    Floppy Emu, copyright 2013 Steve Chamberlin, "Big Mess o' Wires". All rights reserved.
+	
+    Floppy Emu is licensed under a Creative Commons Attribution-NonCommercial 3.0 Unported 
+	license. (CC BY-NC 3.0) The terms of the license may be viewed at 	
+	http://creativecommons.org/licenses/by-nc/3.0/
+	
+	Based on a work at http://www.bigmessowires.com/macintosh-floppy-emu/
+	
+    Permissions beyond the scope of this license may be available at www.bigmessowires.com
+	or from mailto:steve@bigmessowires.com.
+*/
+
+#ifndef TACH_H_
+#define TACH_H_
+
+#include <avr/io.h>
+
+// Timer 1 makes the drive's TACH signal on OC1A. For GCR disks it toggles 120 times per revolution at the
+// speed of the head's zone, and for MFM disks it pulses once per revolution as the index. Each half period is
+// loaded from the timer interrupt, so the signal doesn't depend on the main loop.
+void TachInit();
+
+// Set the speed for the drive's track, or the index pulse for an MFM disk.
+void TachSetTrack(uint8_t track, bool mfm);
+
+// The Timer1 TOP, the last count before it wraps to 0, of the half period before the one holding 'to'. Call it
+// less than a half period after Timer1 read 'to', with interrupts enabled or not. OCR1A can't be read for this,
+// because it's double-buffered and reads back the TOP of a later half period.
+uint16_t TachTopBefore(uint16_t to);
+
+#endif /* TACH_H_ */
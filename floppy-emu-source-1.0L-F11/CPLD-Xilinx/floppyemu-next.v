@@ -0,0 +1,772 @@
+/* 
+  Floppy Emu, copyright 2013 Steve Chamberlin, "Big Mess o' Wires". All rights reserved.
+	
+  Floppy Emu is licensed under a Creative Commons Attribution-NonCommercial 3.0 Unported 
+  license. (CC BY-NC 3.0) The terms of the license may be viewed at 	
+  http://creativecommons.org/licenses/by-nc/3.0/
+	
+  Based on a work at http://www.bigmessowires.com/macintosh-floppy-emu/
+	
+  Permissions beyond the scope of this license may be available at www.bigmessowires.com
+  or from mailto:steve@bigmessowires.com.
+
+  --------------------------------------------------------------------------------------
+  
+  Unreleased firmware 17, adding to the released firmware 11 in floppyemu.v: the read byte FIFO (12),
+  GCR translation (13), the MFM byte handshake (14), the MFM CRC (15), the underrun counter (16), and
+  double density MFM (17). This design hasn't been fitted, simulated, or run on hardware, and it isn't
+  part of floppyemu.xise; firmware.xvf is built from floppyemu.v. The AVR firmware sends MFM the way it
+  does to firmware 11, and doesn't use the MFM byte handshake, the MFM CRC, the underrun counter or double
+  density, until this design has been fitted and run.
+  
+  --------------------------------------------------------------------------------------
+  
+  Disk registers (read):	
+	    State-control lines    Register
+  CA2    CA1    CA0    SEL    addressed    Information in register
+
+  0      0      0      0      DIRTN        Head step direction (0 = toward track 79, 1 = toward track 0)
+  0      0      0      1      CSTIN        Disk in place (0 = disk is inserted)
+  0      0      1      0      STEP         Drive head stepping (setting to 0 performs a step, returns to 1 when step is complete)
+  0      0      1      1      WRTPRT       Disk locked (0 = locked)
+  0      1      0      0      MOTORON      Drive motor running (0 = on, 1 = off)
+  0      1      0      1      TK0          Head at track 0 (0 = at track 0)
+  0		1		 1		  0		SWITCHED   	 Disk switched (1 = yes?) SWIM3: relax, also eject in progress
+  0      1      1      1      TACH         GCR: Tachometer (produces 60 pulses for each rotation of the drive motor), MFM: Index pulse
+  1      0      0      0      RDDATA0      Read data, lower head, side 0
+  1      0      0      1      RDDATA1      Read data, upper head, side 1 
+  1      0      1      0      SUPERDR      Drive is a Superdrive (0 = no, 1 = yes) SWIM3: two meg drive. 
+  1      0      1      1      MFM_MODE		 SWIM3: MFM_MODE, 1 = yes (opposite of writing?)
+  1      1      0      0      SIDES        Single- or double-sided drive (0 = single side, 1 = double side), SWIM: 0 = 4MB, 1 = not 4MB
+  1      1      0      1      READY        0 = yes, SWIM3: SEEK_COMPLETE
+  1      1      1      0      INSTALLED	 0 = yes, only used by SWIM, not IWM? SWIM3: drive present. 
+  1      1      1      1      HSHK_HD      400K/800K: implements ready handshake if 1, Superdrive: Inserted disk capacity (0 = HD, 1 = DD), SWIM3: 1 = ONE_MEG_MEDIA 
+
+
+  Disk registers (write):
+    Control lines      Register
+  CA1    CA0    SEL    addressed    Register function
+
+  0      0      0      DIRTN        Set stepping direction (0 = toward track 79, 1 = toward track 0), SWIM3: SEEK_POSITIVE
+  0      0      1      SWITCHED		Reset disk switched flag (writing 1 sets switch flag to 0)
+  0      1      0      STEP         Step the drive head one track (setting to 0 performs a step, returns to 1 when step is complete)
+  1      0      0      MOTORON      Turn drive motor on/off (0 = on, 1 = off)
+  1      0      0      TWOMEGMEDIA_CHECK The first time zero is written, changes the behavior when reading SIDES
+  0      1      1      MFM_MODE     0 = MFM, 1 = GCR
+  1      1      0      EJECT        Eject the disk (writing 1 ejects the disk)
+  1      1      0		  INDEX			if writing 0
+*/
+
+`define DRIVE_REG_DIRTN		0  
+`define DRIVE_REG_CSTIN		1  	                           
+`define DRIVE_REG_STEP		2                          
+`define DRIVE_REG_WRTPRT	3  
+`define DRIVE_REG_MOTORON	4  
+`define DRIVE_REG_TK0		5  
+`define DRIVE_REG_EJECT		6  	                           
+`define DRIVE_REG_TACH		7  
+`define DRIVE_REG_RDDATA0	8  
+`define DRIVE_REG_RDDATA1	9  
+`define DRIVE_REG_SUPERDR	10 
+`define DRIVE_REG_UNUSED   11
+`define DRIVE_REG_SIDES		12 
+`define DRIVE_REG_READY		13 
+`define DRIVE_REG_INSTALLED	14 
+`define DRIVE_REG_HSHK_HD		15 
+
+`define FIRMWARE_VERSION_NUMBER 		17
+
+// MFM CRC-CCITT after FFFF and the first A1 of a block
+`define CRC_AFTER_A1				16'h443B
+
+// The MCU queues disk bytes in a small FIFO ahead of the shifter. 2^N entries. No size has been through the
+// fitter, so it isn't known which fit the XC9572XL.
+`define BYTE_FIFO_ADDR_BITS		1
+`define BYTE_FIFO_DEPTH			(1 << `BYTE_FIFO_ADDR_BITS)
+
+// GCR translation, config bit 2. Without it config bit 2 is ignored, and the AVR firmware must not be built with
+// CPLD_GCR_TRANSLATE.
+//`define GCR_TRANSLATE
+
+// Capability bits, reported in bit 6 with the version number during reset. The version number says which design
+// this is, and these say which options it was built with.
+`ifdef GCR_TRANSLATE
+`define FIRMWARE_CAPABILITIES			7'h40
+`else
+`define FIRMWARE_CAPABILITIES			7'h00
+`endif
+
+module floppyemu(
+	input clk,
+	
+   // Macintosh interface	
+	input ca0,				// PH0
+	input ca1,				// PH1
+	input ca2,				// PH2
+	input lstrb,			// PH3
+	input SEL, 				// HDSEL from VIA
+	input _enable, 			
+	input wr,
+	input _wreq,
+	input pwm, 				// unused
+	output rd,
+	 
+	// microcontroller interface
+	input _rst,
+	
+	output stepDirectionMotorOn,
+	output reg stepRequest,
+	input stepAck_diskInserted,
+	
+	output _wreqMCU,
+	output reg rdAckWrTick,
+	output reg driveCurrentSide,
+	output reg ejectRequest,
+	
+	input driveTach,
+	input byteReady_tk0,
+	
+	input outputEnable,
+	inout [6:0] data,
+	
+	output zero,
+	
+	// status display 
+	output led,
+	
+	// debugging
+	output test
+);
+
+	/********** drive state data **********/
+	reg _driveRegTK0;
+	reg _driveRegMotorOn;
+	reg driveRegStepDirection;
+	reg _driveRegWriteProtect;
+	reg _driveRegDiskInserted;
+	reg _driveRegMFMMode;
+	reg mfmDoubleDensity;
+	
+	// GCR and double density MFM bit cells are 40 clocks, high density MFM cells are 20
+	wire longCell = (_driveRegMFMMode == 1) | mfmDoubleDensity;
+	
+	/********** serial to parallel interface **********/	
+	// GCR: One bit every 2 microseconds
+	// The exact rate on the Macintosh is actually 16 clocks @ 7.8336 MHz = 2.04 microseconds.
+	// MFM: One bit every 1 microsecond, or every 2 microseconds for double density (720K) disks
+	reg [7:0] shifter;
+	reg [5:0] bitTimer;
+	reg [3:0] bitCounter;
+	reg [6:0] wrData;
+	reg rdHead;
+	reg [1:0] wrHistory;
+	reg mfmWriteSynced;
+	reg wrClear;
+	
+	/* Read byte FIFO: bytes from the MCU wait here until the shifter needs them.
+		The handshake is unchanged: the MCU puts a byte on the data bus and raises byteReady_tk0, the CPLD 
+		pulses rdAckWrTick when it has taken the byte, and the MCU lowers byteReady_tk0 again. The byte is 
+		now taken as soon as there's room in the FIFO instead of at the next byte boundary, so the MCU only 
+		waits when it's more than BYTE_FIFO_DEPTH bytes ahead of the Mac.
+		MFM byte handshake, config bit 3: both nibbles of an MFM byte arrive on one handshake. The high nibble 
+		is taken when byteReady_tk0 rises, once there's room for both, and the low nibble when it falls again, 
+		so the MCU waits for one ack per byte instead of two. The FIFO still holds nibbles, and the shifter 
+		encodes them exactly as before. */
+	reg [6:0] fifo [0:`BYTE_FIFO_DEPTH-1];
+	reg [`BYTE_FIFO_ADDR_BITS:0] fifoWrite; // the extra MSB tells a full FIFO from an empty one
+	reg [`BYTE_FIFO_ADDR_BITS:0] fifoRead;
+	reg fifoPushed; // the byte on the data bus was taken, wait for byteReady_tk0 to go low
+	reg [2:0] ackTimer;
+	reg mfmBytePairs;
+	reg byteArmed; // byteReady_tk0 was last low outside a step, so when it's high it's a byte and not TK0
+	
+	wire fifoEmpty = (fifoWrite == fifoRead);
+	wire fifoFull = ((fifoWrite ^ fifoRead) == `BYTE_FIFO_DEPTH);
+	wire [6:0] fifoOut = fifo[fifoRead[`BYTE_FIFO_ADDR_BITS-1:0]];
+	wire [`BYTE_FIFO_ADDR_BITS:0] fifoLevel = fifoWrite - fifoRead;
+	wire fifoRoom = (mfmBytePairs == 1) ? (fifoLevel < `BYTE_FIFO_DEPTH-1) : (fifoFull == 0);
+	/* No bytes are taken while writing, before the disk is inserted (config load), or when byteReady_tk0 is TK0 for 
+		a step. A byte the MCU raised before a step arrived is still taken, since the MCU waits for its ack with 
+		interrupts disabled; the step then flushes it. */
+	wire fifoPush = (_wreq == 1 && _driveRegDiskInserted == 0 && byteArmed == 1 && outputEnable == 0 &&
+						  byteReady_tk0 == 1 && fifoPushed == 0 && fifoRoom == 1);
+	wire fifoPushLow = (_wreq == 1 && mfmBytePairs == 1 && byteReady_tk0 == 0 && fifoPushed == 1);
+	
+	/* Optional GCR translation, config bit 2: the MCU sends 1 v5..v0 for a 6-bit value, which is looked up 
+		here instead of in the MCU's sony_to_disk_byte table, and 0 b5..b0 for the D5 and AA mark bytes, which
+		are the only disk bytes with no 6-bit value. Bytes written by the Mac are returned to the MCU the same 
+		way. The two 64-entry tables are large, so they're only built with GCR_TRANSLATE. */
+`ifdef GCR_TRANSLATE
+	reg gcrTranslate;
+`endif
+	
+	/* MFM CRC-CCITT, over the nibbles that are serialized and deserialized. Reading, the MCU sets bit 5 on the
+		first nibble of a block to start the CRC at FFFF, and sends 1 0 0 0 0 0 0 for each nibble of the CRC,
+		which is then shifted out of the register. Writing, the CRC restarts at the first A1 of a block, and 
+		bit 5 of each nibble given to the MCU is set when the CRC so far is 0, so the MCU only has to look at
+		the last nibble of the CRC bytes to check a whole sector. */
+	reg [15:0] crc;
+	reg wrPrevMark; // the last complete byte written was an A1 mark
+	
+	function [15:0] CrcNibble;
+		input [15:0] c;
+		input [3:0] d;
+		integer k;
+	begin
+		CrcNibble = c;
+		for (k = 3; k >= 0; k = k - 1)
+			CrcNibble = { CrcNibble[14:0], 1'b0 } ^ ((CrcNibble[15] ^ d[k]) ? 16'h1021 : 16'h0000);
+	end
+	endfunction
+	
+	/* Underrun counter: the number of times the FIFO ran empty inside an address or data block, so that sync 
+		bytes were inserted where the Mac expected data. A stall only counts once the MCU continues the same block: 
+		a block abandoned by a restart after a step, write, or side change is not an underrun. GCR blocks run from 
+		any byte other than FF up to the next FF, which ends every gap, so a stall next to an FF in the data isn't 
+		counted. MFM blocks run from the first A1 to the first nibble of the CRC, and the MCU sets bit 5 on the 
+		first nibble of a gap to start a new stream. The 7-bit count wraps, and is cleared by the config byte.
+		The MCU reads it by releasing the data bus with outputEnable, and raising byteReady_tk0 while _wreqMCU is high. */
+	reg [6:0] underrunCount;
+	reg inBlock;
+	reg stalled; // sync bytes were inserted since the last byte of the block
+	
+	wire streamStart = (_driveRegMFMMode == 1) ? (fifoOut == 7'h7F) : fifoOut[5];
+	wire blockByte = (_driveRegMFMMode == 1) ? (fifoOut != 7'h7F) : (fifoOut[4] | (inBlock & ~fifoOut[6] & ~fifoOut[5]));
+	
+	// MFM read: the next data nibble, from the FIFO or the CRC
+	wire [3:0] mfmNibble = (fifoOut[6] == 1) ? crc[15:12] : fifoOut[3:0];
+	
+	// MFM write: the nibble in the shifter, whether its c2 clock is missing (an A1 mark), and the CRC with it
+	wire [3:0] wrNibble = { shifter[6], shifter[4], shifter[2], shifter[0] };
+	wire wrMark = (shifter[5] != ~(shifter[6] | shifter[4]));
+	wire [15:0] wrCrc = (rdAckWrTick == 0 && wrMark == 1 && wrPrevMark == 0) ? `CRC_AFTER_A1 : CrcNibble(crc, wrNibble);
+	
+`ifdef GCR_TRANSLATE
+	// 6-bit value to disk byte, without the MSB that is always 1
+	function [6:0] SonyToDisk;
+		input [5:0] v;
+		case (v)
+			6'h00: SonyToDisk = 7'h16;
+			6'h01: SonyToDisk = 7'h17;
+			6'h02: SonyToDisk = 7'h1A;
+			6'h03: SonyToDisk = 7'h1B;
+			6'h04: SonyToDisk = 7'h1D;
+			6'h05: SonyToDisk = 7'h1E;
+			6'h06: SonyToDisk = 7'h1F;
+			6'h07: SonyToDisk = 7'h26;
+			6'h08: SonyToDisk = 7'h27;
+			6'h09: SonyToDisk = 7'h2B;
+			6'h0A: SonyToDisk = 7'h2C;
+			6'h0B: SonyToDisk = 7'h2D;
+			6'h0C: SonyToDisk = 7'h2E;
+			6'h0D: SonyToDisk = 7'h2F;
+			6'h0E: SonyToDisk = 7'h32;
+			6'h0F: SonyToDisk = 7'h33;
+			6'h10: SonyToDisk = 7'h34;
+			6'h11: SonyToDisk = 7'h35;
+			6'h12: SonyToDisk = 7'h36;
+			6'h13: SonyToDisk = 7'h37;
+			6'h14: SonyToDisk = 7'h39;
+			6'h15: SonyToDisk = 7'h3A;
+			6'h16: SonyToDisk = 7'h3B;
+			6'h17: SonyToDisk = 7'h3C;
+			6'h18: SonyToDisk = 7'h3D;
+			6'h19: SonyToDisk = 7'h3E;
+			6'h1A: SonyToDisk = 7'h3F;
+			6'h1B: SonyToDisk = 7'h4B;
+			6'h1C: SonyToDisk = 7'h4D;
+			6'h1D: SonyToDisk = 7'h4E;
+			6'h1E: SonyToDisk = 7'h4F;
+			6'h1F: SonyToDisk = 7'h53;
+			6'h20: SonyToDisk = 7'h56;
+			6'h21: SonyToDisk = 7'h57;
+			6'h22: SonyToDisk = 7'h59;
+			6'h23: SonyToDisk = 7'h5A;
+			6'h24: SonyToDisk = 7'h5B;
+			6'h25: SonyToDisk = 7'h5C;
+			6'h26: SonyToDisk = 7'h5D;
+			6'h27: SonyToDisk = 7'h5E;
+			6'h28: SonyToDisk = 7'h5F;
+			6'h29: SonyToDisk = 7'h65;
+			6'h2A: SonyToDisk = 7'h66;
+			6'h2B: SonyToDisk = 7'h67;
+			6'h2C: SonyToDisk = 7'h69;
+			6'h2D: SonyToDisk = 7'h6A;
+			6'h2E: SonyToDisk = 7'h6B;
+			6'h2F: SonyToDisk = 7'h6C;
+			6'h30: SonyToDisk = 7'h6D;
+			6'h31: SonyToDisk = 7'h6E;
+			6'h32: SonyToDisk = 7'h6F;
+			6'h33: SonyToDisk = 7'h72;
+			6'h34: SonyToDisk = 7'h73;
+			6'h35: SonyToDisk = 7'h74;
+			6'h36: SonyToDisk = 7'h75;
+			6'h37: SonyToDisk = 7'h76;
+			6'h38: SonyToDisk = 7'h77;
+			6'h39: SonyToDisk = 7'h79;
+			6'h3A: SonyToDisk = 7'h7A;
+			6'h3B: SonyToDisk = 7'h7B;
+			6'h3C: SonyToDisk = 7'h7C;
+			6'h3D: SonyToDisk = 7'h7D;
+			6'h3E: SonyToDisk = 7'h7E;
+			6'h3F: SonyToDisk = 7'h7F;
+		endcase
+	endfunction
+	
+	// disk byte without its MSB to { 1, 6-bit value }, or { 0, low 6 bits } if the byte has no 6-bit value
+	function [6:0] DiskToSony;
+		input [6:0] d;
+		case (d)
+			7'h16: DiskToSony = { 1'b1, 6'h00 };
+			7'h17: DiskToSony = { 1'b1, 6'h01 };
+			7'h1A: DiskToSony = { 1'b1, 6'h02 };
+			7'h1B: DiskToSony = { 1'b1, 6'h03 };
+			7'h1D: DiskToSony = { 1'b1, 6'h04 };
+			7'h1E: DiskToSony = { 1'b1, 6'h05 };
+			7'h1F: DiskToSony = { 1'b1, 6'h06 };
+			7'h26: DiskToSony = { 1'b1, 6'h07 };
+			7'h27: DiskToSony = { 1'b1, 6'h08 };
+			7'h2B: DiskToSony = { 1'b1, 6'h09 };
+			7'h2C: DiskToSony = { 1'b1, 6'h0A };
+			7'h2D: DiskToSony = { 1'b1, 6'h0B };
+			7'h2E: DiskToSony = { 1'b1, 6'h0C };
+			7'h2F: DiskToSony = { 1'b1, 6'h0D };
+			7'h32: DiskToSony = { 1'b1, 6'h0E };
+			7'h33: DiskToSony = { 1'b1, 6'h0F };
+			7'h34: DiskToSony = { 1'b1, 6'h10 };
+			7'h35: DiskToSony = { 1'b1, 6'h11 };
+			7'h36: DiskToSony = { 1'b1, 6'h12 };
+			7'h37: DiskToSony = { 1'b1, 6'h13 };
+			7'h39: DiskToSony = { 1'b1, 6'h14 };
+			7'h3A: DiskToSony = { 1'b1, 6'h15 };
+			7'h3B: DiskToSony = { 1'b1, 6'h16 };
+			7'h3C: DiskToSony = { 1'b1, 6'h17 };
+			7'h3D: DiskToSony = { 1'b1, 6'h18 };
+			7'h3E: DiskToSony = { 1'b1, 6'h19 };
+			7'h3F: DiskToSony = { 1'b1, 6'h1A };
+			7'h4B: DiskToSony = { 1'b1, 6'h1B };
+			7'h4D: DiskToSony = { 1'b1, 6'h1C };
+			7'h4E: DiskToSony = { 1'b1, 6'h1D };
+			7'h4F: DiskToSony = { 1'b1, 6'h1E };
+			7'h53: DiskToSony = { 1'b1, 6'h1F };
+			7'h56: DiskToSony = { 1'b1, 6'h20 };
+			7'h57: DiskToSony = { 1'b1, 6'h21 };
+			7'h59: DiskToSony = { 1'b1, 6'h22 };
+			7'h5A: DiskToSony = { 1'b1, 6'h23 };
+			7'h5B: DiskToSony = { 1'b1, 6'h24 };
+			7'h5C: DiskToSony = { 1'b1, 6'h25 };
+			7'h5D: DiskToSony = { 1'b1, 6'h26 };
+			7'h5E: DiskToSony = { 1'b1, 6'h27 };
+			7'h5F: DiskToSony = { 1'b1, 6'h28 };
+			7'h65: DiskToSony = { 1'b1, 6'h29 };
+			7'h66: DiskToSony = { 1'b1, 6'h2A };
+			7'h67: DiskToSony = { 1'b1, 6'h2B };
+			7'h69: DiskToSony = { 1'b1, 6'h2C };
+			7'h6A: DiskToSony = { 1'b1, 6'h2D };
+			7'h6B: DiskToSony = { 1'b1, 6'h2E };
+			7'h6C: DiskToSony = { 1'b1, 6'h2F };
+			7'h6D: DiskToSony = { 1'b1, 6'h30 };
+			7'h6E: DiskToSony = { 1'b1, 6'h31 };
+			7'h6F: DiskToSony = { 1'b1, 6'h32 };
+			7'h72: DiskToSony = { 1'b1, 6'h33 };
+			7'h73: DiskToSony = { 1'b1, 6'h34 };
+			7'h74: DiskToSony = { 1'b1, 6'h35 };
+			7'h75: DiskToSony = { 1'b1, 6'h36 };
+			7'h76: DiskToSony = { 1'b1, 6'h37 };
+			7'h77: DiskToSony = { 1'b1, 6'h38 };
+			7'h79: DiskToSony = { 1'b1, 6'h39 };
+			7'h7A: DiskToSony = { 1'b1, 6'h3A };
+			7'h7B: DiskToSony = { 1'b1, 6'h3B };
+			7'h7C: DiskToSony = { 1'b1, 6'h3C };
+			7'h7D: DiskToSony = { 1'b1, 6'h3D };
+			7'h7E: DiskToSony = { 1'b1, 6'h3E };
+			7'h7F: DiskToSony = { 1'b1, 6'h3F };
+			default: DiskToSony = { 1'b0, d[5:0] };
+		endcase
+	endfunction
+`endif
+	
+	always @(posedge clk) begin
+		wrHistory <= { wrHistory[0], wr };
+	end
+	
+	always @(posedge clk) begin
+		if (fifoPush || fifoPushLow)
+			fifo[fifoWrite[`BYTE_FIFO_ADDR_BITS-1:0]] <= data;
+	end
+
+	always @(posedge clk or negedge _rst) begin
+		if (_rst == 0) begin
+			rdAckWrTick <= 0;
+			_driveRegWriteProtect <= 1;
+			_driveRegDiskInserted <= 1;
+			_driveRegMFMMode <= 1;
+			mfmDoubleDensity <= 0;
+`ifdef GCR_TRANSLATE
+			gcrTranslate <= 0;
+`endif
+			mfmBytePairs <= 0;
+			byteArmed <= 0;
+			underrunCount <= 0;
+			inBlock <= 0;
+			stalled <= 0;
+			wrPrevMark <= 0;
+			crc <= 16'hFFFF;
+			wrData <= `FIRMWARE_VERSION_NUMBER | `FIRMWARE_CAPABILITIES;
+			mfmWriteSynced <= 0;
+			wrClear <= 0;
+			fifoWrite <= 0;
+			fifoRead <= 0;
+			fifoPushed <= 0;
+			ackTimer <= 0;
+		end
+		else begin
+			// one-way switch for disk inserted register - until next reset, stepAck_diskInserted will act only as stepAck
+			if (_driveRegDiskInserted == 1 && stepAck_diskInserted == 0) begin
+				_driveRegDiskInserted <= 0;
+			end
+			if (byteReady_tk0 == 0)
+				byteArmed <= ~stepRequest;
+			// is the Macintosh currently writing to the disk?
+			if (_wreq == 0) begin
+				// discard any read bytes still queued
+				fifoRead <= fifoWrite;
+				
+				// was there a transition on the wr line?
+				// GCR: any transition
+				// MFM: falling edge
+				if (((wrHistory[1] != wrHistory[0]) && (_driveRegMFMMode == 1)) ||
+					 ((wrHistory[1] && ~wrHistory[0]) && (_driveRegMFMMode == 0))) begin
+					// has at least half a bit cell time elpased since the last cell boundary?
+					if ((bitTimer >= 20 && longCell == 1) ||
+						 (bitTimer >= 10 && longCell == 0)) begin 
+						shifter <= { shifter[6:0], 1'b1 }; 
+						bitCounter <= bitCounter - 1'b1;					
+					end
+					// do nothing if the clock count was less than half a cell
+					
+					// reset the bit timer
+					bitTimer <= 0;
+				end
+				else begin
+					// have one and a half bit cell times elapsed?
+					if ((bitTimer >= 60 && longCell == 1) ||
+						 (bitTimer >= 30 && longCell == 0)) begin
+						shifter <= { shifter[6:0], 1'b0 };
+						bitCounter <= bitCounter - 1'b1;
+						
+						if (longCell == 1)
+							bitTimer <= 20;
+						else
+							bitTimer <= 10;
+					end
+					else begin
+						// init shifter at the beginning of a write, so we can recognize the framing bits later
+						if (wrClear == 0) begin
+							shifter <= 0;
+							wrClear <= 1;
+						end
+						// has a complete byte been shifted in?
+						else if (_driveRegMFMMode == 1) begin
+							// GCR
+							if (shifter[7] == 1) begin
+								// GCR: The complete byte is shifter[7:0], but only 7 bits are stored in wrData, since the MSB is always 1.
+`ifdef GCR_TRANSLATE
+								wrData <= (gcrTranslate == 1) ? DiskToSony(shifter[6:0]) : shifter[6:0]; // store the byte for the mcu
+`else
+								wrData <= shifter[6:0]; // store the byte for the mcu
+`endif
+								shifter <= 0; // clear the byte from the shifter
+								rdAckWrTick <= ~rdAckWrTick; // signal the mcu that a new byte is ready
+							end
+						end	
+						else begin
+							// MFM
+							// If we're in write mode, but haven't yet synched (framed the bytes in the bit stream),
+							// and we see 01000100 in the shifter, assume that it's the first half of an A1 sync
+							if ((bitCounter == 0) ||
+								 (shifter == 8'h44 && mfmWriteSynced == 0)) begin		
+								// MFM: send the mcu the data nibble in the low 4 bits, and clock bit C2 in bit 4
+								wrData[0] <= shifter[0];
+								wrData[1] <= shifter[2];
+								wrData[2] <= shifter[4];
+								wrData[3] <= shifter[6];
+								wrData[4] <= shifter[5]; // clock bit
+								wrData[5] <= (wrCrc == 0);
+								bitCounter <= 8;
+								
+								// the low nibble completes a byte (rdAckWrTick was 0 after the high nibble)
+								if (shifter != 8'h44 || mfmWriteSynced == 1) begin
+									crc <= wrCrc;
+									if (rdAckWrTick == 0)
+										wrPrevMark <= wrMark;
+								end
+								
+								rdAckWrTick <= (shifter == 8'h44 && mfmWriteSynced == 0) ? 0 : ~rdAckWrTick; // signal the mcu that a new nibble is ready
+								mfmWriteSynced <= mfmWriteSynced | (shifter == 8'h44);
+							end
+						end
+						
+						bitTimer <= bitTimer + 1'b1;	
+					end	
+				end
+			end
+			else begin
+				mfmWriteSynced <= 0;
+				wrClear <= 0;
+				wrPrevMark <= 0;
+				
+				// take a byte from the MCU, and hold rdAck long enough for the MCU's polling loop to see it
+				if (fifoPush) begin
+					fifoWrite <= fifoWrite + 1'b1;
+					fifoPushed <= 1;
+					rdAckWrTick <= 1;
+					ackTimer <= 7;
+				end
+				else begin
+					if (fifoPushLow)
+						fifoWrite <= fifoWrite + 1'b1;
+					if (byteReady_tk0 == 0)
+						fifoPushed <= 0;
+					if (ackTimer != 0)
+						ackTimer <= ackTimer - 1'b1;
+					else
+						rdAckWrTick <= 0;
+				end
+				
+				// is it time for a new bit?
+				if ((bitTimer == 40 && longCell == 1) ||
+					 (bitTimer == 20 && longCell == 0))
+				begin
+					// are all the bits done?
+					if (bitCounter == 0) begin
+						// if there's a byte ready, but no disk inserted, then load config options from the MCU
+						if (byteReady_tk0 == 1 && _driveRegDiskInserted == 1) begin
+							_driveRegWriteProtect <= data[0];
+							_driveRegMFMMode <= data[1];
+`ifdef GCR_TRANSLATE
+							gcrTranslate <= data[2];
+`endif
+							mfmBytePairs <= data[3];
+							mfmDoubleDensity <= data[4];
+							underrunCount <= 0;
+						end
+						// is there a new byte in the FIFO?
+						else if (fifoEmpty == 0 && stepRequest == 0) begin
+							// load the new byte. 
+							if (_driveRegMFMMode == 1) begin
+								// Only 7 bits are transferred, since the MSB is always 1.
+`ifdef GCR_TRANSLATE
+								if (gcrTranslate == 0)
+									shifter <= { 1'b1, fifoOut };
+								// translated: a 6-bit value, or the low 6 bits of D5 or AA
+								else if (fifoOut[6] == 1)
+									shifter <= { 1'b1, SonyToDisk(fifoOut[5:0]) };
+								else
+									shifter <= { 1'b1, ~fifoOut[5], fifoOut[5:0] };
+`else
+								shifter <= { 1'b1, fifoOut };
+`endif
+							end
+							else begin
+								// For MFM, the 7 bits received from the MCU are:
+								// 	0 0 m d3 d2 d1 d0
+								// From this we can constuct the MFM-encoded byte with clock and data bits:
+								// 	c3 d3 c2 d2 c1 d1 c0 d0
+								// where cN = dN+1 NOR dN.
+								// If m is 1, then this is part of a mark byte, and c2 should be forced to 0.
+								// If the byte is 1 0 0 0 0 0 0, the nibble is the next one of the CRC instead.
+								shifter[7] <= ~(shifter[7] | mfmNibble[3]); 
+								shifter[6] <= mfmNibble[3];
+								shifter[5] <= ~(mfmNibble[3] | mfmNibble[2]) & ~fifoOut[4];
+								shifter[4] <= mfmNibble[2];
+								shifter[3] <= ~(mfmNibble[2] | mfmNibble[1]); 
+								shifter[2] <= mfmNibble[1];
+								shifter[1] <= ~(mfmNibble[1] | mfmNibble[0]);
+								shifter[0] <= mfmNibble[0];
+								
+								if (fifoOut[6] == 1)
+									crc <= { crc[11:0], 4'b0000 };
+								else
+									crc <= CrcNibble((fifoOut[5] == 1) ? 16'hFFFF : crc, fifoOut[3:0]);
+							end
+							bitCounter <= 7;
+							fifoRead <= fifoRead + 1'b1;
+							
+							if (stalled == 1 && streamStart == 0)
+								underrunCount <= underrunCount + 1'b1;
+							stalled <= 0;
+							inBlock <= blockByte;
+						end
+						else begin
+							// insert a sync byte
+							if (inBlock == 1)
+								stalled <= 1;
+							if (_driveRegMFMMode == 1)
+							begin
+								shifter <= { 8'b11111111 }; 
+								bitCounter <= 9; // sync "byte" sends 10 bits rather than 8
+							end
+							else begin
+								shifter <= { 8'b10101010 }; // logical 0x0, encoded 0xA. Should sync byte be 0x4E instead?
+								bitCounter <= 7;
+							end							
+						end		
+					end
+					else begin
+						// there are still more bits remaining, so shift the next bit
+						shifter <= { shifter[6:0], 1'b0 }; // left shift
+						bitCounter <= bitCounter - 1'b1;
+					end
+				end
+				/* GCR: After the bit shift is completed, update the read head state, using the MSB of the shift register.
+					A logical 1 is sent as a falling (high to low) transition on the read head at a bit cell boundary time,
+					a logical 0 is sent as no falling transition. */
+				else if (bitTimer == 2 && shifter[7] == 1 && _driveRegMFMMode == 1) begin
+					rdHead <= 1'b0;
+				end
+				/* GCR: Half-way through the bit cell time, set the read head to 1
+					to prepare for a possible falling transition for the next bit. */
+				else if (bitTimer == 20 && _driveRegMFMMode == 1)
+				begin
+					rdHead <= 1'b1;
+				end
+				/* MFM: At the start of the bit cell time, set the read head to 0 if the logical value is 1. */
+				else if (bitTimer == 2 && shifter[7] == 1 && _driveRegMFMMode == 0)
+				begin
+					rdHead <= 1'b0;
+				end
+				/* MFM: About a quarter-way through the bit cell time, always reset read head to 1. */
+				else if (bitTimer == 7 && _driveRegMFMMode == 0)
+				begin
+					rdHead <= 1'b1;
+				end
+				
+				// a step discards any bytes queued for the old track
+				if (stepRequest == 1)
+					fifoRead <= fifoWrite;
+				
+				// increment bit timer modulo 40 (20 high density MFM)
+				if ((bitTimer == 40 && longCell == 1) ||
+					 (bitTimer == 20 && longCell == 0))
+					bitTimer <= 0;
+				else
+					bitTimer <= bitTimer + 1'b1;
+			end
+		end
+	end
+	
+	// enable the data output only if the MCU says its data lines are Hi Z
+	assign data = (outputEnable == 0) ? 7'hZZ : 
+					  (_rst == 1 && _wreqMCU == 1 && byteReady_tk0 == 1) ? underrunCount : wrData;
+	
+	/********** register read **********/
+	wire [3:0] driveReadRegisterSelect = {ca2,ca1,ca0,SEL};
+	
+	reg registerContents;
+	always @* begin
+		case (driveReadRegisterSelect)
+			`DRIVE_REG_DIRTN:
+				registerContents = driveRegStepDirection; // step direction
+			`DRIVE_REG_CSTIN:
+				registerContents = _driveRegDiskInserted; // disk in drive, 0 = yes
+			`DRIVE_REG_STEP:
+				registerContents = ~stepRequest; // STEP, 1 = complete
+			`DRIVE_REG_WRTPRT:
+				registerContents = _driveRegWriteProtect; // write protect, 0 = on, 1 = off
+			`DRIVE_REG_MOTORON:
+				registerContents = _driveRegMotorOn; // 0 = motor on
+			`DRIVE_REG_TK0:
+				registerContents = _driveRegTK0; // TK0: track 0 indicator
+			`DRIVE_REG_EJECT:
+				registerContents = 1'b0; // disk switched?
+			`DRIVE_REG_TACH:
+				registerContents = driveTach; // TACH: 60 pulses for each rotation of the drive motor
+			`DRIVE_REG_RDDATA0:
+				registerContents = rdHead; // RDDATA0
+			`DRIVE_REG_RDDATA1:
+				registerContents = rdHead; // RDDATA1
+			`DRIVE_REG_SUPERDR:
+				registerContents = 1'b1; // SUPERDR, 1 = yes
+			`DRIVE_REG_UNUSED:
+				registerContents = 1'b0; // UNUSED
+			`DRIVE_REG_SIDES:
+				registerContents = 1'b1; // SIDES = double-sided drive
+			`DRIVE_REG_READY:
+				registerContents = 1'b0; // READY = yes
+			`DRIVE_REG_INSTALLED:
+				registerContents = 1'b0; // INSTALLED = yes
+			`DRIVE_REG_HSHK_HD:
+				registerContents = _driveRegMFMMode | mfmDoubleDensity; // HSHK_HD = implements ready handshake, or DD/HD media
+
+		endcase
+	end
+	assign rd = _enable == 1'b1 ? 1'bZ : registerContents;
+	
+	always @(posedge clk or negedge _rst) begin
+		if (_rst == 0) begin
+			driveCurrentSide = 0;
+		end
+		else if (_enable == 1'b0 && lstrb == 1'b0) begin
+			if (driveReadRegisterSelect == `DRIVE_REG_RDDATA0)
+				driveCurrentSide = 0;
+			else if (driveReadRegisterSelect == `DRIVE_REG_RDDATA1)
+				driveCurrentSide = 1;
+		end
+	end
+	
+	// compute the effective _wreq state for the microcontroller
+	assign _wreqMCU = ~(_wreq == 0 && _enable == 0 && _driveRegMotorOn == 0);
+	
+	// cheesy: during a step request, stepDirectionMotorOn is the step direction. Otherwise it's motorOn.
+	assign stepDirectionMotorOn = stepRequest ? driveRegStepDirection : _driveRegMotorOn;
+	
+	/********** register write **********/
+	wire [2:0] driveWriteRegisterSelect = {ca1,ca0,SEL};
+	
+	reg [4:0] lstrbHistory;
+	always @(posedge clk) begin
+		lstrbHistory <= { lstrbHistory[3:0], lstrb };
+	end
+	
+	always @(posedge clk or negedge _rst) begin
+		if (_rst == 1'b0) begin
+			_driveRegTK0 <= 0;
+			_driveRegMotorOn <= 1;
+			driveRegStepDirection <= 0;
+			stepRequest <= 0;
+			ejectRequest <= 0;
+		end
+		// was there a rising edge on lstrb?
+		else if (_enable == 1'b0 && lstrbHistory == 5'b01111) begin
+			case (driveWriteRegisterSelect)
+				`DRIVE_REG_DIRTN:
+					driveRegStepDirection <= ca2;
+				//`DRIVE_REG_SWITCHED: // unused
+				`DRIVE_REG_STEP:
+					begin
+						stepRequest <= 1; // tell the microcontroller that a step was performed
+					end
+				`DRIVE_REG_MOTORON:
+					_driveRegMotorOn <= ca2;
+				`DRIVE_REG_EJECT:
+					if (ca2 == 1'b1) begin
+						ejectRequest <= 1; // tell the microcontroller that the disk was ejected. This stays on forever (until next reset)
+					end
+			endcase
+		end
+		else begin
+			// clear step request after mcu acknowledges it, and get the new track 0 state
+			if (stepRequest == 1 && stepAck_diskInserted == 1'b1) begin
+				stepRequest <= 0;
+				_driveRegTK0 <= byteReady_tk0;
+			end
+		end
+	end
+	
+	/********** Revision 1.0 board: status LEDs and fake SD writeProtect **********/
+	assign led = _driveRegMotorOn;
+	assign zero = 0;
+	
+	
+endmodule
\ No newline at end of file
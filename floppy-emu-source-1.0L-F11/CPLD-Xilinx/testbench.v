@@ -1,163 +1,1094 @@
 `timescale 1ns / 1ps
 
-////////////////////////////////////////////////////////////////////////////////
-// Company: 
-// Engineer:
-//
-// Create Date:   15:13:07 11/30/2011
-// Design Name:   floppyemu
-// Module Name:   C:/Users/steve/Documents/floppyemu/CPLD-Xilinx/testbench.v
-// Project Name:  floppyemu
-// Target Device:  
-// Tool versions:  
-// Description: 
-//
-// Verilog Test Fixture created by ISE for module: floppyemu
-//
-// Dependencies:
-// 
-// Revision:
-// Revision 0.01 - File Created
-// Additional Comments:
-// 
-////////////////////////////////////////////////////////////////////////////////
+/*
+  Floppy Emu, copyright 2013 Steve Chamberlin, "Big Mess o' Wires". All rights reserved.
+
+  Floppy Emu is licensed under a Creative Commons Attribution-NonCommercial 3.0 Unported
+  license. (CC BY-NC 3.0) The terms of the license may be viewed at
+  http://creativecommons.org/licenses/by-nc/3.0/
+
+  Based on a work at http://www.bigmessowires.com/macintosh-floppy-emu/
+
+  Permissions beyond the scope of this license may be available at www.bigmessowires.com
+  or from mailto:steve@bigmessowires.com.
+
+  --------------------------------------------------------------------------------------
+
+  Self-checking testbench for the serial interface in floppyemu-next.v, the unreleased firmware 17, and
+  in floppyemu.v, the released firmware 11 that firmware.xvf is built from. Built with FLOPPYEMU_V11,
+  it runs the tests that firmware 11 can pass, with the handshakes the AVR firmware uses now: GCR and
+  MFM reads with a handshake per byte or nibble and no stall, and the writes without the CRC flag.
+
+  The testbench plays both neighbors of the CPLD: an MCU model that follows the handshakes in
+  floppyemu.cpp, and a Mac model that decodes the read head and generates write bitstreams.
+
+  Read:  the MCU sends a GCR or MFM sector, including a stall that the byte FIFO must absorb. The
+         Mac decodes the falling edges on rd, and the testbench checks the decoded bytes, the
+         position of every edge on the bit cell grid, and the width of every rdHead pulse. The MFM
+         sector is sent twice, with a handshake per nibble and the CRC computed by the MCU, and
+         with the MFM byte handshake and the CPLD's CRC, and the two must produce identical bit
+         cells on rd. The stall must not show up in the CPLD's underrun counter.
+  Underrun: the MCU stalls long enough to run the FIFO dry in a gap, inside a block, and in a block it
+         then abandons, and the underrun counter must count only the stall inside the block.
+  Write: the Mac writes a GCR or MFM sector with random jitter on every transition. The MCU
+         collects wrData on every WR_TICK edge, and the testbench checks the byte framing, the
+         A1 sync detection and mark flags in MFM, and sweeps the jitter to find the margin. In MFM
+         the CPLD must also flag the sector's CRC as good on its last nibble.
+  GCR co-simulation (+gcrsim): the MCU sends the codes of a firmware build with CPLD_GCR_TRANSLATE,
+         and the Mac must read exactly the disk bytes of the standard build, then the Mac writes those
+         disk bytes back and the MCU must receive the codes again. Both byte streams come from the
+         firmware's own encoder, see ../AVR/host/gcrsim.cpp.
+
+  Run with Icarus Verilog (floppyemu-next.v comes first, the testbench uses its defines):
+
+      make sim
+  or
+      iverilog -o testbench.vvp floppyemu-next.v testbench.v && vvp testbench.vvp
+
+  and for the released design:
+
+      make sim-v11
+
+  and for the co-simulation, which builds the design with GCR_TRANSLATE, and also builds the host encoder
+  and writes gcrsim_*.hex:
+
+      make cosim
+
+  The last line printed is PASS or FAIL.
+
+  This testbench hasn't been run through a simulator yet, against either design. Until it has passed,
+  it says nothing about the design, and a failure may be in either file. Against floppyemu.v, a failure
+  is more likely to be in the testbench, since firmware 11 has run on hardware.
+*/
+
+`ifdef FLOPPYEMU_V11
+// firmware 11 takes each byte at the next byte boundary, with no FIFO, and reports no capability bits
+`define BYTE_FIFO_DEPTH			1
+`define FIRMWARE_CAPABILITIES	7'h00
+`endif
+
+`define CLK_PERIOD		50		// 20 MHz CPLD clock
+`define AVR_CYCLE			50		// 20 MHz ATmega1284P
+
+// bit cells generated by the CPLD when reading: the bit timer runs 0-40 (GCR) or 0-20 (MFM)
+`define GCR_READ_CELL	(41 * `CLK_PERIOD)
+`define MFM_READ_CELL	(21 * `CLK_PERIOD)
+// nominal bit cells the Mac expects: 16 clocks at 7.8336 MHz (GCR), 500 kbit/s (MFM)
+`define GCR_MAC_CELL		2042.5
+`define MFM_MAC_CELL		1000.0
+
+// transition jitter on Mac writes that must decode correctly, in ns either way
+`define GCR_JITTER_SPEC	300
+`define MFM_JITTER_SPEC	150
+
+`define PAYLOAD_SIZE		40
+
+// sent and received bytes per test, enough for the co-simulation's sectors
+`define BUF_SIZE			4096
+// MFM read cells recorded after the first sync
+`define CELL_LOG_SIZE		2048
 
 module testbench;
 
-	// Inputs
+	// Macintosh
+	reg ca0, ca1, ca2, lstrb, SEL, _enable, wr, _wreq, pwm;
+	wire rd;
+
+	// microcontroller
 	reg clk;
-	reg wr;
+	reg _rst;
+	reg stepAck_diskInserted;
+	reg driveTach;
+	reg byteReady_tk0;
+	reg outputEnable;
+	reg [6:0] mcuData;
+	wire stepDirectionMotorOn, stepRequest, _wreqMCU, rdAckWrTick, driveCurrentSide, ejectRequest;
+	wire zero, led, test;
+	wire [6:0] data;
 
-	// Outputs
-	wire [7:0] wrData;
-	wire rdAckWrByte;
+	// the MCU drives the data bus unless it has told the CPLD that it's Hi Z
+	assign data = (outputEnable == 1) ? 7'bzzzzzzz : mcuData;
 
-	// Instantiate the Unit Under Test (UUT)
 	floppyemu uut (
-		.clk(clk), 
-		.wr(wr), 
-		.wrData(wrData), 
-		.rdAckWrByte(rdAckWrByte)
+		.clk(clk),
+		.ca0(ca0),
+		.ca1(ca1),
+		.ca2(ca2),
+		.lstrb(lstrb),
+		.SEL(SEL),
+		._enable(_enable),
+		.wr(wr),
+		._wreq(_wreq),
+		.pwm(pwm),
+		.rd(rd),
+		._rst(_rst),
+		.stepDirectionMotorOn(stepDirectionMotorOn),
+		.stepRequest(stepRequest),
+		.stepAck_diskInserted(stepAck_diskInserted),
+		._wreqMCU(_wreqMCU),
+		.rdAckWrTick(rdAckWrTick),
+		.driveCurrentSide(driveCurrentSide),
+		.ejectRequest(ejectRequest),
+		.driveTach(driveTach),
+		.byteReady_tk0(byteReady_tk0),
+		.outputEnable(outputEnable),
+		.data(data),
+		.zero(zero),
+		.led(led),
+		.test(test)
 	);
 
+	always begin
+		#(`CLK_PERIOD/2) clk = ~clk;
+	end
+
+	integer errors;
+	integer seed;
+	integer i;
+	integer start;
+
+	/********** sent and received bytes **********/
+	reg [7:0] txBuf [0:`BUF_SIZE-1];
+	reg txMark [0:`BUF_SIZE-1];
+	integer txCount;
+	reg [7:0] rxBuf [0:`BUF_SIZE-1];
+	reg rxMark [0:`BUF_SIZE-1];
+	integer rxCount;
+
+	task Transmitted;
+		input [7:0] b;
+		input mark;
+	begin
+		txBuf[txCount] = b;
+		txMark[txCount] = mark;
+		txCount = txCount + 1;
+	end
+	endtask
+
+	task Received;
+		input [7:0] b;
+		input mark;
+	begin
+		if (rxCount < `BUF_SIZE) begin
+			rxBuf[rxCount] = b;
+			rxMark[rxCount] = mark;
+			rxCount = rxCount + 1;
+		end
+	end
+	endtask
+
+	// MFM CRC-CCITT
+	function [15:0] CrcByte;
+		input [15:0] c;
+		input [7:0] b;
+		integer k;
+	begin
+		CrcByte = c;
+		for (k = 7; k >= 0; k = k - 1)
+			CrcByte = { CrcByte[14:0], 1'b0 } ^ ((CrcByte[15] ^ b[k]) ? 16'h1021 : 16'h0000);
+	end
+	endfunction
+
+	// Find txBuf[txStart..txStart+2] in the received bytes, and check that everything from there on
+	// arrived in order, with the right mark flags. matchPos is where txBuf[txStart] was found.
+	integer matchPos;
+	task CheckReceived;
+		input [8*16-1:0] name;
+		input integer txStart;
+		input quiet;
+		output ok;
+		integer p, k;
+	begin
+		ok = 1;
+		p = -1;
+		for (k = 0; k + 2 < rxCount && p < 0; k = k + 1) begin
+			if (rxBuf[k] == txBuf[txStart] && rxBuf[k+1] == txBuf[txStart+1] && rxBuf[k+2] == txBuf[txStart+2])
+				p = k;
+		end
+		matchPos = p;
+
+		if (p < 0) begin
+			ok = 0;
+			if (!quiet)
+				$display("  %0s: %02h %02h %02h not found in %0d received bytes", name, txBuf[txStart], txBuf[txStart+1], txBuf[txStart+2], rxCount);
+		end
+		else begin
+			for (k = txStart; k < txCount && ok; k = k + 1) begin
+				if (p + k - txStart >= rxCount) begin
+					ok = 0;
+					if (!quiet)
+						$display("  %0s: only %0d of %0d bytes received", name, k - txStart, txCount - txStart);
+				end
+				else if (rxBuf[p + k - txStart] != txBuf[k] || rxMark[p + k - txStart] != txMark[k]) begin
+					ok = 0;
+					if (!quiet)
+						$display("  %0s: byte %0d is %02h%0s, expected %02h%0s", name, k - txStart,
+							rxBuf[p + k - txStart], rxMark[p + k - txStart] ? " (mark)" : "", txBuf[k], txMark[k] ? " (mark)" : "");
+				end
+			end
+		end
+	end
+	endtask
+
+	/********** MCU model **********/
+
+	// reset the CPLD, check its version number, load the config options, and insert the disk
+	task ResetCPLD;
+		input mfm;
+		input translate;
+		input pairs;
+	begin
+		byteReady_tk0 = 0;
+		stepAck_diskInserted = 1;
+		_wreq = 1;
+		outputEnable = 1;
+		_rst = 0;
+		#(10*`CLK_PERIOD);
+		if (data !== (`FIRMWARE_VERSION_NUMBER | `FIRMWARE_CAPABILITIES)) begin
+			$display("  version byte is %h, expected %h", data, `FIRMWARE_VERSION_NUMBER | `FIRMWARE_CAPABILITIES);
+			errors = errors + 1;
+		end
+		outputEnable = 0;
+		_rst = 1;
+
+		// data[0]: 1 = not write protected, data[1]: 1 = GCR, data[2]: 1 = GCR translation,
+		// data[3]: 1 = MFM byte handshake, data[4]: 1 = double density MFM (0 here)
+		mcuData = { 3'b000, pairs, translate, ~mfm, 1'b1 };
+		byteReady_tk0 = 1;
+		#50000;
+		byteReady_tk0 = 0;
+		#(10*`CLK_PERIOD);
+`ifdef FLOPPYEMU_V11
+		if (uut._driveRegMFMMode !== ~mfm || uut._driveRegWriteProtect !== 1) begin
+`else
+		if (uut._driveRegMFMMode !== ~mfm || uut._driveRegWriteProtect !== 1 || uut.mfmBytePairs !== pairs || uut.mfmDoubleDensity !== 0) begin
+`endif
+			$display("  config byte was not loaded");
+			errors = errors + 1;
+		end
+`ifdef GCR_TRANSLATE
+		if (uut.gcrTranslate !== translate) begin
+			$display("  GCR translation config bit was not loaded");
+			errors = errors + 1;
+		end
+`endif
+
+		stepAck_diskInserted = 0;
+		#(10*`CLK_PERIOD);
+	end
+	endtask
+
+	// PutCpldByte() in floppyemu.cpp
+	task PutCpldByte;
+		input [6:0] b;
+	begin
+		mcuData = b;
+		#(`AVR_CYCLE) byteReady_tk0 = 1;
+		wait (rdAckWrTick == 1);
+		wait (rdAckWrTick == 0);
+		#(2*`AVR_CYCLE) byteReady_tk0 = 0;
+		// call overhead and encoding work for the next byte
+		#(8*`AVR_CYCLE);
+	end
+	endtask
+
+	// the MFM byte handshake of floppyemu-next.v, which floppyemu.cpp doesn't use yet: the first nibble is taken when byteReady rises, the second when it falls
+	task PutCpldNibbles;
+		input [6:0] high;
+		input [6:0] low;
+	begin
+		wait (rdAckWrTick == 0);
+		mcuData = high;
+		#(`AVR_CYCLE) byteReady_tk0 = 1;
+		wait (rdAckWrTick == 1);
+		#(2*`AVR_CYCLE) mcuData = low;
+		#(`AVR_CYCLE) byteReady_tk0 = 0;
+		// call overhead and CRC update
+		#(12*`AVR_CYCLE);
+	end
+	endtask
+
+	// a random byte that could appear in a GCR data field: MSB set, and never more than two 0 bits in a row
+	task RandomGCRByte;
+		output [7:0] b;
+	begin
+		b = $random(seed) | 8'h80;
+		while (b[6:4] == 0 || b[5:3] == 0 || b[4:2] == 0 || b[3:1] == 0 || b[2:0] == 0)
+			b = $random(seed) | 8'h80;
+	end
+	endtask
+
+	task SendGCRByte;
+		input [7:0] b;
+	begin
+		Transmitted(b, 0);
+		PutCpldByte(b[6:0]);
+	end
+	endtask
+
+	reg mcuPairs;
+	reg mcuCPLDCRC;
+	reg [15:0] mcuCrc;
+
+	// the two nibbles of an MFM byte, on one handshake each like floppyemu.cpp, or on the byte handshake
+	task SendMFMNibbles;
+		input [6:0] high;
+		input [6:0] low;
+	begin
+		if (mcuPairs)
+			PutCpldNibbles(high, low);
+		else begin
+			PutCpldByte(high);
+			PutCpldByte(low);
+		end
+	end
+	endtask
+
+	task SendMFMByte;
+		input [7:0] b;
+	begin
+		Transmitted(b, 0);
+		mcuCrc = CrcByte(mcuCrc, b);
+		SendMFMNibbles({ 3'b000, b[7:4] }, { 3'b000, b[3:0] });
+	end
+	endtask
+
+	// the first byte of a gap, with bit 5 set to start a new stream for floppyemu-next.v's underrun counter.
+	// Firmware 11 ignores bit 5.
+	task SendMFMGapStart;
+	begin
+		Transmitted(8'h4E, 0);
+		mcuCrc = CrcByte(mcuCrc, 8'h4E);
+		SendMFMNibbles(7'h24, 7'h0E);
+	end
+	endtask
+
+	// the three A1 syncs, the first restarting the CRC
+	task SendMFMSyncs;
+		integer k;
+	begin
+		mcuCrc = 16'hFFFF;
+		for (k = 0; k < 3; k = k + 1) begin
+			Transmitted(8'hA1, 1);
+			mcuCrc = CrcByte(mcuCrc, 8'hA1);
+			SendMFMNibbles((k == 0 && mcuCPLDCRC) ? 7'h2A : 7'h0A, 7'h11);
+		end
+	end
+	endtask
+
+	// the CRC is sent by the MCU, or shifted out of the CPLD
+	task SendMFMCRC;
+		reg [15:0] c;
+	begin
+		c = mcuCrc;
+		if (mcuCPLDCRC) begin
+			Transmitted(c[15:8], 0);
+			Transmitted(c[7:0], 0);
+			SendMFMNibbles(7'h40, 7'h40);
+			SendMFMNibbles(7'h40, 7'h40);
+		end
+		else begin
+			SendMFMByte(c[15:8]);
+			SendMFMByte(c[7:0]);
+		end
+	end
+	endtask
+
+	// read floppyemu-next.v's underrun counter, which floppyemu.cpp doesn't use yet
+	task ReadUnderruns;
+		output [6:0] n;
+	begin
+		outputEnable = 1;
+		#(`AVR_CYCLE) byteReady_tk0 = 1;
+		#(20*`AVR_CYCLE) n = data;
+		byteReady_tk0 = 0;
+		#(`AVR_CYCLE) outputEnable = 0;
+		#(`AVR_CYCLE);
+	end
+	endtask
+
+	// the rdAck pulse must be long enough to be seen by the AVR's 3 cycle polling loop
+	real ackRise;
+	always @(posedge rdAckWrTick) begin
+		ackRise = $realtime;
+	end
+	always @(negedge rdAckWrTick) begin
+		if (_wreq == 1 && _rst == 1 && $realtime - ackRise < 4*`AVR_CYCLE) begin
+			$display("  rdAck pulse of %0.0f ns at %0t is too short for the MCU", $realtime - ackRise, $time);
+			errors = errors + 1;
+		end
+	end
+
+	// collect wrData on every WR_TICK edge, like ISR(PCINT0_vect)
+	reg writing;
+	reg writeMFM;
+	reg writeTranslated;
+	reg [3:0] writeHigh;
+	reg rxCrcGood [0:`BUF_SIZE-1];
+	always @(rdAckWrTick) begin
+		if (writing) begin
+			#1;
+			if (writeTranslated) begin
+				// GCR translated by the CPLD: the 7-bit code
+				Received({ 1'b0, data }, 0);
+			end
+			else if (!writeMFM) begin
+				// GCR: the MSB is always 1
+				Received({ 1'b1, data }, 0);
+			end
+			else if (rdAckWrTick == 0) begin
+				// MFM: high nibble arrives first
+				writeHigh = data[3:0];
+			end
+			else begin
+				// a missing clock between d3 and d2 marks an A1 sync
+				rxCrcGood[rxCount] = data[5];
+				Received({ writeHigh, data[3:0] }, data[4] != ~(data[3] | data[2]));
+			end
+		end
+	end
+
+	/********** Mac read model **********/
+	reg reading;
+	reg readMFM;
+	reg haveEdge;
+	real lastFall;
+	real readCell;
+	real delta;
+	real residual;
+	real maxResidual;
+	integer cells;
+	integer c;
+	reg [7:0] gcrShift;
+	reg [15:0] mfmCells;
+	integer mfmCount;
+	reg mfmSynced;
+	reg cellLog [0:`CELL_LOG_SIZE-1];
+	integer cellCount;
+
+	function [7:0] MFMData;
+		input [15:0] m;
+	begin
+		MFMData = { m[14], m[12], m[10], m[8], m[6], m[4], m[2], m[0] };
+	end
+	endfunction
+
+	task ReadCell;
+		input b;
+	begin
+		if (!readMFM) begin
+			// GCR: shift in bits until the MSB is set, the same way the IWM frames bytes
+			gcrShift = { gcrShift[6:0], b };
+			if (gcrShift[7]) begin
+				Received(gcrShift, 0);
+				gcrShift = 0;
+			end
+		end
+		else begin
+			// MFM: frame the data on the A1 sync pattern, then take every other cell
+			if (mfmSynced && cellCount < `CELL_LOG_SIZE) begin
+				cellLog[cellCount] = b;
+				cellCount = cellCount + 1;
+			end
+			mfmCells = { mfmCells[14:0], b };
+			mfmCount = mfmCount + 1;
+			if (mfmCells == 16'h4489) begin
+				Received(8'hA1, 1);
+				mfmSynced = 1;
+				mfmCount = 0;
+			end
+			else if (mfmSynced && mfmCount == 16) begin
+				Received(MFMData(mfmCells), 0);
+				mfmCount = 0;
+			end
+		end
+	end
+	endtask
+
+	// a logical 1 is a falling edge on the read head at a bit cell boundary
+	always @(negedge rd) begin
+		if (reading) begin
+			if (haveEdge) begin
+				delta = $realtime - lastFall;
+				cells = delta / readCell; // rounds to the nearest cell
+				residual = delta - cells * readCell;
+				if (residual < 0)
+					residual = -residual;
+				if (residual > maxResidual)
+					maxResidual = residual;
+				for (c = 1; c < cells; c = c + 1)
+					ReadCell(0);
+				ReadCell(1);
+			end
+			haveEdge = 1;
+			lastFall = $realtime;
+		end
+	end
+
+	// rdHead pulse: low at bit timer 2, high again at 20 (GCR) or 7 (MFM)
+	always @(posedge rd) begin
+		if (reading && haveEdge && $realtime - lastFall != (readMFM ? 5 : 18) * `CLK_PERIOD) begin
+			$display("  rdHead low for %0.0f ns at %0t, expected %0d", $realtime - lastFall, $time, (readMFM ? 5 : 18) * `CLK_PERIOD);
+			errors = errors + 1;
+		end
+	end
+
+	task ReadTest;
+		input mfm;
+		input pairs;
+		input cpldCRC;
+		output integer txStart;
+		reg ok;
+		real stall;
+		reg [7:0] b;
+		reg [6:0] underruns;
+	begin
+		ResetCPLD(mfm, 0, pairs);
+		mcuPairs = pairs;
+		mcuCPLDCRC = cpldCRC;
+
+		readMFM = mfm;
+		readCell = mfm ? `MFM_READ_CELL : `GCR_READ_CELL;
+		rxCount = 0;
+		txCount = 0;
+		haveEdge = 0;
+		maxResidual = 0;
+		gcrShift = 0;
+		mfmCells = 0;
+		mfmCount = 0;
+		mfmSynced = 0;
+		cellCount = 0;
+		reading = 1;
+
+		// one FIFO entry is a GCR byte or an MFM nibble, 8 bit cells either way
+		stall = (`BYTE_FIFO_DEPTH - 1) * 8 * readCell;
+
+		if (!mfm) begin
+			for (i = 0; i < 5; i = i + 1)
+				SendGCRByte(8'hFF);
+			txStart = txCount;
+			SendGCRByte(8'hD5);
+			SendGCRByte(8'hAA);
+			SendGCRByte(8'hAD);
+			for (i = 0; i < `PAYLOAD_SIZE; i = i + 1) begin
+				if (i == `PAYLOAD_SIZE/2)
+					#(stall);
+				RandomGCRByte(b);
+				SendGCRByte(b);
+			end
+			SendGCRByte(8'hDE);
+			SendGCRByte(8'hAA);
+			SendGCRByte(8'hFF);
+		end
+		else begin
+			SendMFMGapStart();
+			for (i = 1; i < 4; i = i + 1)
+				SendMFMByte(8'h4E);
+			for (i = 0; i < 12; i = i + 1)
+				SendMFMByte(8'h00);
+			txStart = txCount;
+			SendMFMSyncs();
+			SendMFMByte(8'hFB);
+			for (i = 0; i < `PAYLOAD_SIZE; i = i + 1) begin
+				if (i == `PAYLOAD_SIZE/2)
+					#(stall);
+				SendMFMByte($random(seed));
+			end
+			SendMFMCRC();
+			SendMFMByte(8'h4E);
+		end
+
+		// wait for the FIFO and the shifter to drain
+		#((`BYTE_FIFO_DEPTH + 4) * 16 * readCell);
+		reading = 0;
+
+		CheckReceived(mfm ? "MFM read" : "GCR read", txStart, 0, ok);
+		if (!ok)
+			errors = errors + 1;
+		if (maxResidual > 0) begin
+			$display("  read edges are up to %0.0f ns off the bit cell grid", maxResidual);
+			errors = errors + 1;
+		end
+`ifndef FLOPPYEMU_V11
+		ReadUnderruns(underruns);
+		if (underruns !== 0) begin
+			$display("  %0d underruns counted for a stall that the FIFO absorbed", underruns);
+			errors = errors + 1;
+		end
+`endif
+
+		$display("%0s read%0s%0s: %0s, bit cell %0.0f ns (%0.1f%% from the Mac's %0.1f ns), %0.1f us stall absorbed by a %0d byte FIFO",
+			mfm ? "MFM" : "GCR", pairs ? " with byte handshake" : "", cpldCRC ? " and CPLD CRC" : "", ok ? "ok" : "FAILED", readCell,
+			100.0 * (readCell - (mfm ? `MFM_MAC_CELL : `GCR_MAC_CELL)) / (mfm ? `MFM_MAC_CELL : `GCR_MAC_CELL),
+			mfm ? `MFM_MAC_CELL : `GCR_MAC_CELL, stall / 1000.0, `BYTE_FIFO_DEPTH);
+	end
+	endtask
+
+	// Stall long enough to run the FIFO dry in a gap, inside a block, after a block, and in a block that is then
+	// abandoned for a new sector, like after a step. Only the stall inside the block is an underrun.
+	task UnderrunTest;
+		input mfm;
+		real stall;
+		reg [7:0] b;
+		reg [6:0] underruns;
+	begin
+		ResetCPLD(mfm, 0, mfm);
+		mcuPairs = mfm;
+		mcuCPLDCRC = mfm;
+		readCell = mfm ? `MFM_READ_CELL : `GCR_READ_CELL;
+		txCount = 0;
+		stall = (`BYTE_FIFO_DEPTH + 4) * 8 * readCell;
+
+		if (!mfm) begin
+			for (i = 0; i < 10; i = i + 1) begin
+				if (i == 5)
+					#(stall);
+				SendGCRByte(8'hFF);
+			end
+			SendGCRByte(8'hD5);
+			SendGCRByte(8'hAA);
+			SendGCRByte(8'hAD);
+			for (i = 0; i < 20; i = i + 1) begin
+				RandomGCRByte(b);
+				if (i == 10) begin
+					#(stall);
+					// an FF in the data would end the block
+					b = 8'h96;
+				end
+				SendGCRByte(b);
+			end
+			SendGCRByte(8'hDE);
+			SendGCRByte(8'hAA);
+			SendGCRByte(8'hFF);
+			#(stall);
+			for (i = 0; i < 5; i = i + 1)
+				SendGCRByte(8'hFF);
+			SendGCRByte(8'hD5);
+			SendGCRByte(8'hAA);
+			SendGCRByte(8'h96);
+			SendGCRByte(8'h96);
+			#(stall);
+			for (i = 0; i < 5; i = i + 1)
+				SendGCRByte(8'hFF);
+		end
+		else begin
+			SendMFMGapStart();
+			for (i = 1; i < 4; i = i + 1)
+				SendMFMByte(8'h4E);
+			#(stall);
+			for (i = 0; i < 12; i = i + 1)
+				SendMFMByte(8'h00);
+			SendMFMSyncs();
+			SendMFMByte(8'hFB);
+			for (i = 0; i < 20; i = i + 1) begin
+				if (i == 10)
+					#(stall);
+				SendMFMByte($random(seed));
+			end
+			SendMFMCRC();
+			#(stall);
+			SendMFMGapStart();
+			for (i = 0; i < 12; i = i + 1)
+				SendMFMByte(8'h00);
+			SendMFMSyncs();
+			SendMFMByte(8'hFE);
+			SendMFMByte(8'h00);
+			#(stall);
+			SendMFMGapStart();
+			for (i = 0; i < 4; i = i + 1)
+				SendMFMByte(8'h4E);
+		end
+
+		#((`BYTE_FIFO_DEPTH + 4) * 16 * readCell);
+		ReadUnderruns(underruns);
+		if (underruns !== 1) begin
+			$display("  %0s: %0d underruns counted, expected 1", mfm ? "MFM" : "GCR", underruns);
+			errors = errors + 1;
+		end
+		$display("%0s underrun counter: %0s, %0d of 4 stalls counted", mfm ? "MFM" : "GCR", underruns === 1 ? "ok" : "FAILED", underruns);
+	end
+	endtask
+
+	/********** Mac write model **********/
+	real writeCell;
+	real nextCell;
+	integer jitter;
+	reg prevBit;
+
+	// write one bit cell, with the transition moved by up to +/- jitter ns
+	task MacWriteCell;
+		input b;
+		real t;
+	begin
+		if (b) begin
+			t = nextCell + ($random(seed) % (jitter + 1));
+			if (t > $realtime)
+				#(t - $realtime);
+			if (!writeMFM) begin
+				// GCR: a logical 1 is any transition
+				wr = ~wr;
+			end
+			else begin
+				// MFM: a logical 1 is a falling edge
+				wr = 0;
+				#(writeCell / 4) wr = 1;
+			end
+		end
+		nextCell = nextCell + writeCell;
+	end
+	endtask
+
+	task MacWriteGCR;
+		input [7:0] b;
+		input sync;
+		integer k;
+	begin
+		for (k = 7; k >= 0; k = k - 1)
+			MacWriteCell(b[k]);
+		// self-sync bytes are 10 bits long
+		if (sync) begin
+			MacWriteCell(0);
+			MacWriteCell(0);
+		end
+		Transmitted(b, 0);
+	end
+	endtask
+
+	task MacWriteMFM;
+		input [7:0] b;
+		integer k;
+	begin
+		for (k = 7; k >= 0; k = k - 1) begin
+			MacWriteCell(~(prevBit | b[k]));
+			MacWriteCell(b[k]);
+			prevBit = b[k];
+		end
+		Transmitted(b, 0);
+	end
+	endtask
+
+	task MacWriteMFMSync;
+		integer k;
+		reg [15:0] sync;
+	begin
+		sync = 16'h4489;
+		for (k = 15; k >= 0; k = k - 1)
+			MacWriteCell(sync[k]);
+		prevBit = 1;
+		Transmitted(8'hA1, 1);
+	end
+	endtask
+
+	task WriteTest;
+		input mfm;
+		input integer jitterNs;
+		input quiet;
+		output ok;
+		integer txStart;
+		integer crcEnd;
+		reg [7:0] b;
+		reg [15:0] c;
+	begin
+		ResetCPLD(mfm, 0, 0);
+
+		writeMFM = mfm;
+		writeCell = mfm ? `MFM_MAC_CELL : `GCR_MAC_CELL;
+		jitter = jitterNs;
+		rxCount = 0;
+		txCount = 0;
+
+		// the firmware releases the data bus when _wreqMCU goes low
+		writing = 1;
+		outputEnable = 1;
+		_wreq = 0;
+		nextCell = $realtime + 5000;
+
+		if (!mfm) begin
+			for (i = 0; i < 5; i = i + 1)
+				MacWriteGCR(8'hFF, 1);
+			txStart = txCount;
+			MacWriteGCR(8'hD5, 0);
+			MacWriteGCR(8'hAA, 0);
+			MacWriteGCR(8'hAD, 0);
+			for (i = 0; i < `PAYLOAD_SIZE; i = i + 1) begin
+				RandomGCRByte(b);
+				MacWriteGCR(b, 0);
+			end
+			MacWriteGCR(8'hDE, 0);
+			MacWriteGCR(8'hAA, 0);
+			MacWriteGCR(8'hFF, 0);
+		end
+		else begin
+			// start at a random phase, so the CPLD has to find the byte boundaries from the A1 syncs
+			prevBit = 0;
+			for (i = $random(seed) & 15; i > 0; i = i - 1)
+				MacWriteCell(i & 1);
+			for (i = 0; i < 4; i = i + 1)
+				MacWriteMFM(8'h4E);
+			for (i = 0; i < 12; i = i + 1)
+				MacWriteMFM(8'h00);
+			MacWriteMFMSync();
+			// the first A1 frames the bytes, so only its second nibble reaches the MCU
+			txStart = txCount;
+			MacWriteMFMSync();
+			MacWriteMFMSync();
+			MacWriteMFM(8'hFB);
+			for (i = 0; i < `PAYLOAD_SIZE; i = i + 1)
+				MacWriteMFM($random(seed));
+			c = 16'hFFFF;
+			for (i = txStart - 1; i < txCount; i = i + 1)
+				c = CrcByte(c, txBuf[i]);
+			MacWriteMFM(c[15:8]);
+			MacWriteMFM(c[7:0]);
+			crcEnd = txCount - 1;
+			MacWriteMFM(8'h4E);
+			MacWriteMFM(8'h4E);
+		end
+
+		#(4 * writeCell);
+		_wreq = 1;
+		#(10*`CLK_PERIOD);
+		writing = 0;
+		outputEnable = 0;
+
+		CheckReceived(mfm ? "MFM write" : "GCR write", txStart, quiet, ok);
+
+`ifndef FLOPPYEMU_V11
+		// the CPLD's CRC includes the received CRC, so it's 0 after the last nibble
+		if (ok && mfm && rxCrcGood[matchPos + crcEnd - txStart] !== 1) begin
+			ok = 0;
+			if (!quiet)
+				$display("  MFM write: the CPLD did not flag the CRC as good");
+		end
+`endif
+	end
+	endtask
+
+	// find the largest transition jitter that still decodes correctly
+	task WriteMarginTest;
+		input mfm;
+		integer spec, step, j, margin;
+		reg ok;
+	begin
+		spec = mfm ? `MFM_JITTER_SPEC : `GCR_JITTER_SPEC;
+		step = mfm ? 25 : 50;
+
+		WriteTest(mfm, 0, 0, ok);
+		if (!ok)
+			errors = errors + 1;
+
+		margin = 0;
+		for (j = step; ok && j <= 4 * spec; j = j + step) begin
+			WriteTest(mfm, j, 1, ok);
+			if (ok)
+				margin = j;
+		end
+
+		if (margin < spec) begin
+			$display("  %0s write failed with +/-%0d ns of jitter, +/-%0d ns is required", mfm ? "MFM" : "GCR", margin + step, spec);
+			errors = errors + 1;
+		end
+
+		$display("%0s write: %0s, transitions decode with up to +/-%0d ns of jitter (%0.0f%% of the %0.1f ns bit cell)",
+			mfm ? "MFM" : "GCR", margin >= spec ? "ok" : "FAILED", margin, 100.0 * margin / writeCell, writeCell);
+	end
+	endtask
+
+	/********** MFM byte handshake and CRC **********/
+	reg refLog [0:`CELL_LOG_SIZE-1];
+
+	// Send the same MFM sector the old way, with a handshake per nibble and the CRC from the MCU, and with
+	// the byte handshake and the CPLD's CRC. Compare the bit cells on rd from the first sync on.
+	task MFMOffloadTest;
+		integer txStart, cells, refCount, k, firstDiff;
+	begin
+		seed = 100;
+		ReadTest(1, 0, 0, txStart);
+		refCount = cellCount;
+		for (k = 0; k < refCount; k = k + 1)
+			refLog[k] = cellLog[k];
+
+		seed = 100;
+		ReadTest(1, 1, 1, txStart);
+
+		// every byte after the first sync, without the sync bytes the CPLD inserts once the FIFO runs dry
+		cells = (txCount - txStart - 1) * 16;
+		firstDiff = -1;
+		for (k = 0; k < cells && firstDiff < 0; k = k + 1) begin
+			if (k >= refCount || k >= cellCount || refLog[k] !== cellLog[k])
+				firstDiff = k;
+		end
+
+		if (firstDiff >= 0) begin
+			$display("  MFM byte handshake and CPLD CRC: rd differs from the nibble handshake at cell %0d of %0d", firstDiff, cells);
+			errors = errors + 1;
+		end
+		$display("MFM byte handshake and CPLD CRC: %0s, %0d bit cells identical to the nibble handshake and MCU CRC",
+			firstDiff < 0 ? "ok" : "FAILED", firstDiff < 0 ? cells : firstDiff);
+	end
+	endtask
+
+	/********** GCR translation co-simulation **********/
+	reg [7:0] cosimCode [0:`BUF_SIZE-1];
+	reg [7:0] cosimDisk [0:`BUF_SIZE-1];
+	integer cosimCount;
+
+	task GCRCosimTest;
+		reg readOk, writeOk;
+		integer n;
+	begin
+		// what the firmware sends with and without CPLD_GCR_TRANSLATE, one byte per line
+		for (i = 0; i < `BUF_SIZE; i = i + 1) begin
+			cosimCode[i] = 8'hxx;
+			cosimDisk[i] = 8'hxx;
+		end
+		$readmemh("gcrsim_cpld.hex", cosimCode);
+		$readmemh("gcrsim_disk.hex", cosimDisk);
+		cosimCount = 0;
+		while (cosimCount < `BUF_SIZE && cosimCode[cosimCount] !== 8'hxx)
+			cosimCount = cosimCount + 1;
+		n = 0;
+		while (n < `BUF_SIZE && cosimDisk[n] !== 8'hxx)
+			n = n + 1;
+		if (cosimCount == 0 || n != cosimCount) begin
+			$display("  co-simulation input has %0d codes and %0d disk bytes, run make cosim", cosimCount, n);
+			errors = errors + 1;
+		end
+
+		// read: the translated codes must come out as the standard build's disk bytes
+		ResetCPLD(0, 1, 0);
+		readMFM = 0;
+		readCell = `GCR_READ_CELL;
+		rxCount = 0;
+		txCount = 0;
+		haveEdge = 0;
+		maxResidual = 0;
+		gcrShift = 0;
+		reading = 1;
+
+		for (i = 0; i < cosimCount; i = i + 1) begin
+			Transmitted(cosimDisk[i], 0);
+			PutCpldByte(cosimCode[i][6:0]);
+		end
+
+		#((`BYTE_FIFO_DEPTH + 4) * 16 * readCell);
+		reading = 0;
+
+		// skip the leading sync bytes, which the Mac's decoder is still framing
+		CheckReceived("GCR cosim read", 5, 0, readOk);
+		if (!readOk)
+			errors = errors + 1;
+
+		// write: the Mac writes the disk bytes, and the MCU must receive the codes
+		ResetCPLD(0, 1, 0);
+		writeMFM = 0;
+		writeTranslated = 1;
+		writeCell = `GCR_MAC_CELL;
+		jitter = 0;
+		rxCount = 0;
+		txCount = 0;
+
+		writing = 1;
+		outputEnable = 1;
+		_wreq = 0;
+		nextCell = $realtime + 5000;
+
+		for (i = 0; i < cosimCount; i = i + 1) begin
+			MacWriteGCR(cosimDisk[i], i < 5);
+			txBuf[txCount-1] = { 1'b0, cosimCode[i][6:0] };
+		end
+
+		#(4 * writeCell);
+		_wreq = 1;
+		#(10*`CLK_PERIOD);
+		writing = 0;
+		writeTranslated = 0;
+		outputEnable = 0;
+
+		CheckReceived("GCR cosim write", 5, 0, writeOk);
+		if (!writeOk)
+			errors = errors + 1;
+
+		$display("GCR co-simulation: read %0s, write %0s, %0d bytes from the firmware's encoder",
+			readOk ? "ok" : "FAILED", writeOk ? "ok" : "FAILED", cosimCount);
+	end
+	endtask
+
 	initial begin
-		clk = 0;		
+		if ($test$plusargs("vcd")) begin
+			$dumpfile("testbench.vcd");
+			$dumpvars(0, testbench);
+		end
 	end
-	
-	always begin
-		#70 clk = 1;
-		#70 clk = 0;
+
+	// nothing here should take more than a few tens of ms, or about 100 ms with the co-simulation
+	initial begin
+		#400000000;
+		$display("FAIL: timeout");
+		$finish;
 	end
-	
+
 	initial begin
-		// Initialize Inputs
-		wr = 0;
-
-		// Wait 100 ns for global reset to finish
-		#4000;
-        
-		// send 10-bit sync byte
-		#2000 wr = ~wr;
-		#2000 wr = ~wr;
-		#2000 wr = ~wr;
-		#2000 wr = ~wr;
-		#2000 wr = ~wr;
-		#2000 wr = ~wr;
-		#2000 wr = ~wr;
-		#2000 wr = ~wr;
-		#2000 ;
-		#2000 ;
-		
-		// send 10-bit sync byte
-		#2000 wr = ~wr;
-		#2000 wr = ~wr;
-		#2000 wr = ~wr;
-		#2000 wr = ~wr;
-		#2000 wr = ~wr;
-		#2000 wr = ~wr;
-		#2000 wr = ~wr;
-		#2000 wr = ~wr;
-		#2000 ;
-		#2000 ;
-
-		// send 10-bit sync byte
-		#2000 wr = ~wr;
-		#2000 wr = ~wr;
-		#2000 wr = ~wr;
-		#2000 wr = ~wr;
-		#2000 wr = ~wr;
-		#2000 wr = ~wr;
-		#2000 wr = ~wr;
-		#2000 wr = ~wr;
-		#2000 ;
-		#2000 ;
-
-		// send 10-bit sync byte
-		#2000 wr = ~wr;
-		#2000 wr = ~wr;
-		#2000 wr = ~wr;
-		#2000 wr = ~wr;
-		#2000 wr = ~wr;
-		#2000 wr = ~wr;
-		#2000 wr = ~wr;
-		#2000 wr = ~wr;
-		#2000 ;
-		#2000 ;
-
-		// send 10-bit sync byte
-		#2000 wr = ~wr;
-		#2000 wr = ~wr;
-		#2000 wr = ~wr;
-		#2000 wr = ~wr;
-		#2000 wr = ~wr;
-		#2000 wr = ~wr;
-		#2000 wr = ~wr;
-		#2000 wr = ~wr;
-		#2000 ;
-		#2000	 ;
-
-		// D5 = 1101 0101
-		#2000 wr = ~wr;
-		#2000 wr = ~wr;
-		#2000 ;
-		#2000 wr = ~wr;
-		#2000 ;
-		#2000 wr = ~wr;
-		#2000 ;
-		#2000 wr = ~wr;
-		
-		// AA = 1010 1010
-		#2000 wr = ~wr;
-		#2000 ;
-		#2000 wr = ~wr;
-		#2000 ;
-		#2000 wr = ~wr;
-		#2000 ;
-		#2000 wr = ~wr;
-		#2000 ;
-		
-		// 96 = 1001 0110
-		#2000 wr = ~wr;
-		#2000 ;
-		#2000 ;
-		#2000 wr = ~wr;
-		#2000 ;
-		#2000 wr = ~wr;
-		#2000 wr = ~wr;
-		#2000	;
-		
-		// 96 = 1001 0110
-		#2000 wr = ~wr;
-		#2000 ;
-		#2000 ;
-		#2000 wr = ~wr;
-		#2000 ;
-		#2000 wr = ~wr;
-		#2000 wr = ~wr;
-		#2000	;
-		
-		$stop;
-	end
-      
-endmodule
+		// XC9500XL macrocells power up cleared, and the serial interface registers have no reset term
+		uut.shifter = 0;
+		uut.bitTimer = 0;
+		uut.bitCounter = 0;
+		uut.rdHead = 0;
+		uut.wrHistory = 0;
+		uut.lstrbHistory = 0;
+
+		errors = 0;
+		seed = 1;
+		reading = 0;
+		writing = 0;
+		writeTranslated = 0;
+		mcuPairs = 0;
+		mcuCPLDCRC = 0;
+
+		clk = 0;
+		_rst = 0;
+		stepAck_diskInserted = 1;
+		driveTach = 0;
+		byteReady_tk0 = 0;
+		outputEnable = 1;
+		mcuData = 0;
+
+		// the Mac has the drive enabled and reads RDDATA0, the lower head
+		_enable = 0;
+		ca2 = 1;
+		ca1 = 0;
+		ca0 = 0;
+		SEL = 0;
+		lstrb = 0;
+		wr = 1;
+		_wreq = 1;
+		pwm = 0;
 
+		ReadTest(0, 0, 0, start);
+`ifdef FLOPPYEMU_V11
+		// firmware 11 has no MFM byte handshake, CRC or underrun counter
+		ReadTest(1, 0, 0, start);
+`else
+		MFMOffloadTest;
+		UnderrunTest(0);
+		UnderrunTest(1);
+`endif
+		WriteMarginTest(0);
+		WriteMarginTest(1);
+		if ($test$plusargs("gcrsim")) begin
+`ifdef GCR_TRANSLATE
+			GCRCosimTest;
+`else
+			$display("  the GCR co-simulation needs a build with GCR_TRANSLATE");
+			errors = errors + 1;
+`endif
+		end
+
+		if (errors == 0)
+			$display("PASS");
+		else
+			$display("FAIL: %0d errors", errors);
+		$finish;
+	end
+
+endmodule